@@ -9,42 +9,56 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <ulockmgr.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sys/random.h>
 
 #include <mcrypt.h>
 #include <mhash.h>
 
+#include "new/bitmap.h"
+#include "new/uring.h"
+
 #include <termios.h>
 
 
-#define SIGNATURE "RndAllV0"
+#define SIGNATURE "RndAllV2"
+#define SIGNATURE_V1 "RndAllV1" /* same table, records not compacted, still loaded */
+#define SIGNATURE_V0 "RndAllV0" /* old chained directory format, still loaded */
 #define BLOCK_HEADER_SIZE 16
 
 int block_count;
 int block_size;
-FILE* rnd;
 int data;
-const char* rnd_name;
+const char* rnd_name; /* NULL - seed from getrandom */
 const char* data_name;
 
 int readonly_flag;
-volatile int dirty_status;
+int no_o_direct;
+volatile int dirty_status; /* updated atomically */
 volatile int dirty_bytes;
-int alarm_triggered;
 
 int max_dirty_bytes;
 int max_dirty_calls;
-int dirty_alarm_timeout;
+int dirty_expire_timeout; /* seconds a change may stay unsaved */
 int no_shred;
 int no_sync;
 int reserved_percent;
@@ -52,38 +66,265 @@ int reserved_percent;
 int user_first_block;
 
 /* 0 - free, 1 - busy */
-unsigned char *busy_map;
+struct bitmap *busy_map;
 int busy_blocks_count;
 
-int *saved_directory_blocks;
-int saved_directory_blocks_size;
+/* Blocks of the saved directory no longer used by the in-memory layout, freed after the next checkpoint */
+int *stale_directory_blocks;
+int stale_directory_blocks_count;
+int stale_directory_blocks_size;
+
+/*
+   Metadata journal (see README): changes since the last checkpoint (full save of the directory) 
+   are appended to a chain of journal blocks starting at the block listed in the root.
+   Protected by save_lock, except journal_ops.
+*/
+int journal_max_blocks = 128; /* checkpoint when the journal would grow beyond it, 0 - no journal */
+uint64_t journal_epoch;       /* random for each checkpoint, journal blocks of other ones are not valid */
+int journal_next_block = -1;  /* where the next journal block goes, -1 - no journal until the next checkpoint */
+int journal_seq;              /* sequence number of the next journal block */
+int journal_blocks_count;     /* written since the checkpoint */
+/* Records of creations, removals and renames not committed yet, protected by tree_lock */
+unsigned char* journal_ops;
+int journal_ops_len;
+int journal_ops_size;
+/* While replaying the journal, released blocks are collected here (see journal_replay) */
+int journal_replaying;
+int* replay_released;
+int replay_released_count;
+int replay_released_size;
+
+/*
+   Locking (MULTITHREADED mode), always taken in this order:
+     save_lock    - serializes save_entries and protects the directory layout (dir_slots, dir_table, 
+                    stale_directory_blocks, saved_in of the entries). Tree operations change the layout 
+                    while holding tree_lock for writing, saves hold it for reading.
+     tree_lock    - directory tree, dirent_index, inode_table, name_table, dirents array, 
+                    nlookup and open_count (which may be incremented atomically under the read lock)
+     myhandle.lock
+     mydirent.lock - length and block list of the entry. A lazy block list is loaded with the write lock,
+                    the read lock and save_lock, or tree_lock taken for writing.
+     lru_lock     - the LRU of block lists, entries are only try-locked while holding it
+     alloc_lock   - busy_map and busy_blocks_count
+     readahead_lock - readahead queue, never held while taking other locks
+     writeback_lock - state of the flusher thread, never held while taking other locks
+*/
+pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+   Readahead: sequential readers get the next blocks loaded into the block cache
+   by readahead threads. Requests are queued in a ring, protected by readahead_lock.
+*/
+int readahead_threads_count = 4;
+long long readahead_max_bytes = 1024*1024;
+int readahead_max_blocks; /* per handle, also limited by the cache size */
+struct readahead_req {
+    struct myhandle* h; /* the handle that asked, the blocks are of its file */
+    int index;
+};
+struct readahead_req* readahead_queue;
+int readahead_queue_size;
+int readahead_queue_head;
+int readahead_queue_count;
+int readahead_thread_stop;
+int readahead_threads_running;
+pthread_t* readahead_threads;
+pthread_mutex_t readahead_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t readahead_cond = PTHREAD_COND_INITIALIZER;      /* something was queued */
+pthread_cond_t readahead_done_cond = PTHREAD_COND_INITIALIZER; /* a request was finished */
+
+/* Requests in flight for multi-block I/O of a thread */
+#define IO_QUEUE_DEPTH 64
 
-unsigned char* shred_buffer;
+/*
+   Mount reads the directory blocks in batches of up to LOAD_BATCH_BYTES
+   and decrypts every batch with up to load_threads_count threads.
+*/
+#define LOAD_BATCH_BYTES (16*1024*1024)
+#define LOAD_MIN_BLOCKS_PER_THREAD 16
+int load_threads_count = 4;
+
+/* 
+   Freed blocks wait here for the shred thread and stay busy in busy_map until they are overwritten.
+   Protected by shred_lock.
+*/
+#define SHRED_BATCH 64
+int *shred_queue;
+int shred_queue_count;
+int shred_queue_size;
+int shred_in_flight; /* blocks taken by the shred thread but not written yet */
+int shred_thread_running;
+int shred_thread_stop;
+pthread_t shred_thread;
+pthread_mutex_t shred_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t shred_cond = PTHREAD_COND_INITIALIZER;      /* something was queued */
+pthread_cond_t shred_done_cond = PTHREAD_COND_INITIALIZER; /* a batch was written */
 
 struct myblock {
     int num;
-    unsigned long iv;
+    uint32_t iv; /* only 32 bits of it are saved in the directory */
+};
+
+struct dir_block;
+
+/* A record of the entry in a saved directory block, for the block lists loaded lazily */
+struct saved_record {
+    int num;    /* the directory block */
+    int offset; /* of the record in it */
+    int first;
+    int count;
 };
 
 struct mydirent {
-    char* full_path;
+    const char* name; /* interned path component, "" for the root */
+    int is_dir;
     long long int length;
     struct myblock* blocks;
     int blocks_array_size;
+    int blocks_lazy; /* blocks not loaded yet, they are listed by the records below (see load_block_list) */
+    struct saved_record* lazy_records;
+    int lazy_records_count;
+    
+    /* directory tree */
+    struct mydirent* parent;
+    struct mydirent* first_child;
+    struct mydirent* last_child;
+    struct mydirent* prev_sibling;
+    struct mydirent* next_sibling;
+    
+    unsigned int key_hash;
+    struct mydirent* hash_next; /* chain in dirent_index */
+    
+    /* Inode numbers are never reused during the mount */
+    fuse_ino_t ino;
+    struct mydirent* ino_next; /* chain in inode_table */
+    unsigned long nlookup; /* references held by the kernel */
+    int open_count;
+    int unlinked; /* removed from the tree, waiting for the last reference to go */
+    int dirents_pos; /* index in dirents */
+    
+    /* directory blocks holding the saved records of this entry, see the directory layout below */
+    struct dir_block** saved_in;
+    int saved_in_count;
+    int saved_in_size;
+    int meta_dirty; /* length, block list or path changed since the records were saved, set atomically */
+    int saving;     /* read-locked by the running save */
+    /* length or blocks [journal_first, journal_end) changed since the last journal commit */
+    int journal_dirty;
+    int journal_first;
+    int journal_end;
+    
+    /* loaded block list of a closed file, in the list of evictable ones (lazy block lists only) */
+    struct mydirent* lru_prev;
+    struct mydirent* lru_next;
+    int lru_blocks; /* blocks_array_size when it was put there */
     
+    pthread_rwlock_t lock;
 };
 
 struct myhandle {
     struct mydirent* ent;
-    char* tmpbuf;
-    int current_block;   
-    int is_dirty; 
+    
+    /* sequential access detection, protected by lock */
+    pthread_mutex_t lock;
+    long long int ra_next_offset; /* where the next read continues a sequential stream */
+    int ra_window; /* blocks to keep prefetched ahead of the reader, 0 if not sequential */
+    int ra_end;    /* first block not requested yet */
+    int readahead_refs; /* queued and in-flight readahead requests, protected by readahead_lock */
+};
+
+/*
+   Directory layout (format V2, see README). Directory blocks hold the records of the entries,
+   the first block of the branch is the root of a table listing them. A save writes the changed 
+   directory blocks and the table blocks leading to them to new places, then the root.
+*/
+#define DIR_MAX_DEPTH 8
+#define DIR_EMPTY_SLOT 0xFFFFFFFF
+
+struct dir_record {
+    struct mydirent* ent;
+    int first;  /* index of the first block of the entry listed here */
+    int count;  /* blocks listed here */
+    int size;   /* serialized size */
+    int offset; /* where it starts in the saved block, valid while the block is not dirty */
+};
+
+struct dir_block {
+    int num;   /* -1 if not saved yet */
+    int dirty; /* records changed since it was saved */
+    int used;  /* bytes taken by the records */
+    struct dir_record* records;
+    int records_count;
+    int records_size;
+};
+
+/* Slots don't move, so a changed directory block changes only the table blocks on the way to its slot. NULL - free slot */
+struct dir_block** dir_slots;
+int dir_slots_count;
+int dir_slots_size;
+int dir_free_slot_hint; /* no free slots before it */
+
+/* dir_table[0] blocks list the slots, dir_table[k] blocks list dir_table[k-1] blocks, the root lists the last level */
+struct dir_table_level {
+    int* nums;
+    unsigned char* dirty;
+    int count;
 };
+struct dir_table_level dir_table[DIR_MAX_DEPTH];
+int dir_table_depth;
 
-struct mydirent *dirents;
+/* 
+   Entries are allocated individually, so pointers to them stay valid when the array is resized. 
+   The order is arbitrary, removal moves the last entry to the freed place.
+*/
+struct mydirent **dirents;
 int current_dirent_array_size;
 int dirent_entries_count;
 
+struct mydirent *root_dirent;
+
+/*
+   Lazy block lists (LAZY_BLOCK_LISTS): mount keeps only the paths, lengths and records of the files.
+   The block list of a file is decoded from its saved records when it is opened, truncated, removed
+   or its records get rewritten. Lists of closed unchanged files are dropped again, least recently
+   used first, when they take more than block_lists_max_bytes. The list is protected by lru_lock.
+*/
+int lazy_block_lists;
+long long block_lists_max_bytes = 64*1024*1024;
+long long block_lists_bytes; /* taken by the lists in the LRU */
+struct mydirent* lru_head; /* least recently used */
+struct mydirent* lru_tail;
+pthread_mutex_t lru_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* ino -> dirent, also contains unlinked entries still referenced by the kernel or open handles */
+struct mydirent **inode_table;
+int inode_table_size; /* power of two */
+int inode_count;
+fuse_ino_t next_ino;
+
+/* How long the kernel may cache entries and attributes, seconds */
+double cache_timeout;
+
+/* (parent, name) -> dirent hash index */
+struct mydirent **dirent_index;
+int dirent_index_size; /* power of two */
+
+/* Path components are interned: equal names share one refcounted copy and can be compared by pointer */
+struct name_atom {
+    struct name_atom* next;
+    int refcount;
+    unsigned int hash;
+    char str[];
+};
+
+struct name_atom **name_table;
+int name_table_size; /* power of two */
+int name_count;
+
+#define NAME_ATOM(name) ((struct name_atom*)((name) - offsetof(struct name_atom, str)))
+
 char* mcrypt_algo="rijndael-256";
 char* mcrypt_mode="nofb";
 int mcrypt_blocksize;
@@ -93,6 +334,18 @@ int mcrypt_keysize=256;
 int random_shred_probability=5;
 // of 1000
 
+/* 
+   Cover traffic: random data written to random free blocks by cover_thread, at a constant rate
+   (also while idle) plus random_shred_probability per 1000 foreground block writes.
+*/
+double cover_writes_per_sec = 0;
+volatile int foreground_block_writes;
+int cover_thread_running;
+int cover_thread_stop;
+pthread_t cover_thread;
+pthread_mutex_t cover_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cover_cond = PTHREAD_COND_INITIALIZER;
+
 int hash_algo = MHASH_SHA256;
 int keygen_algo = KEYGEN_S2K_ISALTED;
 int keygen_count= 190;
@@ -109,717 +362,4105 @@ char* mcrypt_initvect=
     "\x44\xd4\x6f\xa8\xc5\xd7\xf5\x93\xe4\x6f\xd4\xe9\xa9\xc9\x18\x8a\xf1\xb3\xba\x5b\x7a\x00\x77\xb0\x6b\xb5\xa8\xf1\x18\xdd"
     "\x79\x09\xb5\xf4\x53\xf4\x1d\x4b\x38\x60\xb0\x47\x36\xe3\x15\x56\x52\x2d\x7b\xa6\x19\x1e\x08\xe7\x87\x2a\xbb\x6e\xe5\x4f"
     ;
-char* mcrypt_key = NULL;
-unsigned char* mcrypt_buf = NULL;
-unsigned char* mcrypt_ivbuf = NULL;
+/* Key derived from a blockpassword */
+struct cipher_key {
+    char* key;
+    int generation; /* unique for every key, thread contexts compare it to see whether they are initialized with it */
+};
 
-        
+/* Key of the branch being mounted, the auxiliary branches have theirs only while they are loaded */
+struct cipher_key main_key;
+int key_generations;
+
+/* Only tells whether encryption is enabled. Each thread encrypts with its own context from thread_state. */
 MCRYPT mcrypt = MCRYPT_FAILED;
 
-int is_directory(const struct mydirent* i) {
-    return i->full_path[strlen(i->full_path)-1] == '/';
-}
+/*
+   The key schedule is computed once per key: the context stays initialized 
+   and only the mode state (which holds the IV) is replaced for every block.
+   mcrypt_state_template is the state right after initialization, 
+   the IV is found at mcrypt_state_iv_offsets in it.
+   mcrypt_state_size==0 means that this does not work for the algorithm/mode 
+   and the context is initialized for every block.
+*/
+int mcrypt_state_size;
+unsigned char* mcrypt_state_template;
+#define MAX_IV_COPIES_IN_STATE 4
+int mcrypt_state_iv_offsets[MAX_IV_COPIES_IN_STATE];
+int mcrypt_state_iv_count;
 
-int is_file(const struct mydirent* i) {
-    return ! is_directory(i);
-}
+/*
+   Random numbers: ChaCha20 with fast key erasure. Each refill produces 
+   RNG_BUFFER_SIZE bytes of keystream, the first 32 of them immediately replace the key, 
+   the rest is handed out and wiped as it is consumed.
+   Every thread has its own generator seeded from master_rng.
+*/
+#define RNG_BUFFER_SIZE 768
+#define RNG_BULK_SIZE 256 /* bigger requests are generated directly into the caller's buffer */
 
-struct mydirent* find_dirent(const char* path) {
+struct csprng {
+    uint32_t key[8];
+    unsigned char buf[RNG_BUFFER_SIZE];
+    int pos;
+};
+
+struct csprng master_rng;
+pthread_mutex_t master_rng_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA_QR(a, b, c, d) \
+    a += b; d ^= a; d = ROTL32(d, 16); \
+    c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8); \
+    c += d; b ^= c; b = ROTL32(b, 7);
+
+/* One 64-byte ChaCha20 block with zero nonce */
+void chacha20_block(const uint32_t key[8], uint64_t counter, unsigned char* out) {
+    uint32_t in[16], x[16];
     int i;
-    int pl = strlen(path);
-    if (pl==0) return NULL;
-    if (path[pl-1]=='/') --pl;
-    for (i=0; i<dirent_entries_count; ++i) {
-        int l = strlen(dirents[i].full_path);
-        if (is_directory(&dirents[i])) --l;
-        
-        if (pl != l) continue;
-        
-        if (strncmp(path, dirents[i].full_path, pl)) continue;
-            
-        return &dirents[i];
+    in[0] = 0x61707865; in[1] = 0x3320646e; in[2] = 0x79622d32; in[3] = 0x6b206574;
+    for (i=0; i<8; ++i) in[4+i] = key[i];
+    in[12] = (uint32_t)counter;
+    in[13] = (uint32_t)(counter >> 32);
+    in[14] = 0;
+    in[15] = 0;
+    memcpy(x, in, sizeof(x));
+    for (i=0; i<10; ++i) {
+        CHACHA_QR(x[0], x[4], x[8],  x[12]);
+        CHACHA_QR(x[1], x[5], x[9],  x[13]);
+        CHACHA_QR(x[2], x[6], x[10], x[14]);
+        CHACHA_QR(x[3], x[7], x[11], x[15]);
+        CHACHA_QR(x[0], x[5], x[10], x[15]);
+        CHACHA_QR(x[1], x[6], x[11], x[12]);
+        CHACHA_QR(x[2], x[7], x[8],  x[13]);
+        CHACHA_QR(x[3], x[4], x[9],  x[14]);
+    }
+    for (i=0; i<16; ++i) {
+        uint32_t v = htole32(x[i] + in[i]);
+        memcpy(out + 4*i, &v, 4);
     }
-    return NULL;
 }
 
-void copy_dirent(struct mydirent* dst, struct mydirent* src) {
-    memcpy(dst, src, sizeof (*src));
+void csprng_seed(struct csprng* r, const unsigned char* seed) {
+    memcpy(r->key, seed, sizeof(r->key));
+    memset(r->buf, 0, sizeof(r->buf));
+    r->pos = RNG_BUFFER_SIZE;
 }
 
-int get_block_count_for_length(long long int size);
-void mark_unused_block(int i);
-int write_block(const unsigned char* buffer, struct myblock *block);
-int write_block_ll(const unsigned char* buffer, int i);
-int nearest_power_of_two(int s);
-void shred_block(int i);
+void csprng_refill(struct csprng* r) {
+    uint64_t i;
+    for (i=0; i<RNG_BUFFER_SIZE/64; ++i) {
+        chacha20_block(r->key, i, r->buf + 64*i);
+    }
+    memcpy(r->key, r->buf, sizeof(r->key));
+    memset(r->buf, 0, sizeof(r->key));
+    r->pos = sizeof(r->key);
+}
 
-void remove_dirent(struct mydirent* ent) {
-    int index = ent - dirents;
-    int i;
-    
-    free(ent->full_path);
-    
-    unsigned char* zeroes = (unsigned char*) malloc(block_size);
-    memset(zeroes, 0, block_size);
-    
-    if (ent->blocks) {
-        int bc = get_block_count_for_length(ent->length);
-        for (i=0; i<bc; ++i) {
-            shred_block(ent->blocks[i].num);
-            mark_unused_block(ent->blocks[i].num);
+void csprng_generate(struct csprng* r, void* out_, size_t n) {
+    unsigned char* out = (unsigned char*) out_;
+    if (n >= RNG_BULK_SIZE) {
+        /* block 0 becomes the next key, the rest goes straight to the output */
+        unsigned char tmp[64];
+        uint32_t old_key[8];
+        uint64_t counter = 1;
+        memcpy(old_key, r->key, sizeof(old_key));
+        chacha20_block(old_key, 0, tmp);
+        memcpy(r->key, tmp, sizeof(r->key));
+        for (; n >= 64; n -= 64, out += 64) {
+            chacha20_block(old_key, counter++, out);
         }
+        if (n) {
+            chacha20_block(old_key, counter, tmp);
+            memcpy(out, tmp, n);
+        }
+        memset(tmp, 0, sizeof(tmp));
+        memset(old_key, 0, sizeof(old_key));
+        return;
     }
-    free(ent->blocks);
-    free(zeroes);
-    for(i=index; i<dirent_entries_count-1; ++i) {
-        copy_dirent(&dirents[i], &dirents[i+1]);
+    while (n) {
+        if (r->pos == RNG_BUFFER_SIZE) csprng_refill(r);
+        size_t c = RNG_BUFFER_SIZE - r->pos;
+        if (c > n) c = n;
+        memcpy(out, r->buf + r->pos, c);
+        memset(r->buf + r->pos, 0, c);
+        r->pos += c;
+        out += c;
+        n -= c;
     }
-    --dirent_entries_count;
 }
 
-int get_maximum_path_length();
+/* Seeds master_rng from RANDOM_FILE if it is set (reproducible runs), else from getrandom. Returns 0 on failure. */
+int seed_random() {
+    unsigned char seed[32];
+    if (rnd_name) {
+        FILE* f = fopen(rnd_name, "rb");
+        if (!f) { perror("fopen random"); return 0; }
+        size_t ret = fread(seed, 1, sizeof(seed), f);
+        fclose(f);
+        if (ret != sizeof(seed)) {
+            fprintf(stderr, "Can't read %d bytes of seed from %s\n", (int)sizeof(seed), rnd_name);
+            return 0;
+        }
+    } else {
+        size_t got = 0;
+        while (got < sizeof(seed)) {
+            ssize_t ret = getrandom(seed + got, sizeof(seed) - got, 0);
+            if (ret < 0) {
+                if (errno == EINTR) continue;
+                perror("getrandom");
+                return 0;
+            }
+            got += ret;
+        }
+    }
+    csprng_seed(&master_rng, seed);
+    memset(seed, 0, sizeof(seed));
+    return 1;
+}
 
-struct mydirent* create_dirent(const char* path) {
-    if (strlen(path) > get_maximum_path_length()-12) {
-        return NULL;
+/* Per-thread crypto context and scratch buffers */
+struct thread_state {
+    struct csprng rng;
+    MCRYPT mcrypt;
+    const struct cipher_key* key; /* the key used by this thread, main_key unless loading another branch */
+    int key_generation; /* of the key mcrypt is initialized with, -1 if not initialized */
+    unsigned char* mcrypt_buf;
+    unsigned char* mcrypt_ivbuf;
+    unsigned char* mcrypt_state;
+    unsigned char* shred_buffer;
+    unsigned char* block_buf; /* for I/O bypassing the block cache */
+    struct uring* ring; /* for multi-block I/O, created on first use */
+};
+
+pthread_key_t thread_state_key;
+pthread_mutex_t mcrypt_open_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void free_thread_state(void* arg) {
+    struct thread_state* ts = (struct thread_state*) arg;
+    if (ts->mcrypt != MCRYPT_FAILED) {
+        if (ts->key_generation != -1) mcrypt_generic_deinit(ts->mcrypt);
+        mcrypt_module_close(ts->mcrypt);
     }
+    free(ts->mcrypt_buf);
+    free(ts->mcrypt_ivbuf);
+    free(ts->mcrypt_state);
+    free(ts->shred_buffer);
+    free(ts->block_buf);
+    uring_free(ts->ring);
+    memset(&ts->rng, 0, sizeof(ts->rng));
+    free(ts);
+}
+
+/* Returns NULL on failure */
+struct thread_state* get_thread_state() {
+    struct thread_state* ts = (struct thread_state*) pthread_getspecific(thread_state_key);
+    if (ts) return ts;
     
-    struct mydirent* ent;
-    if (dirent_entries_count < current_dirent_array_size) {
-        ent = &dirents[dirent_entries_count++];
+    ts = (struct thread_state*) malloc(sizeof(*ts));
+    {
+        unsigned char seed[32];
+        pthread_mutex_lock(&master_rng_lock);
+        csprng_generate(&master_rng, seed, sizeof(seed));
+        pthread_mutex_unlock(&master_rng_lock);
+        csprng_seed(&ts->rng, seed);
+        memset(seed, 0, sizeof(seed));
+    }
+    ts->mcrypt = MCRYPT_FAILED;
+    ts->key = &main_key;
+    ts->key_generation = -1;
+    ts->mcrypt_buf = (unsigned char*) valloc(block_size);
+    ts->shred_buffer = (unsigned char*) malloc(block_size);
+    ts->block_buf = (unsigned char*) malloc(block_size);
+    ts->mcrypt_ivbuf = NULL;
+    ts->mcrypt_state = NULL;
+    ts->ring = NULL;
+    if (mcrypt != MCRYPT_FAILED) {
+        pthread_mutex_lock(&mcrypt_open_lock);
+        ts->mcrypt = mcrypt_module_open(mcrypt_algo, NULL, mcrypt_mode, NULL);
+        pthread_mutex_unlock(&mcrypt_open_lock);
+        ts->mcrypt_ivbuf = (unsigned char*) malloc(mcrypt_ivsize);
+        if (ts->mcrypt == MCRYPT_FAILED) {
+            fprintf(stderr, "mcrypt_module_open failed in a worker thread\n");
+            free_thread_state(ts);
+            return NULL;
+        }
+    }
+    pthread_setspecific(thread_state_key, ts);
+    return ts;
+}
+
+void random_bytes(void* out, size_t n) {
+    struct thread_state* ts = get_thread_state();
+    if (ts) {
+        csprng_generate(&ts->rng, out, n);
     } else {
-        current_dirent_array_size*=2;
-        dirents = realloc(dirents, current_dirent_array_size*sizeof(*dirents));
-        ent = &dirents[dirent_entries_count++];
+        pthread_mutex_lock(&master_rng_lock);
+        csprng_generate(&master_rng, out, n);
+        pthread_mutex_unlock(&master_rng_lock);
     }
-    ent->full_path = strdup(path);
-    ent->length = 0;
-    ent->blocks_array_size = 0;
-    ent->blocks = NULL;
-    return ent;
 }
 
+int is_directory(const struct mydirent* i) {
+    return i->is_dir;
+}
 
-/*
-   returns -1 on failure 
-*/
-int allocate_block(int privileged_mode) {
+int is_file(const struct mydirent* i) {
+    return ! is_directory(i);
+}
+
+/* FNV-1a */
+unsigned int hash_string(const char* s, int len) {
+    unsigned int h = 2166136261u;
     int i;
-    int index=0;
-    
-    if (!privileged_mode && busy_blocks_count*100.0 >= block_count*(100.0-reserved_percent)) {
-        //fprintf(stderr, "Not priv\n");
-        return -1; /* out of free space */
+    for (i=0; i<len; ++i) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
     }
+    return h;
+}
+
+void name_table_grow() {
+    int i;
+    struct name_atom** old = name_table;
+    int old_size = name_table_size;
     
-    if (busy_blocks_count < block_count - 5) {
-        for (i=0; i<100; ++i) {
-            unsigned long long int rrr;
-            fread(&rrr, sizeof(rrr), 1, rnd);
-            index = rrr % block_count;
-            if (busy_map[index]) continue;
-            if (index == user_first_block) {
-                fprintf(stderr, "Starting block is not used?\n");
-                continue;
-            }
-            busy_map[index] = 1;
-            ++busy_blocks_count;
-            //fprintf(stderr, "Normal: %d\n", index);
-            return index;
+    name_table_size = old_size ? old_size*2 : 256;
+    name_table = (struct name_atom**) calloc(name_table_size, sizeof(*name_table));
+    for (i=0; i<old_size; ++i) {
+        struct name_atom* a = old[i];
+        while (a) {
+            struct name_atom* next = a->next;
+            int slot = a->hash & (name_table_size-1);
+            a->next = name_table[slot];
+            name_table[slot] = a;
+            a = next;
         }
-    } 
-    
-    for(i=index+1; i<block_count; ++i) {
-        if (busy_map[i]) continue;
-        busy_map[i]=1;
-        //fprintf(stderr, "Alt1: %d\n", i);
-        return i;
     }
-    
-    for(i=0; i<index; ++i) {
-        if (busy_map[i]) continue;
-        busy_map[i]=1;
-        //fprintf(stderr, "Alt2: %d\n", i);
-        return i;        
+    free(old);
+}
+
+/* Returns the interned copy of the name or NULL if nobody uses such name */
+const char* find_interned_name(const char* s, int len) {
+    if (!name_table_size) return NULL;
+    unsigned int h = hash_string(s, len);
+    struct name_atom* a = name_table[h & (name_table_size-1)];
+    for (; a; a = a->next) {
+        if (a->hash != h) continue;
+        if (strncmp(a->str, s, len) || a->str[len]) continue;
+        return a->str;
+    }
+    return NULL;
+}
+
+/* Returns the interned copy of the name with a reference taken */
+const char* intern_name(const char* s, int len) {
+    const char* name = find_interned_name(s, len);
+    if (name) {
+        ++NAME_ATOM(name)->refcount;
+        return name;
     }
     
-    /* No more free blocks at all */
-    
-    if (privileged_mode) {
-        readonly_flag = 1;
-        /* Emergency measures: expand the storage file to save directory in it */
-        fprintf(stderr, "Expanding the data file to store the directory\n");
-        ++block_count;
-        ++busy_blocks_count;
-        int po2 = nearest_power_of_two(block_count);
-        busy_map = realloc(busy_map, po2*sizeof(int));
-        busy_map[block_count-1]=1;
-        fprintf(stderr, "Emeg: %d\n", block_count-1);
-        return block_count-1;
+    if (name_count >= name_table_size) {
+        name_table_grow();
     }
+    struct name_atom* a = (struct name_atom*) malloc(sizeof(*a) + len + 1);
+    memcpy(a->str, s, len);
+    a->str[len] = 0;
+    a->hash = hash_string(s, len);
+    a->refcount = 1;
+    int slot = a->hash & (name_table_size-1);
+    a->next = name_table[slot];
+    name_table[slot] = a;
+    ++name_count;
+    return a->str;
+}
+
+void release_name(const char* name) {
+    struct name_atom* a = NAME_ATOM(name);
+    if (--a->refcount) return;
     
-    //fprintf(stderr, "Fail\n");
-    return -1; /* out of free space */
+    struct name_atom** p = &name_table[a->hash & (name_table_size-1)];
+    while (*p != a) p = &(*p)->next;
+    *p = a->next;
+    --name_count;
+    free(a);
 }
 
-void mark_unused_block(int i) {
-    if (!busy_map[i]) {
-        fprintf(stderr, "Freeing not occupied block %d\n", i);
-    } else {
-        --busy_blocks_count;
-    }
-    busy_map[i] = 0;
+unsigned int hash_key(const struct mydirent* parent, const char* name) {
+    return NAME_ATOM(name)->hash ^ (unsigned int)(((uintptr_t)parent >> 4) * 2654435761u);
 }
 
-void shred_block(int i) {
-    if (no_shred) return;
-    fread(shred_buffer, 1, block_size, rnd);
-    write_block_ll(shred_buffer, i);
+void index_insert_nogrow(struct mydirent* ent) {
+    int slot = ent->key_hash & (dirent_index_size-1);
+    ent->hash_next = dirent_index[slot];
+    dirent_index[slot] = ent;
 }
 
-void maybe_shred_some_random_block() {
-    unsigned int r;
+void index_grow() {
     int i;
-    if (readonly_flag) return;
-    fread(&r, 4, 1, rnd);
-    r %= 1000;
-    if (r<random_shred_probability) {
-        int target = -1;
-        fread(&r, 4, 1, rnd);
-        r %= block_count;
-        if (!busy_map[r]) target=r;
-        else {
-            for(i=(r+1)%block_count; i != r; i=(i+1)%block_count) {
-                if (!busy_map[i]) { 
-                    target=i;
-                    break;
-                }
-            }
+    struct mydirent** old = dirent_index;
+    int old_size = dirent_index_size;
+    
+    dirent_index_size = old_size ? old_size*2 : 256;
+    dirent_index = (struct mydirent**) calloc(dirent_index_size, sizeof(*dirent_index));
+    for (i=0; i<old_size; ++i) {
+        struct mydirent* ent = old[i];
+        while (ent) {
+            struct mydirent* next = ent->hash_next;
+            index_insert_nogrow(ent);
+            ent = next;
         }
-        if (target!= -1) {
-            fread(shred_buffer, 1, block_size, rnd);
-            write_block_ll(shred_buffer, target);
+    }
+    free(old);
+}
+
+void index_insert(struct mydirent* ent) {
+    ent->key_hash = hash_key(ent->parent, ent->name);
+    /* keep load factor below 1 */
+    if (dirent_entries_count >= dirent_index_size) {
+        index_grow();
+    }
+    index_insert_nogrow(ent);
+}
+
+void index_remove(struct mydirent* ent) {
+    struct mydirent** p = &dirent_index[ent->key_hash & (dirent_index_size-1)];
+    while (*p) {
+        if (*p == ent) {
+            *p = ent->hash_next;
+            ent->hash_next = NULL;
+            return;
         }
+        p = &(*p)->hash_next;
     }
 }
 
-void mark_used_block(int i) {
-    if (busy_map[i]) {
-        fprintf(stderr, "Marking the block %d twice\n", i);
+struct mydirent* find_child(const struct mydirent* parent, const char* interned_name) {
+    unsigned int h = hash_key(parent, interned_name);
+    struct mydirent* ent = dirent_index[h & (dirent_index_size-1)];
+    for (; ent; ent = ent->hash_next) {
+        if (ent->parent == parent && ent->name == interned_name) return ent;
+    }
+    return NULL;
+}
+
+void link_child(struct mydirent* parent, struct mydirent* ent) {
+    ent->parent = parent;
+    ent->next_sibling = NULL;
+    ent->prev_sibling = parent->last_child;
+    if (parent->last_child) {
+        parent->last_child->next_sibling = ent;
     } else {
-        ++busy_blocks_count;
+        parent->first_child = ent;
     }
-    busy_map[i] = 1;
+    parent->last_child = ent;
 }
 
-int nearest_power_of_two(int s) {
-    int r=1;
-    while(r<s) r*=2;
-    return r;
+void unlink_child(struct mydirent* ent) {
+    struct mydirent* parent = ent->parent;
+    if (ent->prev_sibling) {
+        ent->prev_sibling->next_sibling = ent->next_sibling;
+    } else {
+        parent->first_child = ent->next_sibling;
+    }
+    if (ent->next_sibling) {
+        ent->next_sibling->prev_sibling = ent->prev_sibling;
+    } else {
+        parent->last_child = ent->prev_sibling;
+    }
+    ent->prev_sibling = ent->next_sibling = NULL;
 }
 
-int get_block_count_for_length(long long int size) {
-    int bc = (size - 1) / block_size + 1;
-    if (size == 0) bc = 0;
-    return bc;
+void inode_insert_nogrow(struct mydirent* ent) {
+    int slot = ent->ino & (inode_table_size-1);
+    ent->ino_next = inode_table[slot];
+    inode_table[slot] = ent;
 }
 
-/* returns 0 on failure, 1 on success */
-int ensure_size(struct mydirent* ent, long long int size) {
-    if (size == 0) return 1;
-    if (size <= ent->length) return 1;
-    int ent_block_count      = get_block_count_for_length(ent->length);
-    int required_block_count = get_block_count_for_length(size);
-    if (required_block_count > ent->blocks_array_size) {
-        ent->blocks_array_size = nearest_power_of_two(required_block_count);
-        struct myblock* nb = (struct myblock*)realloc(ent->blocks, ent->blocks_array_size*sizeof(*ent->blocks));
-        if(!nb) return 0;
-        ent->blocks = nb;
-    }
-    
-    unsigned char* zeroes = (unsigned char*) malloc(block_size);
-    memset(zeroes, 0, block_size);
-    
+void inode_table_grow() {
     int i;
-    for(i=ent_block_count; i<required_block_count; ++i) {
-        ent->blocks[i].num = allocate_block(0);
-        ent->blocks[i].iv = 0;
-        if ((ent->blocks[i].num) == -1) {
-            free(zeroes);
-            return 0;
+    struct mydirent** old = inode_table;
+    int old_size = inode_table_size;
+    
+    inode_table_size = old_size ? old_size*2 : 256;
+    inode_table = (struct mydirent**) calloc(inode_table_size, sizeof(*inode_table));
+    for (i=0; i<old_size; ++i) {
+        struct mydirent* ent = old[i];
+        while (ent) {
+            struct mydirent* next = ent->ino_next;
+            inode_insert_nogrow(ent);
+            ent = next;
         }
-        write_block(zeroes, &ent->blocks[i]);
     }
-    free(zeroes);
-    
-    ent->length = size;
-    return 1;    
+    free(old);
 }
 
-int d_truncate(struct mydirent* ent, long long int size) {
-    if (size >= ent->length) return ensure_size(ent, size);
-        
-    int ent_block_count      = get_block_count_for_length(ent->length);
-    int required_block_count = get_block_count_for_length(size);
-    int i;
-    
-    for (i=required_block_count; i<ent_block_count; ++i) {
-        shred_block(ent->blocks[i].num);
-        mark_unused_block(ent->blocks[i].num);
+void inode_insert(struct mydirent* ent) {
+    if (inode_count >= inode_table_size) {
+        inode_table_grow();
     }
-    ent->length = size;
-    return 1;
+    inode_insert_nogrow(ent);
+    ++inode_count;
 }
 
-int write_block_ll(const unsigned char* buffer, int i) {
-    int fd = data;
-    off_t off = i*block_size;
-    size_t s = block_size;
-    while(s) {
-        int ret = pwrite(fd, buffer, s, off);
-        if (ret<=0) {
-            if (errno==EINTR || errno==EAGAIN) continue;
-            perror("pwrite");
-            return 0;
+void inode_remove(struct mydirent* ent) {
+    struct mydirent** p = &inode_table[ent->ino & (inode_table_size-1)];
+    while (*p) {
+        if (*p == ent) {
+            *p = ent->ino_next;
+            ent->ino_next = NULL;
+            --inode_count;
+            return;
         }
-        off+=ret;
-        s-=ret;
+        p = &(*p)->ino_next;
     }
-    maybe_shred_some_random_block();
-    return 1;
 }
 
-static __attribute__((const)) int imin(int a, int b) { return (a < b) ? a : b; }
+struct mydirent* get_dirent_by_ino(fuse_ino_t ino) {
+    if (!inode_table_size) return NULL;
+    struct mydirent* ent = inode_table[ino & (inode_table_size-1)];
+    for (; ent; ent = ent->ino_next) {
+        if (ent->ino == ino) return ent;
+    }
+    return NULL;
+}
 
-int write_block_enc(const unsigned char* buffer, struct myblock *block) {
-    int i = block->num;
-    memcpy(mcrypt_buf, buffer, block_size);
-    if (mcrypt == MCRYPT_FAILED) {
-        return write_block_ll(mcrypt_buf, i);
-    } else {
-        int s = imin(sizeof(block->iv), mcrypt_ivsize);
-        memset(mcrypt_ivbuf, 0, mcrypt_ivsize);
-        memcpy(mcrypt_ivbuf, &block->iv, s);
+/* Walks the path component by component. Trailing '/' is ignored. */
+struct mydirent* find_dirent_len(const char* path, int len) {
+    if (len==0) return NULL;
+    
+    struct mydirent* ent = root_dirent;
+    int i = 0;
+    while (ent) {
+        while (i<len && path[i]=='/') ++i;
+        if (i==len) return ent;
         
-        if(mcrypt_generic_init(mcrypt, mcrypt_key, mcrypt_keysize/8, mcrypt_ivbuf) < 0) {
-            fprintf(stderr, "Encryption init error\n");
-            return 0;
-        }
-        if(mcrypt_generic (mcrypt, mcrypt_buf, block_size) < 0) {
-            fprintf(stderr, "Encryption error\n");
-            return 0;
-        }
-        mcrypt_generic_deinit(mcrypt);
+        int e = i;
+        while (e<len && path[e]!='/') ++e;
         
-        return write_block_ll(mcrypt_buf, i);
+        const char* name = find_interned_name(path+i, e-i);
+        if (!name) return NULL;
+        ent = find_child(ent, name);
+        i = e;
     }
+    return NULL;
 }
 
-int write_block(const unsigned char* buffer, struct myblock *block) {
-    if (mcrypt != MCRYPT_FAILED) { fread(&block->iv, 1, sizeof(block->iv), rnd); }
-    return write_block_enc(buffer, block);
+struct mydirent* find_dirent(const char* path) {
+    return find_dirent_len(path, strlen(path));
 }
 
-void xor_scrable_buffer(unsigned char* buffer) {
-    int j;
-    unsigned long pseudokey = *(unsigned long*)buffer;
-    for(j=1; j<(block_size / sizeof(unsigned long)); ++j) {
-        ((unsigned long*)buffer)[j] ^= pseudokey;
+/* Length of the serialized full path, including the trailing '/' of directories */
+int get_path_length(const struct mydirent* ent) {
+    int l = ent->is_dir ? 1 : 0;
+    if (ent == root_dirent) return 1;
+    for (; ent != root_dirent; ent = ent->parent) {
+        l += 1 + strlen(ent->name);
     }
+    return l;
 }
 
-int write_block_simple(unsigned char* buffer, int i) {
-    struct myblock b;
-    b.num = i;
-    b.iv = htobe32(i);
-    // scramble the data, using first 4 bytes of buffer is "poor man's IV"
-    // write_block_simple is called by save_entries and it sets first 8 bytes to random
-    if (mcrypt!=MCRYPT_FAILED) xor_scrable_buffer(buffer);
-    int ret = write_block_enc(buffer, &b);
-    if (mcrypt!=MCRYPT_FAILED) xor_scrable_buffer(buffer);
+/* Writes get_path_length(ent) bytes to buf, without terminating zero */
+void get_full_path(const struct mydirent* ent, char* buf) {
+    int pos = get_path_length(ent);
+    if (ent->is_dir) buf[--pos] = '/';
+    for (; ent != root_dirent; ent = ent->parent) {
+        int l = strlen(ent->name);
+        pos -= l;
+        memcpy(buf+pos, ent->name, l);
+        buf[--pos] = '/';
+    }
+}
+
+static __attribute__((const)) int imin(int a, int b) { return (a < b) ? a : b; }
+static __attribute__((const)) int imax(int a, int b) { return (a > b) ? a : b; }
+
+int get_block_count_for_length(long long int size);
+void mark_unused_block(int i);
+int write_block(const unsigned char* buffer, struct myblock *block);
+int write_block_ll(const unsigned char* buffer, int i);
+int read_block(unsigned char* buffer, struct myblock *block);
+int rw_blocks_ll(unsigned char** buffers, const int* nums, int count, int write);
+int decrypt_block(unsigned char* buffer, const struct myblock *block);
+int encrypt_block(unsigned char* buffer, struct myblock *block);
+struct uring* get_thread_ring(struct thread_state* ts);
+int nearest_power_of_two(int s);
+void release_block(int i);
+void cache_drop(struct mydirent* ent, int first_index);
+void mark_dirty();
+void dir_unrecord(struct mydirent* ent);
+int load_block_list(struct mydirent* ent);
+void lru_evict_ll();
+
+/* The entry's length, block list or path changed: its records get rewritten on the next checkpoint */
+void mark_ent_dirty(struct mydirent* ent) {
+    __sync_lock_test_and_set(&ent->meta_dirty, 1);
+}
+
+/* The length and blocks [first, end) of the entry changed. Caller holds the write lock of ent. */
+void mark_ent_blocks_dirty(struct mydirent* ent, int first, int end) {
+    if (first < end) {
+        if (ent->journal_first >= ent->journal_end) {
+            ent->journal_first = first;
+            ent->journal_end = end;
+        } else {
+            ent->journal_first = imin(ent->journal_first, first);
+            ent->journal_end = imax(ent->journal_end, end);
+        }
+    }
+    __sync_lock_test_and_set(&ent->journal_dirty, 1);
+    mark_ent_dirty(ent);
+}
+
+static void lru_unlink(struct mydirent* ent) {
+    if (ent->lru_blocks == -1) return;
+    if (ent->lru_prev) ent->lru_prev->lru_next = ent->lru_next; else lru_head = ent->lru_next;
+    if (ent->lru_next) ent->lru_next->lru_prev = ent->lru_prev; else lru_tail = ent->lru_prev;
+    ent->lru_prev = ent->lru_next = NULL;
+    block_lists_bytes -= (long long)ent->lru_blocks * sizeof(struct myblock);
+    ent->lru_blocks = -1;
+}
+
+/* The block list is in use (the file is open or gone), it can't be dropped */
+void lru_remove(struct mydirent* ent) {
+    if (!lazy_block_lists) return;
+    pthread_mutex_lock(&lru_lock);
+    lru_unlink(ent);
+    pthread_mutex_unlock(&lru_lock);
+}
+
+/* The file got closed (or its list loaded while it is closed), the list may be dropped later */
+void lru_add(struct mydirent* ent) {
+    if (!lazy_block_lists || !ent->blocks || ent->unlinked) return;
+    pthread_mutex_lock(&lru_lock);
+    lru_unlink(ent);
+    ent->lru_prev = lru_tail;
+    if (lru_tail) lru_tail->lru_next = ent; else lru_head = ent;
+    lru_tail = ent;
+    ent->lru_blocks = ent->blocks_array_size;
+    block_lists_bytes += (long long)ent->lru_blocks * sizeof(struct myblock);
+    pthread_mutex_unlock(&lru_lock);
+}
+
+/* Frees the unlinked dirent and its blocks when neither the kernel nor open handles reference it */
+void maybe_free_dirent(struct mydirent* ent) {
+    int i;
+    if (!ent->unlinked || ent->nlookup || ent->open_count) return;
+    
+    inode_remove(ent);
+    release_name(ent->name);
+    lru_remove(ent);
+    
+    cache_drop(ent, 0);
+    if (ent->blocks) {
+        int bc = get_block_count_for_length(ent->length);
+        for (i=0; i<bc; ++i) {
+            release_block(ent->blocks[i].num);
+        }
+    }
+    free(ent->blocks);
+    free(ent->lazy_records);
+    free(ent->saved_in);
+    pthread_rwlock_destroy(&ent->lock);
+    free(ent);
+}
+
+/* Removes the dirent from the directory. The file content is kept while it is still open. */
+void remove_dirent(struct mydirent* ent) {
+    /* its blocks are released along with it */
+    if (!load_block_list(ent)) fprintf(stderr, "Blocks of the removed file stay allocated till the next mount\n");
+    lru_remove(ent);
+    
+    index_remove(ent);
+    if (ent->parent) unlink_child(ent);
+    if (ent == root_dirent) root_dirent = NULL;
+    dir_unrecord(ent);
+    struct mydirent* last = dirents[--dirent_entries_count];
+    dirents[ent->dirents_pos] = last;
+    last->dirents_pos = ent->dirents_pos;
+    
+    ent->unlinked = 1;
+    maybe_free_dirent(ent);
+}
+
+/* Moves the entry under newdir with the new name. The caller checked that the move is possible. */
+void move_dirent(struct mydirent* ent, struct mydirent* newdir, const char* newname, int l) {
+    struct mydirent* i;
+    
+    // descendants are attached to ent itself, so the whole subtree moves along with it
+    index_remove(ent);
+    unlink_child(ent);
+    release_name(ent->name);
+    ent->name = intern_name(newname, l);
+    link_child(newdir, ent);
+    index_insert(ent);
+    
+    /* saved records contain full paths */
+    for (i = ent; i; ) {
+        mark_ent_dirty(i);
+        if (i->first_child) { i = i->first_child; continue; }
+        while (i != ent && !i->next_sibling) i = i->parent;
+        i = (i == ent) ? NULL : i->next_sibling;
+    }
+}
+
+/* How far the longest path in the subtree goes beyond the name of ent (the slash of a directory included) */
+int get_subtree_depth(const struct mydirent* ent) {
+    const struct mydirent* i;
+    int base = get_path_length(ent) - (ent->is_dir ? 1 : 0);
+    int depth = 0;
+    for (i = ent; i; ) {
+        depth = imax(depth, get_path_length(i) - base);
+        if (i->first_child) { i = i->first_child; continue; }
+        while (i != ent && !i->next_sibling) i = i->parent;
+        i = (i == ent) ? NULL : i->next_sibling;
+    }
+    return depth;
+}
+
+/* Journal records: type, body length - 4 bytes, big endian, body (see README) */
+#define JOURNAL_CREATE 'C'
+#define JOURNAL_UNLINK 'U'
+#define JOURNAL_RENAME 'R'
+#define JOURNAL_LENGTH 'L'
+#define JOURNAL_BLOCKS 'B'
+#define JOURNAL_RECORD_HEADER_SIZE 5
+
+/* Appends a record to journal_ops, returns where its body goes */
+static unsigned char* journal_ops_append(int type, int len) {
+    if (journal_ops_len + JOURNAL_RECORD_HEADER_SIZE + len > journal_ops_size) {
+        journal_ops_size = nearest_power_of_two(journal_ops_len + JOURNAL_RECORD_HEADER_SIZE + len + 1024);
+        journal_ops = (unsigned char*) realloc(journal_ops, journal_ops_size);
+    }
+    unsigned char* r = journal_ops + journal_ops_len;
+    r[0] = type;
+    *(uint32_t*)(r+1) = htobe32(len);
+    journal_ops_len += JOURNAL_RECORD_HEADER_SIZE + len;
+    return r + JOURNAL_RECORD_HEADER_SIZE;
+}
+
+/* Creation or removal of the entry goes to the next journal commit. Called with tree_lock held for writing. */
+void journal_log_path(int type, struct mydirent* ent) {
+    if (!journal_max_blocks) return;
+    int l = get_path_length(ent);
+    get_full_path(ent, (char*)journal_ops_append(type, l));
+}
+
+/* The entry (already moved) was at old_path. Called with tree_lock held for writing. */
+void journal_log_rename(const char* old_path, int old_len, struct mydirent* ent) {
+    if (!journal_max_blocks) return;
+    int l = get_path_length(ent);
+    unsigned char* b = journal_ops_append(JOURNAL_RENAME, 4 + old_len + l);
+    *(uint32_t*)b = htobe32(old_len);
+    memcpy(b+4, old_path, old_len);
+    get_full_path(ent, (char*)b+4+old_len);
+}
+
+int get_maximum_path_length();
+
+struct mydirent* new_dirent(struct mydirent* parent, const char* name, int namelen, int is_dir) {
+    struct mydirent* ent = (struct mydirent*) malloc(sizeof(*ent));
+    if (dirent_entries_count == current_dirent_array_size) {
+        current_dirent_array_size*=2;
+        dirents = realloc(dirents, current_dirent_array_size*sizeof(*dirents));
+    }
+    ent->name = intern_name(name, namelen);
+    ent->is_dir = is_dir;
+    ent->length = 0;
+    ent->blocks_array_size = 0;
+    ent->blocks = NULL;
+    ent->blocks_lazy = 0;
+    ent->lazy_records = NULL;
+    ent->lazy_records_count = 0;
+    ent->parent = NULL;
+    ent->first_child = ent->last_child = NULL;
+    ent->prev_sibling = ent->next_sibling = NULL;
+    ent->hash_next = NULL;
+    if (parent) {
+        link_child(parent, ent);
+    }
+    index_insert(ent);
+    ent->dirents_pos = dirent_entries_count;
+    dirents[dirent_entries_count++] = ent;
+    
+    ent->ino = parent ? next_ino++ : FUSE_ROOT_ID;
+    ent->nlookup = 0;
+    ent->open_count = 0;
+    ent->unlinked = 0;
+    ent->saved_in = NULL;
+    ent->saved_in_count = ent->saved_in_size = 0;
+    ent->meta_dirty = 0;
+    ent->saving = 0;
+    ent->journal_dirty = 0;
+    ent->journal_first = ent->journal_end = 0;
+    ent->lru_prev = ent->lru_next = NULL;
+    ent->lru_blocks = -1;
+    pthread_rwlock_init(&ent->lock, NULL);
+    inode_insert(ent);
+    return ent;
+}
+
+/* Returns NULL if the resulting path would be too long */
+struct mydirent* create_child(struct mydirent* parent, const char* name, int is_dir) {
+    int l = strlen(name);
+    if (get_path_length(parent) + l + is_dir > get_maximum_path_length()-12) {
+        return NULL;
+    }
+    return new_dirent(parent, name, l, is_dir);
+}
+
+/* 
+   Path ending in '/' creates a directory. 
+   Missing parent directories are created as well (directory may be loaded after its content).
+   Returns NULL if the path is too long or already exists.
+*/
+struct mydirent* create_dirent(const char* path) {
+    if (strlen(path) > get_maximum_path_length()-12) {
+        return NULL;
+    }
+    
+    int l = strlen(path);
+    int is_dir = (l>0 && path[l-1]=='/');
+    if (is_dir) --l;
+    
+    if (l == 0) {
+        if (root_dirent) return NULL;
+        root_dirent = new_dirent(NULL, "", 0, 1);
+        return root_dirent;
+    }
+    
+    if (find_dirent_len(path, l)) return NULL;
+    
+    int s = l;
+    while (s>0 && path[s-1]!='/') --s;
+    
+    struct mydirent* parent = find_dirent_len(path, s);
+    if (!parent) {
+        if (!root_dirent && s<=1) {
+            create_dirent("/");
+            parent = root_dirent;
+        } else {
+            char* parent_path = strndup(path, s);
+            parent = create_dirent(parent_path);
+            free(parent_path);
+        }
+        if (!parent) return NULL;
+    }
+    if (!is_directory(parent)) return NULL;
+    
+    return new_dirent(parent, path+s, l-s, is_dir);
+}
+
+
+/*
+   returns -1 on failure 
+*/
+int allocate_block_ll(int privileged_mode) {
+    int i;
+    long long free_count;
+    
+    if (!privileged_mode && busy_blocks_count*100.0 >= block_count*(100.0-reserved_percent)) {
+        //fprintf(stderr, "Not priv\n");
+        return -1; /* out of free space */
+    }
+    
+    free_count = bitmap_count_clear(busy_map);
+    if (free_count > 0) {
+        /* uniformly random free block, no matter how full the storage is */
+        unsigned long long int rrr;
+        random_bytes(&rrr, sizeof(rrr));
+        i = bitmap_find_nth_clear(busy_map, rrr % free_count);
+        if (i == user_first_block) {
+            fprintf(stderr, "Starting block is not used?\n");
+            i = bitmap_find_clear_wrap(busy_map, (i+1) % block_count);
+        }
+        if (i != -1 && i != user_first_block) {
+            bitmap_set(busy_map, i);
+            ++busy_blocks_count;
+            //fprintf(stderr, "Normal: %d\n", i);
+            return i;
+        }
+    }
+    
+    /* No more free blocks at all */
+    
+    if (privileged_mode) {
+        readonly_flag = 1;
+        /* Emergency measures: expand the storage file to save directory in it */
+        fprintf(stderr, "Expanding the data file to store the directory\n");
+        ++block_count;
+        ++busy_blocks_count;
+        bitmap_resize(busy_map, block_count);
+        bitmap_set(busy_map, block_count-1);
+        fprintf(stderr, "Emeg: %d\n", block_count-1);
+        return block_count-1;
+    }
+    
+    //fprintf(stderr, "Fail\n");
+    return -1; /* out of free space */
+}
+
+int allocate_block(int privileged_mode) {
+    pthread_mutex_lock(&alloc_lock);
+    int ret = allocate_block_ll(privileged_mode);
+    pthread_mutex_unlock(&alloc_lock);
     return ret;
 }
 
-int read_block_ll(unsigned char* buffer, int i) {
-    int fd = data;
-    off_t off = i*block_size;
-    size_t s = block_size;
-    while(s) {
-        int ret = pread(fd, buffer, s, off);
+#define ALLOCATE_RANDOM_CHUNK 64
+
+/* 
+   Allocates count random blocks in one pass: one reserve check, one lock, bulk randomness.
+   Fills blocks[i].num (iv is set to 0). Either all blocks are allocated or none.
+   returns 0 on failure
+*/
+int allocate_blocks(struct myblock* blocks, int count) {
+    unsigned long long rnd[ALLOCATE_RANDOM_CHUNK];
+    int i;
+    
+    pthread_mutex_lock(&alloc_lock);
+    if ((busy_blocks_count + (double)count)*100.0 > block_count*(100.0-reserved_percent) ||
+            bitmap_count_clear(busy_map) < count) {
+        pthread_mutex_unlock(&alloc_lock);
+        return 0; /* out of free space */
+    }
+    
+    for (i=0; i<count; ++i) {
+        long long free_count = bitmap_count_clear(busy_map);
+        int b;
+        if (i % ALLOCATE_RANDOM_CHUNK == 0) {
+            random_bytes(rnd, sizeof(rnd[0]) * imin(count - i, ALLOCATE_RANDOM_CHUNK));
+        }
+        b = bitmap_find_nth_clear(busy_map, rnd[i % ALLOCATE_RANDOM_CHUNK] % free_count);
+        if (b == user_first_block) {
+            fprintf(stderr, "Starting block is not used?\n");
+            b = bitmap_find_clear_wrap(busy_map, (b+1) % block_count);
+            if (b == -1 || b == user_first_block) break;
+        }
+        bitmap_set(busy_map, b);
+        ++busy_blocks_count;
+        blocks[i].num = b;
+        blocks[i].iv = 0;
+    }
+    
+    if (i < count) {
+        /* roll back */
+        while (i--) {
+            bitmap_clear(busy_map, blocks[i].num);
+            --busy_blocks_count;
+        }
+        pthread_mutex_unlock(&alloc_lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return 1;
+}
+
+void mark_unused_block(int i) {
+    pthread_mutex_lock(&alloc_lock);
+    if (!bitmap_clear(busy_map, i)) {
+        fprintf(stderr, "Freeing not occupied block %d\n", i);
+    } else {
+        --busy_blocks_count;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+void shred_block(int i) {
+    if (no_shred) return;
+    struct thread_state* ts = get_thread_state();
+    if (!ts) return;
+    random_bytes(ts->shred_buffer, block_size);
+    write_block_ll(ts->shred_buffer, i);
+}
+
+/* Overwrites a random free block with random data */
+void cover_write_once(unsigned char* buffer) {
+    unsigned long long r;
+    long long free_count;
+    int target = -1;
+    random_bytes(&r, sizeof(r));
+    pthread_mutex_lock(&alloc_lock);
+    free_count = bitmap_count_clear(busy_map);
+    if (free_count > 0) target = bitmap_find_nth_clear(busy_map, r % free_count);
+    /* keep the block from being allocated while we are overwriting it */
+    if (target!= -1) bitmap_set(busy_map, target);
+    pthread_mutex_unlock(&alloc_lock);
+    
+    if (target!= -1) {
+        random_bytes(buffer, block_size);
+        write_block_ll(buffer, target);
+        pthread_mutex_lock(&alloc_lock);
+        bitmap_clear(busy_map, target);
+        pthread_mutex_unlock(&alloc_lock);
+    }
+}
+
+/*
+   First blocks of the branches given at mount, marked used before any branch is loaded.
+   A branch marking one of them again overlaps another branch (or itself).
+*/
+int* branch_roots;
+int branch_roots_count;
+int branch_root_collision;
+
+void mark_used_block(int i) {
+    int j;
+    pthread_mutex_lock(&alloc_lock);
+    if (bitmap_set(busy_map, i)) {
+        fprintf(stderr, "Marking the block %d twice\n", i);
+        for (j=0; j<branch_roots_count; ++j) {
+            if (branch_roots[j] == i) branch_root_collision = 1;
+        }
+    } else {
+        ++busy_blocks_count;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+/* Marks the block used unless it already is, branches may be loaded concurrently. Returns 1 if it was free. */
+int mark_used_block_if_free(int i) {
+    int was_free = 0;
+    pthread_mutex_lock(&alloc_lock);
+    if (!bitmap_set(busy_map, i)) {
+        ++busy_blocks_count;
+        was_free = 1;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return was_free;
+}
+
+
+int nearest_power_of_two(int s) {
+    int r=1;
+    while(r<s) r*=2;
+    return r;
+}
+
+/* Writes (or reads) the whole iovec array, returns 0 on failure */
+int rwv_full(int fd, struct iovec* iov, int count, off_t off, int write) {
+    while (count) {
+        ssize_t ret = write ? pwritev(fd, iov, imin(count, IOV_MAX), off)
+                            : preadv(fd, iov, imin(count, IOV_MAX), off);
         if (ret<=0) {
-            if (errno==EINTR || errno==EAGAIN) continue;
+            if (ret<0 && (errno==EINTR || errno==EAGAIN)) continue;
+            if (write) perror("pwritev");
             return 0;
         }
-        off+=ret;
-        s-=ret;
+        off += ret;
+        while (count && ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (ret) {
+            iov->iov_base = (char*)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
     }
     return 1;
 }
 
-int read_block(unsigned char* buffer, struct myblock *block) {
-    int i = block->num;
-    int ret = read_block_ll(mcrypt_buf, i);
-    if (!ret) return 0;
-    if (mcrypt == MCRYPT_FAILED) {
-        memcpy(buffer, mcrypt_buf, block_size);   
-    } else {
-        int ret = read_block_ll(mcrypt_buf, i);
-        if (!ret) return 0;
+/* A block of a multi-block request: its number and position in the request */
+struct io_slot {
+    int num;
+    int k;
+};
+
+int compare_io_slots(const void* a, const void* b) {
+    int x = ((const struct io_slot*)a)->num;
+    int y = ((const struct io_slot*)b)->num;
+    return (x > y) - (x < y);
+}
+
+/* Overwrites the blocks with random data */
+void shred_blocks(int* blocks, int count, unsigned char* buffer) {
+    unsigned char* buffers[SHRED_BATCH];
+    int i;
+    
+    random_bytes(buffer, (size_t)count*block_size);
+    for (i=0; i<count; ++i) {
+        buffers[i] = buffer + (size_t)i*block_size;
+    }
+    rw_blocks_ll(buffers, blocks, count, 1);
+}
+
+void* shred_thread_func(void* arg) {
+    int batch[SHRED_BATCH];
+    unsigned char* buffer = (unsigned char*) valloc((size_t)SHRED_BATCH*block_size);
+    int i, n;
+    
+    pthread_mutex_lock(&shred_lock);
+    for(;;) {
+        while (!shred_queue_count && !shred_thread_stop) {
+            pthread_cond_wait(&shred_cond, &shred_lock);
+        }
+        if (!shred_queue_count) break;
         
-        int s = imin(sizeof(block->iv), mcrypt_ivsize);
-        memset(mcrypt_ivbuf, 0, mcrypt_ivsize);
-        memcpy(mcrypt_ivbuf, &block->iv, s);
+        n = imin(shred_queue_count, SHRED_BATCH);
+        shred_queue_count -= n;
+        memcpy(batch, shred_queue + shred_queue_count, n*sizeof(*batch));
+        shred_in_flight = n;
+        pthread_mutex_unlock(&shred_lock);
         
-        if(mcrypt_generic_init(mcrypt, mcrypt_key, mcrypt_keysize/8, mcrypt_ivbuf) < 0) return 0;
-        if(mdecrypt_generic (mcrypt, mcrypt_buf, block_size) < 0) return 0;
-        mcrypt_generic_deinit(mcrypt);
+        shred_blocks(batch, n, buffer);
+        for (i=0; i<n; ++i) mark_unused_block(batch[i]);
+        
+        pthread_mutex_lock(&shred_lock);
+        shred_in_flight = 0;
+        pthread_cond_broadcast(&shred_done_cond);
     }
-    memcpy(buffer, mcrypt_buf, block_size);    
-    return 0;
+    pthread_mutex_unlock(&shred_lock);
+    free(buffer);
+    return NULL;
 }
 
-int read_block_simple(unsigned char* buffer, int i) {
-    struct myblock b;
-    b.num = i;
-    b.iv = htobe32(i);    
-    int ret = read_block(buffer, &b);
-    if (mcrypt!=MCRYPT_FAILED) xor_scrable_buffer(buffer);
-    return ret;
+/* Frees the block once it is shredded */
+void release_block(int i) {
+    if (journal_replaying) {
+        /* the block may be taken by another entry later in the same commit */
+        if (replay_released_count == replay_released_size) {
+            replay_released_size = replay_released_size ? replay_released_size*2 : 256;
+            replay_released = (int*) realloc(replay_released, replay_released_size*sizeof(int));
+        }
+        replay_released[replay_released_count++] = i;
+        return;
+    }
+    if (no_shred) {
+        mark_unused_block(i);
+        return;
+    }
+    pthread_mutex_lock(&shred_lock);
+    if (!shred_thread_running) {
+        pthread_mutex_unlock(&shred_lock);
+        shred_block(i);
+        mark_unused_block(i);
+        return;
+    }
+    if (shred_queue_count == shred_queue_size) {
+        shred_queue_size = shred_queue_size ? shred_queue_size*2 : 1024;
+        shred_queue = (int*) realloc(shred_queue, shred_queue_size*sizeof(*shred_queue));
+    }
+    shred_queue[shred_queue_count++] = i;
+    pthread_cond_signal(&shred_cond);
+    pthread_mutex_unlock(&shred_lock);
 }
 
-int get_maximum_path_length() {
-    size_t dirent_size = 0;
-    dirent_size += 4; /* full_path string length */
-    dirent_size += 8; /* file length */
-    //int bc = get_block_count_for_length(ent->length);
-    //dirent_size += 4*bc; /* block list */
+/* Waits until all queued blocks are shredded and free. Returns 1 if there was anything to wait for. */
+int drain_shred_queue() {
+    int waited = 0;
+    pthread_mutex_lock(&shred_lock);
+    while (shred_thread_running && (shred_queue_count || shred_in_flight)) {
+        waited = 1;
+        pthread_cond_wait(&shred_done_cond, &shred_lock);
+    }
+    pthread_mutex_unlock(&shred_lock);
+    return waited;
+}
+
+#define COVER_TICK_MS 100
+#define COVER_MAX_BURST 64
+
+void* cover_thread_func(void* arg) {
+    unsigned char* buffer = (unsigned char*) valloc(block_size);
+    double budget = 0;
+    int seen_writes = foreground_block_writes;
     
-    dirent_size += 4; /* number of blocks in this extent */
-    dirent_size += 4; /* starting block in this extend */
-    // If we can't save all block numbers in this block, we save further block numbers in next blocks
+    /* stay out of the way of foreground IO */
+    syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, (int)syscall(SYS_gettid), (3 << 13) /* IOPRIO_CLASS_IDLE */);
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
     
-    dirent_size+=16; /* there should be room for at least 2 blocks or this is not serious */
+    pthread_mutex_lock(&cover_lock);
+    for(;;) {
+        /* jittered tick, so cover writes don't form a regular pattern */
+        unsigned int r;
+        random_bytes(&r, sizeof(r));
+        long tick_ns = (COVER_TICK_MS/2 + r % COVER_TICK_MS) * 1000000L;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += tick_ns;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        if (!cover_thread_stop) {
+            pthread_cond_timedwait(&cover_cond, &cover_lock, &deadline);
+        }
+        int stop = cover_thread_stop;
+        pthread_mutex_unlock(&cover_lock);
+        
+        int writes = foreground_block_writes;
+        /* on unmount only the share owed to foreground writes is done */
+        if (!stop) budget += cover_writes_per_sec * tick_ns / 1e9;
+        budget += (writes - seen_writes) * random_shred_probability / 1000.0;
+        seen_writes = writes;
+        if (budget > COVER_MAX_BURST) budget = COVER_MAX_BURST;
+        
+        while (budget >= 1) {
+            budget -= 1;
+            if (readonly_flag) continue;
+            cover_write_once(buffer);
+        }
+        if (stop) break;
+        
+        pthread_mutex_lock(&cover_lock);
+    }
+    free(buffer);
+    return NULL;
+}
+
+void start_cover_thread() {
+    if (cover_writes_per_sec <= 0 && random_shred_probability <= 0) return;
+    cover_thread_stop = 0;
+    if (pthread_create(&cover_thread, NULL, &cover_thread_func, NULL)) {
+        perror("pthread_create");
+        return;
+    }
+    cover_thread_running = 1;
+}
+
+void stop_cover_thread() {
+    if (!cover_thread_running) return;
+    pthread_mutex_lock(&cover_lock);
+    cover_thread_stop = 1;
+    pthread_cond_signal(&cover_cond);
+    pthread_mutex_unlock(&cover_lock);
+    pthread_join(cover_thread, NULL);
+    cover_thread_running = 0;
+}
+
+void start_shred_thread() {
+    if (no_shred) return;
+    shred_thread_stop = 0;
+    if (pthread_create(&shred_thread, NULL, &shred_thread_func, NULL)) {
+        perror("pthread_create");
+        return;
+    }
+    shred_thread_running = 1;
+}
+
+/* Shreds everything still queued and stops the thread */
+void stop_shred_thread() {
+    pthread_mutex_lock(&shred_lock);
+    if (!shred_thread_running) {
+        pthread_mutex_unlock(&shred_lock);
+        return;
+    }
+    shred_thread_stop = 1;
+    pthread_cond_signal(&shred_cond);
+    pthread_mutex_unlock(&shred_lock);
+    
+    pthread_join(shred_thread, NULL);
+    
+    pthread_mutex_lock(&shred_lock);
+    shred_thread_running = 0;
+    pthread_mutex_unlock(&shred_lock);
+}
+
+/*
+   Cache of decrypted file blocks shared by all handles, keyed by (dirent, block index).
+   
+   Replacement is 2Q: blocks seen once go to the A1in FIFO, so a long sequential scan
+   only cycles through it. Blocks hit again (or remembered in the A1out ghost list
+   after eviction from A1in) go to the Am LRU.
+   
+   Data and the dirty flag of an entry are protected by the lock of its dirent:
+   readers hold it for reading, writers for writing. Everything else is protected by cache_lock.
+   Entries with refs != 0 are not evicted.
+   Dirty entries are written back on eviction, on release and before saving the directory.
+*/
+
+#define CACHE_A1IN 0  /* resident, seen once, FIFO */
+#define CACHE_AM 1    /* resident, seen more than once, LRU */
+#define CACHE_A1OUT 2 /* ghost, evicted from A1in recently, no data */
+#define CACHE_FREE 3  /* unused resident entries */
+#define CACHE_GHOST_FREE 4 /* unused ghost entries */
+#define CACHE_QUEUES 5
+
+struct cache_entry {
+    struct mydirent* ent; /* NULL if not hashed */
+    int index;
+    int queue;
+    int refs;
+    int dirty;
+    int loading;
+    unsigned char* data;
+    struct cache_entry *prev, *next; /* in the queue, head is the most recent */
+    struct cache_entry *hash_next;
+};
+
+struct cache_queue {
+    struct cache_entry *head, *tail;
+    int count;
+};
+
+long long block_cache_bytes = 4*1024*1024;
+int cache_capacity;
+int cache_ghost_capacity;
+int cache_a1in_target;
+struct cache_entry* cache_entries;
+unsigned char* cache_arena;
+struct cache_entry** cache_hash;
+int cache_hash_size;
+struct cache_entry** cache_flush_list; /* used by cache_flush_all under save_lock */
+struct mydirent** cache_flush_ents;
+struct cache_queue cache_queues[CACHE_QUEUES];
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+
+static unsigned int cache_hash_of(const struct mydirent* ent, int index) {
+    uintptr_t h = (uintptr_t)ent / sizeof(void*);
+    h = h * 0x9E3779B1u + (unsigned int)index;
+    h ^= h >> 15;
+    return (unsigned int)h % cache_hash_size;
+}
+
+static void cache_queue_remove(struct cache_entry* e) {
+    struct cache_queue* q = &cache_queues[e->queue];
+    if (e->prev) e->prev->next = e->next; else q->head = e->next;
+    if (e->next) e->next->prev = e->prev; else q->tail = e->prev;
+    e->prev = e->next = NULL;
+    --q->count;
+}
+
+static void cache_queue_push(struct cache_entry* e, int queue) {
+    struct cache_queue* q = &cache_queues[queue];
+    e->queue = queue;
+    e->prev = NULL;
+    e->next = q->head;
+    if (q->head) q->head->prev = e; else q->tail = e;
+    q->head = e;
+    ++q->count;
+}
+
+static void cache_hash_insert(struct cache_entry* e, struct mydirent* ent, int index) {
+    unsigned int h = cache_hash_of(ent, index);
+    e->ent = ent;
+    e->index = index;
+    e->hash_next = cache_hash[h];
+    cache_hash[h] = e;
+}
+
+static void cache_hash_remove(struct cache_entry* e) {
+    struct cache_entry** p = &cache_hash[cache_hash_of(e->ent, e->index)];
+    while (*p != e) p = &(*p)->hash_next;
+    *p = e->hash_next;
+    e->ent = NULL;
+    e->hash_next = NULL;
+}
+
+/* Marks the entry that was read by cache_get_ll's caller as ready */
+static void cache_loaded(struct cache_entry* e) {
+    pthread_mutex_lock(&cache_lock);
+    e->loading = 0;
+    pthread_cond_broadcast(&cache_cond);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_put(struct cache_entry* e) {
+    pthread_mutex_lock(&cache_lock);
+    --e->refs;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* The entry could not be read: it is dropped, whoever waits for it finds it unhashed */
+static void cache_load_failed(struct cache_entry* e) {
+    pthread_mutex_lock(&cache_lock);
+    cache_hash_remove(e);
+    e->loading = 0;
+    pthread_cond_broadcast(&cache_cond);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* returns 0 if the entry could not be read */
+static int cache_wait_loaded(struct cache_entry* e) {
+    pthread_mutex_lock(&cache_lock);
+    while (e->loading) pthread_cond_wait(&cache_cond, &cache_lock);
+    int ok = (e->ent != NULL);
+    pthread_mutex_unlock(&cache_lock);
+    return ok;
+}
+
+static struct cache_entry* cache_lookup(const struct mydirent* ent, int index) {
+    struct cache_entry* e = cache_hash[cache_hash_of(ent, index)];
+    while (e && (e->ent != ent || e->index != index)) e = e->hash_next;
+    return e;
+}
+
+/* returns -1 on failure */
+int cache_init() {
+    int i;
+    cache_capacity = block_cache_bytes / block_size;
+    if (cache_capacity < 8) cache_capacity = 8;
+    cache_ghost_capacity = cache_capacity / 2;
+    cache_a1in_target = cache_capacity / 4;
+    cache_hash_size = (cache_capacity + cache_ghost_capacity) * 2 + 1;
+    
+    cache_entries = (struct cache_entry*) calloc(cache_capacity + cache_ghost_capacity, sizeof(struct cache_entry));
+    cache_hash = (struct cache_entry**) calloc(cache_hash_size, sizeof(struct cache_entry*));
+    cache_flush_list = (struct cache_entry**) malloc(cache_capacity * sizeof(struct cache_entry*));
+    cache_flush_ents = (struct mydirent**) malloc(cache_capacity * sizeof(struct mydirent*));
+    cache_arena = (unsigned char*) valloc((size_t)cache_capacity * block_size);
+    if (!cache_entries || !cache_hash || !cache_flush_list || !cache_flush_ents || !cache_arena) return -1;
+    
+    for (i=0; i<cache_capacity + cache_ghost_capacity; ++i) {
+        struct cache_entry* e = &cache_entries[i];
+        if (i < cache_capacity) {
+            e->data = cache_arena + (size_t)i * block_size;
+            cache_queue_push(e, CACHE_FREE);
+        } else {
+            cache_queue_push(e, CACHE_GHOST_FREE);
+        }
+    }
+    return 0;
+}
+
+/* 
+   Decrypted data should not end up in swap. Memory locks don't survive fork,
+   so the daemon does this itself. returns -1 on failure
+*/
+int cache_mlock() {
+    return mlock(cache_arena, (size_t)cache_capacity * block_size) ? -1 : 0;
+}
+
+void cache_destroy() {
+    if (cache_arena) {
+        memset(cache_arena, 0, (size_t)cache_capacity * block_size);
+        munlock(cache_arena, (size_t)cache_capacity * block_size);
+    }
+    free(cache_arena);
+    free(cache_entries);
+    free(cache_hash);
+    free(cache_flush_list);
+    free(cache_flush_ents);
+}
+
+/* 
+   Writes the dirty entry back. Caller holds the write lock of e->ent.
+   returns 0 on failure, the entry stays dirty and the block keeps its old IV then
+*/
+static int cache_write_back(struct cache_entry* e) {
+    struct myblock b = e->ent->blocks[e->index];
+    if (!write_block(e->data, &b)) {
+        readonly_flag=1;
+        return 0;
+    }
+    e->ent->blocks[e->index] = b;
+    e->dirty = 0;
+    /* the block got a new IV, the directory needs to be saved */
+    mark_ent_blocks_dirty(e->ent, e->index, e->index+1);
+    mark_dirty();
+    return 1;
+}
+
+/* Remembers the key of the entry evicted from A1in */
+static void cache_add_ghost(struct mydirent* ent, int index) {
+    struct cache_entry* g;
+    if (!cache_ghost_capacity) return;
+    if (cache_queues[CACHE_GHOST_FREE].count) {
+        g = cache_queues[CACHE_GHOST_FREE].tail;
+    } else {
+        g = cache_queues[CACHE_A1OUT].tail;
+        cache_hash_remove(g);
+    }
+    cache_queue_remove(g);
+    cache_hash_insert(g, ent, index);
+    cache_queue_push(g, CACHE_A1OUT);
+}
+
+/* 
+   Tries to evict the unreferenced entry. A dirty one is written back without cache_lock,
+   taken out of the queues meanwhile, and stays if it got referenced by then.
+   self_ent is the dirent the caller holds the write lock of, or NULL.
+   returns 1 if evicted or cache_lock was released (the queues have to be looked at again),
+   0 if it can't go now. One failing to be written back is put first in its queue.
+*/
+static int cache_try_evict(struct cache_entry* e, struct mydirent* self_ent) {
+    struct mydirent* ent = e->ent;
+    int index = e->index;
+    int queue = e->queue;
+    if (e->refs) return 0;
+    if (!ent) {
+        /* dropped while referenced */
+        cache_queue_remove(e);
+        cache_queue_push(e, CACHE_FREE);
+        return 1;
+    }
+    if (e->dirty) {
+        /* lock order is dirent -> cache, so only try */
+        if (ent != self_ent && pthread_rwlock_trywrlock(&ent->lock)) return 0;
+        cache_queue_remove(e);
+        pthread_mutex_unlock(&cache_lock);
+        int written = cache_write_back(e);
+        pthread_mutex_lock(&cache_lock);
+        if (ent != self_ent) pthread_rwlock_unlock(&ent->lock);
+        cache_queue_push(e, queue);
+        /* cache_flush_all took it meanwhile */
+        if (e->refs) return 1;
+        /* it holds the only copy of the data, so it stays (first in the queue now) */
+        if (!written) return 0;
+    }
+    cache_hash_remove(e);
+    cache_queue_remove(e);
+    cache_queue_push(e, CACHE_FREE);
+    if (queue == CACHE_A1IN) cache_add_ghost(ent, index);
+    return 1;
+}
+
+/* 
+   Makes a free entry available. Caller holds cache_lock, which may be released meanwhile.
+   returns 0 if everything is in use, otherwise the caller looks for a free entry again.
+*/
+static int cache_reclaim(struct mydirent* self_ent) {
+    struct cache_entry* e;
+    int first = cache_queues[CACHE_A1IN].count > cache_a1in_target ? CACHE_A1IN : CACHE_AM;
+    int second = (first == CACHE_A1IN) ? CACHE_AM : CACHE_A1IN;
+    
+    if (cache_queues[CACHE_FREE].count) return 1;
+    for (e = cache_queues[first].tail; e; e = e->prev) {
+        if (cache_try_evict(e, self_ent)) return 1;
+    }
+    for (e = cache_queues[second].tail; e; e = e->prev) {
+        if (cache_try_evict(e, self_ent)) return 1;
+    }
+    return 0;
+}
+
+/*
+   Like cache_get, but if must_load is not NULL nothing is read and nothing is waited for:
+   a new entry is returned with loading set and *must_load set to 1, for the caller
+   to read it and call cache_loaded. Entries being loaded by others need cache_wait_loaded.
+*/
+static struct cache_entry* cache_get_ll(struct mydirent* ent, int index, int load, int write_locked, int* must_load) {
+    struct cache_entry* e;
+    int queue = CACHE_A1IN;
+    
+    pthread_mutex_lock(&cache_lock);
+    /* reclaiming may release cache_lock, so the block can get cached by others meanwhile */
+    for (;;) {
+        e = cache_lookup(ent, index);
+        if (e && e->queue != CACHE_A1OUT) {
+            ++e->refs;
+            if (e->queue == CACHE_AM) {
+                cache_queue_remove(e);
+                cache_queue_push(e, CACHE_AM);
+            }
+            while (e->loading && !must_load) pthread_cond_wait(&cache_cond, &cache_lock);
+            if (!e->ent) {
+                /* its read failed */
+                --e->refs;
+                e = NULL;
+            }
+            pthread_mutex_unlock(&cache_lock);
+            return e;
+        }
+        if (e) {
+            /* seen recently - promote to the main queue */
+            cache_hash_remove(e);
+            cache_queue_remove(e);
+            cache_queue_push(e, CACHE_GHOST_FREE);
+            queue = CACHE_AM;
+        }
+        if (cache_queues[CACHE_FREE].count) break;
+        if (!cache_reclaim(write_locked ? ent : NULL)) {
+            pthread_mutex_unlock(&cache_lock);
+            return NULL;
+        }
+    }
+    e = cache_queues[CACHE_FREE].head;
+    cache_queue_remove(e);
+    cache_queue_push(e, queue);
+    cache_hash_insert(e, ent, index);
+    e->refs = 1;
+    e->dirty = 0;
+    e->loading = load;
+    pthread_mutex_unlock(&cache_lock);
+    
+    if (load && must_load) {
+        *must_load = 1;
+    } else if (load) {
+        if (!read_block(e->data, &ent->blocks[index])) {
+            cache_load_failed(e);
+            cache_put(e);
+            return NULL;
+        }
+        cache_loaded(e);
+    }
+    return e;
+}
+
+/*
+   Returns the referenced cache entry for the block, reading it if not cached and load is set
+   (otherwise the content of a new entry is undefined, for the caller to overwrite it fully).
+   Caller holds ent->lock, for writing if write_locked.
+   Returns NULL if all entries are in use or the block can't be read, the caller should 
+   bypass the cache then (and gets the read error there).
+*/
+struct cache_entry* cache_get(struct mydirent* ent, int index, int load, int write_locked) {
+    return cache_get_ll(ent, index, load, write_locked, NULL);
+}
+
+/* Blocks got in one batch, enough for a 1 MiB read of 4 KiB blocks. IO_QUEUE_DEPTH still limits requests in flight. */
+#define CACHE_RANGE_MAX 256
+
+/*
+   Gets referenced entries for blocks [first, first+count) of ent, count <= CACHE_RANGE_MAX.
+   The missing blocks are read with one batch of requests and decrypted afterwards.
+   Caller holds ent->lock for reading.
+   Returns the number of entries got, less than count if the cache is too busy.
+   -1 if a block can't be read, nothing is referenced then.
+*/
+int cache_get_range(struct mydirent* ent, int first, int count, struct cache_entry** out) {
+    unsigned char* buffers[CACHE_RANGE_MAX];
+    int nums[CACHE_RANGE_MAX];
+    struct cache_entry* loads[CACHE_RANGE_MAX];
+    int i, got, n = 0;
+    
+    /* don't pin more than a quarter of the cache */
+    count = imin(count, imin(CACHE_RANGE_MAX, cache_capacity / 4));
+    for (got=0; got<count; ++got) {
+        int must_load = 0;
+        struct cache_entry* e = cache_get_ll(ent, first + got, 1, 0, &must_load);
+        if (!e) break;
+        out[got] = e;
+        if (must_load) {
+            loads[n] = e;
+            buffers[n] = e->data;
+            nums[n] = ent->blocks[first + got].num;
+            ++n;
+        }
+    }
+    
+    int ok = 1;
+    if (n) {
+        ok = rw_blocks_ll(buffers, nums, n, 0);
+        for (i=0; i<n; ++i) {
+            if (ok && decrypt_block(loads[i]->data, &ent->blocks[loads[i]->index])) {
+                cache_loaded(loads[i]);
+            } else {
+                cache_load_failed(loads[i]);
+            }
+        }
+    }
+    ok = 1;
+    for (i=0; i<got; ++i) ok = cache_wait_loaded(out[i]) && ok;
+    if (!ok) {
+        for (i=0; i<got; ++i) cache_put(out[i]);
+        return -1;
+    }
+    return got;
+}
+
+/* 
+   Forgets cached blocks of ent starting from first_index without writing them.
+   Caller holds ent->lock for writing or ent is not reachable anymore.
+*/
+void cache_drop(struct mydirent* ent, int first_index) {
+    int i;
+    pthread_mutex_lock(&cache_lock);
+    for (i=0; i<cache_capacity + cache_ghost_capacity; ++i) {
+        struct cache_entry* e = &cache_entries[i];
+        if (e->ent != ent || e->index < first_index) continue;
+        cache_hash_remove(e);
+        e->dirty = 0;
+        if (e->refs) continue; /* cache_flush_all still has it, gets evicted later */
+        cache_queue_remove(e);
+        cache_queue_push(e, e->data ? CACHE_FREE : CACHE_GHOST_FREE);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* 
+   Writes back dirty blocks of ent. Caller holds ent->lock for writing,
+   so dirty entries of ent can't be evicted or change while we are here.
+*/
+void cache_flush_ent(struct mydirent* ent) {
+    int i;
+    for (i=0; i<cache_capacity; ++i) {
+        struct cache_entry* e = &cache_entries[i];
+        int match;
+        pthread_mutex_lock(&cache_lock);
+        match = (e->ent == ent && e->dirty);
+        pthread_mutex_unlock(&cache_lock);
+        if (match) cache_write_back(e);
+    }
+}
+
+/* Writes back all dirty blocks. Caller holds tree_lock, so dirents can't go away */
+void cache_flush_all() {
+    int i, n = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (i=0; i<cache_capacity; ++i) {
+        struct cache_entry* e = &cache_entries[i];
+        if (e->ent && e->dirty) {
+            ++e->refs;
+            cache_flush_ents[n] = e->ent;
+            cache_flush_list[n++] = e;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    
+    for (i=0; i<n; ++i) {
+        struct cache_entry* e = cache_flush_list[i];
+        struct mydirent* ent = cache_flush_ents[i];
+        pthread_rwlock_wrlock(&ent->lock);
+        /* it could have been truncated away meanwhile */
+        if (e->ent == ent && e->dirty) cache_write_back(e);
+        pthread_rwlock_unlock(&ent->lock);
+        cache_put(e);
+    }
+}
+
+/* Loads blocks [first, first+count) into the cache, except what is beyond the end of the file by now */
+static void readahead_blocks(struct mydirent* ent, int first, int count) {
+    struct cache_entry* got[CACHE_RANGE_MAX];
+    int i, n;
+    pthread_rwlock_rdlock(&ent->lock);
+    count = imin(count, get_block_count_for_length(ent->length) - first);
+    while (count > 0) {
+        n = cache_get_range(ent, first, count, got);
+        for (i=0; i<n; ++i) cache_put(got[i]);
+        if (n <= 0) break;
+        first += n;
+        count -= n;
+    }
+    pthread_rwlock_unlock(&ent->lock);
+}
+
+void* readahead_thread_func(void* arg) {
+    pthread_mutex_lock(&readahead_lock);
+    for(;;) {
+        while (!readahead_queue_count && !readahead_thread_stop) {
+            pthread_cond_wait(&readahead_cond, &readahead_lock);
+        }
+        if (readahead_thread_stop) break;
+        
+        /* take the whole run of consecutive blocks of the file, to read them in one batch */
+        struct readahead_req r = readahead_queue[readahead_queue_head];
+        int n = 0;
+        do {
+            readahead_queue_head = (readahead_queue_head + 1) % readahead_queue_size;
+            --readahead_queue_count;
+            ++n;
+        } while (readahead_queue_count && n < CACHE_RANGE_MAX &&
+                 readahead_queue[readahead_queue_head].h == r.h &&
+                 readahead_queue[readahead_queue_head].index == r.index + n);
+        pthread_mutex_unlock(&readahead_lock);
+        
+        readahead_blocks(r.h->ent, r.index, n);
+        
+        pthread_mutex_lock(&readahead_lock);
+        r.h->readahead_refs -= n;
+        pthread_cond_broadcast(&readahead_done_cond);
+    }
+    pthread_mutex_unlock(&readahead_lock);
+    return NULL;
+}
+
+/* Queues blocks [first, end) of the handle's file. Requests that don't fit in the queue are dropped. */
+void readahead_queue_blocks(struct myhandle* h, int first, int end) {
+    int i;
+    pthread_mutex_lock(&readahead_lock);
+    for (i=first; i<end && readahead_queue_count < readahead_queue_size; ++i) {
+        struct readahead_req* r = &readahead_queue[(readahead_queue_head + readahead_queue_count) % readahead_queue_size];
+        r->h = h;
+        r->index = i;
+        ++readahead_queue_count;
+        ++h->readahead_refs;
+    }
+    pthread_cond_broadcast(&readahead_cond);
+    pthread_mutex_unlock(&readahead_lock);
+}
+
+/* Drops queued readahead of the handle and waits for its requests already being loaded */
+void readahead_cancel(struct myhandle* h) {
+    int i, n = 0;
+    pthread_mutex_lock(&readahead_lock);
+    for (i=0; i<readahead_queue_count; ++i) {
+        struct readahead_req r = readahead_queue[(readahead_queue_head + i) % readahead_queue_size];
+        if (r.h == h) {
+            --h->readahead_refs;
+            continue;
+        }
+        readahead_queue[(readahead_queue_head + n) % readahead_queue_size] = r;
+        ++n;
+    }
+    readahead_queue_count = n;
+    while (h->readahead_refs) {
+        pthread_cond_wait(&readahead_done_cond, &readahead_lock);
+    }
+    pthread_mutex_unlock(&readahead_lock);
+}
+
+#define READAHEAD_MIN_BLOCKS 4
+
+/*
+   Called for every read of the handle, with ent->lock held. A read starting where the previous
+   one ended continues the stream. Each time the reader gets into the second half of the window,
+   the window is doubled (up to readahead_max_blocks) and the blocks up to its end are queued.
+   Any other read resets the window.
+*/
+void readahead_update(struct myhandle* h, long long int offset, size_t size) {
+    struct mydirent* ent = h->ent;
+    int first = -1, end = 0;
+    if (!readahead_threads_running || !size) return;
+    
+    int last = (offset + size - 1) / block_size;
+    int file_blocks = get_block_count_for_length(ent->length);
+    
+    pthread_mutex_lock(&h->lock);
+    if (offset != h->ra_next_offset) {
+        h->ra_window = 0;
+        h->ra_end = 0;
+    } else if (!h->ra_window) {
+        h->ra_window = imin(READAHEAD_MIN_BLOCKS, readahead_max_blocks);
+    }
+    h->ra_next_offset = offset + size;
+    
+    if (h->ra_window && last + 1 + h->ra_window / 2 >= h->ra_end) {
+        /* the reader got into the second half of the prefetched blocks (or past them) */
+        if (h->ra_end) h->ra_window = imin(h->ra_window * 2, readahead_max_blocks);
+        first = (h->ra_end > last) ? h->ra_end : last + 1;
+        end = imin(last + 1 + h->ra_window, file_blocks);
+        if (end > h->ra_end) h->ra_end = end;
+    }
+    pthread_mutex_unlock(&h->lock);
+    
+    if (first >= 0 && first < end) readahead_queue_blocks(h, first, end);
+}
+
+void start_readahead_threads() {
+    int i;
+    /* prefetched blocks must survive in A1in until the reader gets to them */
+    readahead_max_blocks = readahead_max_bytes / block_size;
+    if (readahead_max_blocks > cache_a1in_target / 2) readahead_max_blocks = cache_a1in_target / 2;
+    if (readahead_threads_count <= 0 || readahead_max_blocks <= 0) return;
+    
+    readahead_queue_size = cache_a1in_target;
+    readahead_queue = (struct readahead_req*) malloc(readahead_queue_size * sizeof(*readahead_queue));
+    readahead_threads = (pthread_t*) malloc(readahead_threads_count * sizeof(*readahead_threads));
+    if (!readahead_queue || !readahead_threads) return;
+    readahead_queue_head = 0;
+    readahead_queue_count = 0;
+    readahead_thread_stop = 0;
+    for (i=0; i<readahead_threads_count; ++i) {
+        if (pthread_create(&readahead_threads[i], NULL, &readahead_thread_func, NULL)) {
+            perror("pthread_create");
+            break;
+        }
+    }
+    readahead_threads_running = i;
+}
+
+/* Queued requests are dropped, handles are released before this */
+void stop_readahead_threads() {
+    int i;
+    if (!readahead_threads_running) return;
+    pthread_mutex_lock(&readahead_lock);
+    readahead_thread_stop = 1;
+    pthread_cond_broadcast(&readahead_cond);
+    pthread_mutex_unlock(&readahead_lock);
+    for (i=0; i<readahead_threads_running; ++i) {
+        pthread_join(readahead_threads[i], NULL);
+    }
+    readahead_threads_running = 0;
+    free(readahead_threads);
+    free(readahead_queue);
+}
+
+int get_block_count_for_length(long long int size) {
+    int bc = (size - 1) / block_size + 1;
+    if (size == 0) bc = 0;
+    return bc;
+}
+
+/* 
+   Like ensure_size, but new blocks lying entirely within [overwrite_start, overwrite_end)
+   are not zero-filled because the caller is about to overwrite them completely.
+   returns 0 on failure, 1 on success
+*/
+#define ZERO_FILL_BATCH 64
+
+/* 
+   Writes blocks [first, end) of ent zeroed with new IVs, in batches, except the ones 
+   within [overwrite_start, overwrite_end). returns 0 on failure
+*/
+static int zero_fill_blocks(struct mydirent* ent, int first, int end, long long int overwrite_start, long long int overwrite_end) {
+    unsigned char* buffers[ZERO_FILL_BATCH];
+    int nums[ZERO_FILL_BATCH];
+    int i, n = 0, ok = 1;
+    memset(buffers, 0, sizeof(buffers));
+    for (i=first; i<end && ok; ++i) {
+        long long int block_start = (long long int)i*block_size;
+        if (block_start >= overwrite_start && block_start+block_size <= overwrite_end) continue;
+        if (!buffers[n]) buffers[n] = (unsigned char*) valloc(block_size);
+        if (!buffers[n]) { ok = 0; break; }
+        memset(buffers[n], 0, block_size);
+        ok = encrypt_block(buffers[n], &ent->blocks[i]);
+        nums[n++] = ent->blocks[i].num;
+        if (ok && n == ZERO_FILL_BATCH) {
+            ok = rw_blocks_ll(buffers, nums, n, 1);
+            __sync_fetch_and_add(&foreground_block_writes, n);
+            n = 0;
+        }
+    }
+    if (ok && n) {
+        ok = rw_blocks_ll(buffers, nums, n, 1);
+        __sync_fetch_and_add(&foreground_block_writes, n);
+    }
+    for (i=0; i<ZERO_FILL_BATCH; ++i) free(buffers[i]);
+    return ok;
+}
+
+/* returns 0 on failure, with errno ENOSPC or EIO; the length and the block list stay as they were */
+int ensure_size_ll(struct mydirent* ent, long long int size, long long int overwrite_start, long long int overwrite_end) {
+    if (size == 0) return 1;
+    if (size <= ent->length) return 1;
+    int ent_block_count      = get_block_count_for_length(ent->length);
+    int required_block_count = get_block_count_for_length(size);
+    if (required_block_count > ent->blocks_array_size) {
+        int new_size = nearest_power_of_two(required_block_count);
+        struct myblock* nb = (struct myblock*)realloc(ent->blocks, new_size*sizeof(*ent->blocks));
+        if(!nb) { errno = ENOMEM; return 0; }
+        ent->blocks = nb;
+        ent->blocks_array_size = new_size;
+    }
+    
+    int i;
+    int n = required_block_count - ent_block_count;
+    if (n > 0 && !allocate_blocks(ent->blocks + ent_block_count, n)) {
+        /* freed blocks become available after shredding */
+        if (!drain_shred_queue() || !allocate_blocks(ent->blocks + ent_block_count, n)) {
+            errno = ENOSPC;
+            return 0;
+        }
+    }
+    if (!zero_fill_blocks(ent, ent_block_count, required_block_count, overwrite_start, overwrite_end)) {
+        readonly_flag=1;
+        for (i=ent_block_count; i<required_block_count; ++i) release_block(ent->blocks[i].num);
+        errno = EIO;
+        return 0;
+    }
+    
+    ent->length = size;
+    mark_ent_blocks_dirty(ent, ent_block_count, required_block_count);
+    return 1;    
+}
+
+/* returns 0 on failure, 1 on success */
+int ensure_size(struct mydirent* ent, long long int size) {
+    return ensure_size_ll(ent, size, 0, 0);
+}
+
+/* returns 0 on failure, with errno set */
+int d_truncate(struct mydirent* ent, long long int size) {
+    if (!load_block_list(ent)) { errno = EIO; return 0; }
+    if (size >= ent->length) return ensure_size(ent, size);
+        
+    int ent_block_count      = get_block_count_for_length(ent->length);
+    int required_block_count = get_block_count_for_length(size);
+    int i;
+    
+    cache_drop(ent, required_block_count);
+    for (i=required_block_count; i<ent_block_count; ++i) {
+        release_block(ent->blocks[i].num);
+    }
+    ent->length = size;
+    mark_ent_blocks_dirty(ent, 0, 0);
+    return 1;
+}
+
+int write_block_ll(const unsigned char* buffer, int i) {
+    int fd = data;
+    off_t off = i*block_size;
+    size_t s = block_size;
+    while(s) {
+        int ret = pwrite(fd, buffer, s, off);
+        if (ret<=0) {
+            if (errno==EINTR || errno==EAGAIN) continue;
+            perror("pwrite");
+            return 0;
+        }
+        off+=ret;
+        s-=ret;
+    }
+    return 1;
+}
+
+/* Encrypts (or decrypts) block_size bytes in place with the thread's context. Returns 0 on failure. */
+int crypt_buffer(struct thread_state* ts, unsigned char* buf, uint32_t iv, int decrypt) {
+    int s = imin(sizeof(iv), mcrypt_ivsize);
+    memset(ts->mcrypt_ivbuf, 0, mcrypt_ivsize);
+    memcpy(ts->mcrypt_ivbuf, &iv, s);
+    
+    if (mcrypt_state_size) {
+        if (ts->key_generation != ts->key->generation) {
+            if (ts->key_generation != -1) mcrypt_generic_deinit(ts->mcrypt);
+            ts->key_generation = -1;
+            if(mcrypt_generic_init(ts->mcrypt, ts->key->key, mcrypt_keysize/8, ts->mcrypt_ivbuf) < 0) {
+                fprintf(stderr, "Encryption init error\n");
+                return 0;
+            }
+            ts->key_generation = ts->key->generation;
+            if (!ts->mcrypt_state) ts->mcrypt_state = (unsigned char*) malloc(mcrypt_state_size);
+        }
+        int j;
+        memcpy(ts->mcrypt_state, mcrypt_state_template, mcrypt_state_size);
+        for (j=0; j<mcrypt_state_iv_count; ++j) {
+            memcpy(ts->mcrypt_state + mcrypt_state_iv_offsets[j], ts->mcrypt_ivbuf, mcrypt_ivsize);
+        }
+        if (mcrypt_enc_set_state(ts->mcrypt, ts->mcrypt_state, mcrypt_state_size) < 0) {
+            fprintf(stderr, "Encryption state error\n");
+            return 0;
+        }
+    } else {
+        if (ts->key_generation != -1) mcrypt_generic_deinit(ts->mcrypt);
+        ts->key_generation = -1;
+        if(mcrypt_generic_init(ts->mcrypt, ts->key->key, mcrypt_keysize/8, ts->mcrypt_ivbuf) < 0) {
+            fprintf(stderr, "Encryption init error\n");
+            return 0;
+        }
+    }
+    
+    int ret;
+    if (decrypt) {
+        ret = mdecrypt_generic (ts->mcrypt, buf, block_size);
+    } else {
+        ret = mcrypt_generic (ts->mcrypt, buf, block_size);
+    }
+    if (!mcrypt_state_size) mcrypt_generic_deinit(ts->mcrypt);
+    if (ret < 0) {
+        fprintf(stderr, "Encryption error\n");
+        return 0;
+    }
+    return 1;
+}
+
+/* 
+   Finds where the IV is kept in the mode state and checks that replacing the state
+   gives the same result as initializing the context for every block.
+   Called once, before any other thread uses the cipher. The mode state does not
+   depend on the key, so the result holds for the keys of all the branches.
+   Returns 1 if the context can be reused.
+*/
+int probe_cipher_state(struct thread_state* ts) {
+    int i, j;
+    mcrypt_state_size = 0;
+    mcrypt_state_iv_count = 0;
+    free(mcrypt_state_template);
+    mcrypt_state_template = NULL;
+    free(ts->mcrypt_state);
+    ts->mcrypt_state = NULL;
+    
+    if (ts->key_generation != -1) mcrypt_generic_deinit(ts->mcrypt);
+    ts->key_generation = -1;
+    
+    /* recognizable IV */
+    for (i=0; i<mcrypt_ivsize; ++i) ts->mcrypt_ivbuf[i] = 0xA5 ^ (i*29+7);
+    if(mcrypt_generic_init(ts->mcrypt, ts->key->key, mcrypt_keysize/8, ts->mcrypt_ivbuf) < 0) return 0;
+    
+    unsigned char dummy;
+    int size = 0;
+    unsigned char* st = NULL;
+    if (mcrypt_enc_get_state(ts->mcrypt, &dummy, &size) < 0 && size > 0) {
+        st = (unsigned char*) malloc(size);
+        if (mcrypt_enc_get_state(ts->mcrypt, st, &size) < 0) size = 0;
+    }
+    mcrypt_generic_deinit(ts->mcrypt);
+    if (size < mcrypt_ivsize) { free(st); return 0; }
+    
+    for (i=0; i+mcrypt_ivsize<=size; ) {
+        if (!memcmp(st+i, ts->mcrypt_ivbuf, mcrypt_ivsize)) {
+            if (mcrypt_state_iv_count == MAX_IV_COPIES_IN_STATE) { free(st); return 0; }
+            mcrypt_state_iv_offsets[mcrypt_state_iv_count++] = i;
+            i += mcrypt_ivsize;
+        } else {
+            ++i;
+        }
+    }
+    if (!mcrypt_state_iv_count) { free(st); return 0; }
+    mcrypt_state_template = st;
+    
+    unsigned char* plain = (unsigned char*) malloc(block_size);
+    unsigned char* a = (unsigned char*) malloc(block_size);
+    unsigned char* b = (unsigned char*) malloc(block_size);
+    int ok = 1;
+    for (j=0; j<4 && ok; ++j) {
+        uint32_t iv;
+        random_bytes(&iv, sizeof(iv));
+        random_bytes(plain, block_size);
+        memcpy(a, plain, block_size);
+        memcpy(b, plain, block_size);
+        
+        mcrypt_state_size = 0;
+        ok = crypt_buffer(ts, a, iv, 0);
+        
+        mcrypt_state_size = size;
+        ok = ok && crypt_buffer(ts, b, iv, 0) && !memcmp(a, b, block_size);
+        ok = ok && crypt_buffer(ts, b, iv, 1) && !memcmp(b, plain, block_size);
+    }
+    free(plain);
+    free(a);
+    free(b);
+    
+    if (!ok) {
+        if (ts->key_generation != -1) mcrypt_generic_deinit(ts->mcrypt);
+        ts->key_generation = -1;
+        mcrypt_state_size = 0;
+        mcrypt_state_iv_count = 0;
+    }
+    return ok;
+}
+
+int write_block_enc(const unsigned char* buffer, struct myblock *block) {
+    int i = block->num;
+    struct thread_state* ts = get_thread_state();
+    if (!ts) return 0;
+    unsigned char* mcrypt_buf = ts->mcrypt_buf;
+    memcpy(mcrypt_buf, buffer, block_size);
+    if (mcrypt != MCRYPT_FAILED) {
+        if (!crypt_buffer(ts, mcrypt_buf, block->iv, 0)) return 0;
+    }
+    __sync_fetch_and_add(&foreground_block_writes, 1);
+    return write_block_ll(mcrypt_buf, i);
+}
+
+int write_block(const unsigned char* buffer, struct myblock *block) {
+    if (mcrypt != MCRYPT_FAILED) { random_bytes(&block->iv, sizeof(block->iv)); }
+    return write_block_enc(buffer, block);
+}
+
+void xor_scrable_buffer(unsigned char* buffer) {
+    int j;
+    unsigned long pseudokey = *(unsigned long*)buffer;
+    for(j=1; j<(block_size / sizeof(unsigned long)); ++j) {
+        ((unsigned long*)buffer)[j] ^= pseudokey;
+    }
+}
+
+int write_block_simple(unsigned char* buffer, int i) {
+    struct myblock b;
+    b.num = i;
+    b.iv = htobe32(i);
+    // scramble the data, using first 4 bytes of buffer is "poor man's IV"
+    // write_block_simple is called by save_entries and it sets first 8 bytes to random
+    if (mcrypt!=MCRYPT_FAILED) xor_scrable_buffer(buffer);
+    int ret = write_block_enc(buffer, &b);
+    if (mcrypt!=MCRYPT_FAILED) xor_scrable_buffer(buffer);
+    return ret;
+}
+
+int read_block_ll(unsigned char* buffer, int i) {
+    int fd = data;
+    off_t off = i*block_size;
+    size_t s = block_size;
+    while(s) {
+        int ret = pread(fd, buffer, s, off);
+        if (ret<=0) {
+            if (errno==EINTR || errno==EAGAIN) continue;
+            return 0;
+        }
+        off+=ret;
+        s-=ret;
+    }
+    return 1;
+}
+
+int read_block(unsigned char* buffer, struct myblock *block) {
+    int i = block->num;
+    struct thread_state* ts = get_thread_state();
+    if (!ts) return 0;
+    unsigned char* mcrypt_buf = ts->mcrypt_buf;
+    int ret = read_block_ll(mcrypt_buf, i);
+    if (!ret) return 0;
+    if (mcrypt != MCRYPT_FAILED) {
+        if (!crypt_buffer(ts, mcrypt_buf, block->iv, 1)) return 0;
+    }
+    memcpy(buffer, mcrypt_buf, block_size);    
+    return 1;
+}
+
+int read_block_simple(unsigned char* buffer, int i) {
+    struct myblock b;
+    b.num = i;
+    b.iv = htobe32(i);    
+    int ret = read_block(buffer, &b);
+    if (mcrypt!=MCRYPT_FAILED) xor_scrable_buffer(buffer);
+    return ret;
+}
+
+/* Decrypts the block read from the storage in place. Returns 0 on failure. */
+/* Encrypts the file block in place with a new IV, to be written as is */
+int encrypt_block(unsigned char* buffer, struct myblock *block) {
+    if (mcrypt == MCRYPT_FAILED) return 1;
+    struct thread_state* ts = get_thread_state();
+    if (!ts) return 0;
+    random_bytes(&block->iv, sizeof(block->iv));
+    return crypt_buffer(ts, buffer, block->iv, 0);
+}
+
+int decrypt_block(unsigned char* buffer, const struct myblock *block) {
+    if (mcrypt == MCRYPT_FAILED) return 1;
+    struct thread_state* ts = get_thread_state();
+    if (!ts) return 0;
+    return crypt_buffer(ts, buffer, block->iv, 1);
+}
+
+/* Scrambles and encrypts the directory block in place, to be written as is */
+int encrypt_block_simple(unsigned char* buffer, int i) {
+    if (mcrypt == MCRYPT_FAILED) return 1;
+    struct thread_state* ts = get_thread_state();
+    if (!ts) return 0;
+    xor_scrable_buffer(buffer);
+    return crypt_buffer(ts, buffer, htobe32(i), 0);
+}
+
+/* Returns the thread's I/O queue, NULL if it can't be set up */
+struct uring* get_thread_ring(struct thread_state* ts) {
+    if (ts->ring) return ts->ring;
+    struct uring* r = uring_alloc();
+    if (!r || uring_init(r, data, IO_QUEUE_DEPTH)) {
+        uring_free(r);
+        return NULL;
+    }
+    if (!no_o_direct && cache_arena) {
+        /* file blocks are read into the cache directly, keep its pages mapped for the kernel */
+        struct iovec iov;
+        iov.iov_base = cache_arena;
+        iov.iov_len = (size_t)cache_capacity * block_size;
+        uring_register_buffers(r, &iov, 1);
+    }
+    ts->ring = r;
+    return r;
+}
+
+/* Drops the thread's I/O queue. A forked child must not use it: the registered cache pages stay the parent's */
+void free_thread_ring() {
+    struct thread_state* ts = (struct thread_state*) pthread_getspecific(thread_state_key);
+    if (!ts) return;
+    uring_free(ts->ring);
+    ts->ring = NULL;
+}
+
+/* 
+   A run of physically adjacent blocks of a multi-block request: 
+   iov[first..first+length) in the order of block numbers 
+*/
+struct io_run {
+    int first;
+    int length;
+    off_t off;
+};
+
+/* Every run with one system call, returns 0 if any of them failed */
+static int rw_runs_sync(struct iovec* iov, struct io_run* runs, int nruns, int write) {
+    int i, ok = 1;
+    for (i=0; i<nruns; ++i) {
+        /* rwv_full may change the iovec, the queue may still need it for a retry */
+        struct iovec tmp[IOV_MAX];
+        memcpy(tmp, iov + runs[i].first, runs[i].length * sizeof(*tmp));
+        if (!rwv_full(data, tmp, runs[i].length, runs[i].off, write)) ok = 0;
+    }
+    return ok;
+}
+
+/* Submits all runs keeping up to IO_QUEUE_DEPTH in flight. Returns -1 if the queue is broken */
+static int rw_runs_async(struct uring* r, struct iovec* iov, struct io_run* runs, int nruns, int write) {
+    struct uring_completion c[IO_QUEUE_DEPTH];
+    int i, n, k = 0, ok = 1;
+    
+    while (k < nruns || uring_pending(r)) {
+        for (; k < nruns; ++k) {
+            struct io_run* run = &runs[k];
+            void* tag = (void*)(intptr_t)k;
+            int ret;
+            if (run->length == 1) {
+                /* may use a registered buffer */
+                ret = write ? uring_queue_write(r, iov[run->first].iov_base, block_size, run->off, tag)
+                            : uring_queue_read(r, iov[run->first].iov_base, block_size, run->off, tag);
+            } else {
+                ret = write ? uring_queue_writev(r, iov + run->first, run->length, run->off, tag)
+                            : uring_queue_readv(r, iov + run->first, run->length, run->off, tag);
+            }
+            if (ret == -1) break;
+        }
+        if (uring_submit(r) == -1) return -1;
+        n = uring_reap(r, c, IO_QUEUE_DEPTH, 1);
+        if (n == -1) return -1;
+        for (i=0; i<n; ++i) {
+            int j = (intptr_t)c[i].tag;
+            if (c[i].result == runs[j].length * block_size) continue;
+            /* failed or short, retry the usual way */
+            if (!rw_runs_sync(iov, runs + j, 1, write)) ok = 0;
+        }
+    }
+    return ok;
+}
+
+/*
+   Reads (or writes) block_size bytes of buffers[k] from (to) block nums[k] for every k.
+   No encryption on this level.
+   
+   Blocks are sorted by their position in the storage and every run of adjacent blocks
+   becomes one vectored request scattering into (gathering from) the caller's buffers.
+   Up to IO_QUEUE_DEPTH requests are in flight.
+   
+   Returns 0 if any of them failed.
+*/
+int rw_blocks_ll(unsigned char** buffers, const int* nums, int count, int write) {
+    struct io_slot* slots = (struct io_slot*) malloc(count * sizeof(*slots));
+    struct iovec* iov = (struct iovec*) malloc(count * sizeof(*iov));
+    struct io_run* runs = (struct io_run*) malloc(count * sizeof(*runs));
+    int i, nruns = 0, ok;
+    
+    if (!count) { free(slots); free(iov); free(runs); return 1; }
+    if (!slots || !iov || !runs) {
+        free(slots); free(iov); free(runs);
+        return 0;
+    }
+    
+    for (i=0; i<count; ++i) {
+        slots[i].num = nums[i];
+        slots[i].k = i;
+    }
+    qsort(slots, count, sizeof(*slots), &compare_io_slots);
+    
+    for (i=0; i<count; ++i) {
+        iov[i].iov_base = buffers[slots[i].k];
+        iov[i].iov_len = block_size;
+        if (nruns && slots[i].num == slots[i-1].num + 1 && runs[nruns-1].length < IOV_MAX) {
+            ++runs[nruns-1].length;
+        } else {
+            runs[nruns].first = i;
+            runs[nruns].length = 1;
+            runs[nruns].off = (off_t)slots[i].num * block_size;
+            ++nruns;
+        }
+    }
+    
+    struct thread_state* ts = get_thread_state();
+    struct uring* r = ts ? get_thread_ring(ts) : NULL;
+    ok = -1;
+    if (r) ok = rw_runs_async(r, iov, runs, nruns, write);
+    if (ok == -1) {
+        if (r) {
+            /* the queue is broken, forget it and redo everything the usual way */
+            uring_free(r);
+            ts->ring = NULL;
+        }
+        ok = rw_runs_sync(iov, runs, nruns, write);
+    }
+    
+    free(slots);
+    free(iov);
+    free(runs);
+    return ok;
+}
+
+struct decrypt_job {
+    const struct cipher_key* key;
+    unsigned char** buffers;
+    const int* nums;
+    int count;
+    int ok;
+};
+
+/* Undoes encrypt_block_simple for every block of the job, with the thread's own cipher context */
+static void* decrypt_thread_func(void* arg) {
+    struct decrypt_job* job = (struct decrypt_job*) arg;
+    struct thread_state* ts = get_thread_state();
+    int i;
+    job->ok = (ts != NULL);
+    if (ts) ts->key = job->key;
+    for (i=0; i<job->count && job->ok; ++i) {
+        if (!crypt_buffer(ts, job->buffers[i], htobe32(job->nums[i]), 1)) job->ok = 0;
+        xor_scrable_buffer(job->buffers[i]);
+    }
+    return NULL;
+}
+
+/*
+   read_block_simple of every nums[k] into buffers[k]: all blocks are read in one batch,
+   then decrypted by up to load_threads_count threads. Returns 0 on failure.
+*/
+int read_blocks_simple(unsigned char** buffers, const int* nums, int count) {
+    if (!rw_blocks_ll(buffers, nums, count, 0)) return 0;
+    if (mcrypt == MCRYPT_FAILED) return 1;
+
+    int t, ok = 1;
+    int nthreads = imax(1, imin(load_threads_count, count / LOAD_MIN_BLOCKS_PER_THREAD));
+    int per_thread = (count + nthreads - 1) / nthreads;
+    struct thread_state* ts = get_thread_state();
+    if (!ts) return 0;
+    struct decrypt_job* jobs = (struct decrypt_job*) malloc(nthreads * sizeof(*jobs));
+    pthread_t* threads = (pthread_t*) malloc(nthreads * sizeof(*threads));
+    unsigned char* started = (unsigned char*) calloc(nthreads, 1);
+
+    for (t=0; t<nthreads; ++t) {
+        /* the blocks may be of another branch, with the key of this thread */
+        jobs[t].key = ts->key;
+        jobs[t].buffers = buffers + t*per_thread;
+        jobs[t].nums = nums + t*per_thread;
+        jobs[t].count = imax(0, imin(per_thread, count - t*per_thread));
+        /* the first part is done by this thread, as are the parts that failed to start */
+        if (t && !pthread_create(&threads[t], NULL, &decrypt_thread_func, &jobs[t])) started[t] = 1;
+    }
+    for (t=0; t<nthreads; ++t) {
+        if (!started[t]) decrypt_thread_func(&jobs[t]);
+    }
+    for (t=0; t<nthreads; ++t) {
+        if (started[t]) pthread_join(threads[t], NULL);
+        if (!jobs[t].ok) ok = 0;
+    }
+    free(jobs);
+    free(threads);
+    free(started);
+    return ok;
+}
+
+int get_maximum_path_length() {
+    size_t dirent_size = 0;
+    dirent_size += 4; /* full_path string length */
+    dirent_size += 8; /* file length */
+    //int bc = get_block_count_for_length(ent->length);
+    //dirent_size += 4*bc; /* block list */
+    
+    dirent_size += 4; /* number of blocks in this extent */
+    dirent_size += 4; /* starting block in this extend */
+    // If we can't save all block numbers in this block, we save further block numbers in next blocks
+    
+    dirent_size+=16; /* there should be room for at least 2 blocks or this is not serious */
     dirent_size += 4; /* next dirent's block number */
     dirent_size += 4; /* next dirent's offset in block */ 
     dirent_size += 8; /* reserved for possible extensions */
     return block_size - BLOCK_HEADER_SIZE - dirent_size;
 }
 
-int get_saved_entry_minimal_size(struct mydirent* ent) {
-    size_t dirent_size = 0;
-    dirent_size += 4; /* full_path string length */
-    dirent_size += strlen(ent->full_path);
-    dirent_size += 8; /* file length */
-    //int bc = get_block_count_for_length(ent->length);
-    //dirent_size += 4*bc; /* block list */
-    
-    dirent_size += 4; /* number of blocks in this extent */
-    dirent_size += 4; /* starting block in this extend */
-    // If we can't save all block numbers in this block, we save further block numbers in next blocks
-    
-    dirent_size+=16; /* there should be room for at least 2 blocks or this is not serious */
-    dirent_size += 4; /* next dirent's block number */
-    dirent_size += 4; /* next dirent's offset in block */ 
-    dirent_size += 8; /* reserved for possible extensions */
-    return dirent_size;
+/* Size of a V1 record without its block list: path length, file length, number of blocks, first block index */
+#define DIR_RECORD_HEADER_SIZE 20
+/* The root also has the number of slots, depth of the table, start of the journal and 4 reserved bytes */
+#define DIR_ROOT_HEADER_SIZE (BLOCK_HEADER_SIZE + 24)
+
+static int dir_block_capacity() { return block_size - BLOCK_HEADER_SIZE; }
+static int dir_root_fanout() { return (block_size - DIR_ROOT_HEADER_SIZE) / 4; }
+static int dir_table_fanout() { return (block_size - BLOCK_HEADER_SIZE) / 4; }
+
+void add_stale_directory_block(int num) {
+    if (num == -1) return;
+    if (stale_directory_blocks_count == stale_directory_blocks_size) {
+        stale_directory_blocks_size = stale_directory_blocks_size ? stale_directory_blocks_size*2 : 64;
+        stale_directory_blocks = (int*)realloc(stale_directory_blocks, stale_directory_blocks_size*sizeof(int));
+    }
+    stale_directory_blocks[stale_directory_blocks_count++] = num;
+}
+
+/* Changes were taken out of the journal without being committed: the next save has to be a checkpoint */
+static void journal_stop() {
+    add_stale_directory_block(journal_next_block);
+    journal_next_block = -1;
+}
+
+static void dir_add_record(struct dir_block* b, struct mydirent* ent, int first, int count, int size) {
+    if (b->records_count == b->records_size) {
+        b->records_size = b->records_size ? b->records_size*2 : 8;
+        b->records = (struct dir_record*)realloc(b->records, b->records_size*sizeof(*b->records));
+    }
+    struct dir_record* r = &b->records[b->records_count++];
+    r->ent = ent;
+    r->first = first;
+    r->count = count;
+    r->size = size;
+    r->offset = -1;
+    b->used += size;
+
+    if (ent->saved_in_count && ent->saved_in[ent->saved_in_count-1] == b) return;
+    if (ent->saved_in_count == ent->saved_in_size) {
+        ent->saved_in_size = ent->saved_in_size ? ent->saved_in_size*2 : 1;
+        ent->saved_in = (struct dir_block**)realloc(ent->saved_in, ent->saved_in_size*sizeof(*ent->saved_in));
+    }
+    ent->saved_in[ent->saved_in_count++] = b;
+}
+
+/* Removes the records of the entry, the directory blocks that held them get rewritten on the next save */
+void dir_unrecord(struct mydirent* ent) {
+    int i, j, k;
+    for (i=0; i<ent->saved_in_count; ++i) {
+        struct dir_block* b = ent->saved_in[i];
+        for (j=k=0; j<b->records_count; ++j) {
+            if (b->records[j].ent == ent) {
+                b->used -= b->records[j].size;
+            } else {
+                b->records[k++] = b->records[j];
+            }
+        }
+        b->records_count = k;
+        b->dirty = 1;
+    }
+    ent->saved_in_count = 0;
+}
+
+/* Takes a free slot for a new directory block */
+static struct dir_block* dir_new_block() {
+    struct dir_block* b = (struct dir_block*)calloc(1, sizeof(*b));
+    b->num = -1;
+    b->dirty = 1;
+
+    int i = dir_free_slot_hint;
+    while (i < dir_slots_count && dir_slots[i]) ++i;
+    if (i == dir_slots_count) {
+        if (dir_slots_count == dir_slots_size) {
+            dir_slots_size = dir_slots_size ? dir_slots_size*2 : 64;
+            dir_slots = (struct dir_block**)realloc(dir_slots, dir_slots_size*sizeof(*dir_slots));
+        }
+        ++dir_slots_count;
+    }
+    dir_slots[i] = b;
+    dir_free_slot_hint = i+1;
+    return b;
+}
+
+static void dir_free_slot(int i) {
+    free(dir_slots[i]->records);
+    free(dir_slots[i]);
+    dir_slots[i] = NULL;
+    if (i < dir_free_slot_hint) dir_free_slot_hint = i;
+}
+
+/* Number of table levels needed between the root and count slots */
+static int dir_table_depth_for(int count) {
+    long long capacity = dir_root_fanout();
+    int depth = 0;
+    while (capacity < count) {
+        capacity *= dir_table_fanout();
+        ++depth;
+    }
+    return depth;
+}
+
+/* Number of blocks at every level of the table for count slots */
+static void dir_table_counts(int count, int depth, int* counts) {
+    int k;
+    for (k=0; k<depth; ++k) {
+        count = (count + dir_table_fanout() - 1) / dir_table_fanout();
+        counts[k] = count;
+    }
+}
+
+/* Makes the table big enough for all slots. Blocks of the table that get reshaped become stale. */
+static void dir_table_resize() {
+    int k, i;
+    int depth = dir_table_depth_for(dir_slots_count);
+    int counts[DIR_MAX_DEPTH];
+    if (depth != dir_table_depth) {
+        for (k=0; k<dir_table_depth; ++k) {
+            for (i=0; i<dir_table[k].count; ++i) add_stale_directory_block(dir_table[k].nums[i]);
+            dir_table[k].count = 0;
+        }
+        dir_table_depth = depth;
+    }
+    dir_table_counts(dir_slots_count, depth, counts);
+    for (k=0; k<depth; ++k) {
+        struct dir_table_level* l = &dir_table[k];
+        if (counts[k] <= l->count) continue;
+        l->nums = (int*)realloc(l->nums, counts[k]*sizeof(*l->nums));
+        l->dirty = (unsigned char*)realloc(l->dirty, counts[k]);
+        for (i=l->count; i<counts[k]; ++i) {
+            l->nums[i] = -1;
+            l->dirty[i] = 1;
+        }
+        l->count = counts[k];
+    }
+}
+
+/* The slot changed: so do the table blocks on the way to it */
+static void dir_table_mark(int slot) {
+    int k;
+    for (k=0; k<dir_table_depth; ++k) {
+        slot /= dir_table_fanout();
+        dir_table[k].dirty[slot] = 1;
+    }
+}
+
+/* Forgets the saved layout: everything gets written anew, the old blocks are freed after that */
+static void dir_reset_layout() {
+    int i, j, k;
+    for (i=0; i<dir_slots_count; ++i) {
+        struct dir_block* b = dir_slots[i];
+        if (!b) continue;
+        add_stale_directory_block(b->num);
+        for (j=0; j<b->records_count; ++j) b->records[j].ent->saved_in_count = 0;
+        dir_free_slot(i);
+    }
+    dir_slots_count = 0;
+    dir_free_slot_hint = 0;
+    for (k=0; k<dir_table_depth; ++k) {
+        for (i=0; i<dir_table[k].count; ++i) add_stale_directory_block(dir_table[k].nums[i]);
+        dir_table[k].count = 0;
+    }
+    dir_table_depth = 0;
+}
+
+/* Repacking is worth it when less than half of the directory blocks is used */
+static int dir_needs_compaction() {
+    int i, blocks = 0;
+    long long used = 0;
+    for (i=0; i<dir_slots_count; ++i) {
+        if (!dir_slots[i]) continue;
+        ++blocks;
+        used += dir_slots[i]->used;
+    }
+    return blocks > 4 && used*2 < (long long)blocks*dir_block_capacity();
+}
+
+/* LEB128: 7 bits per byte, lowest first, high bit set on all bytes but the last */
+static int varint_size(uint64_t v) {
+    int n = 1;
+    while (v >= 0x80) { v >>= 7; ++n; }
+    return n;
+}
+
+/* Writes v at out+offset (only counts it if out is NULL), returns the new offset */
+static int put_varint(unsigned char* out, int offset, uint64_t v) {
+    if (!out) return offset + varint_size(v);
+    while (v >= 0x80) {
+        out[offset++] = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    out[offset++] = v;
+    return offset;
+}
+
+/* Returns the new offset, -1 if the varint runs beyond end */
+static int get_varint(const unsigned char* in, int offset, int end, uint64_t* v) {
+    int shift = 0;
+    *v = 0;
+    for (;;) {
+        if (offset >= end || shift > 63) return -1;
+        unsigned char c = in[offset++];
+        *v |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) return offset;
+        shift += 7;
+    }
+}
+
+static uint64_t zigzag(long long int v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+static long long int unzigzag(uint64_t v) { return (long long int)(v >> 1) ^ -(long long int)(v & 1); }
+
+/*
+   Writes the record of blocks [first, first+count) of the entry to out+offset (only counts
+   its size if out is NULL), returns the new offset. The path shares prefix bytes with 
+   the path of the previous record in the block. See README for the format.
+*/
+static int dir_encode_record(unsigned char* out, int offset, const struct mydirent* ent,
+                             const char* path, int l, int prefix, int first, int count) {
+    int j, run;
+    offset = put_varint(out, offset, l - prefix);
+    offset = put_varint(out, offset, prefix);
+    if (out) memcpy(out+offset, path+prefix, l-prefix);
+    offset += l-prefix;
+    offset = put_varint(out, offset, ent->length);
+    offset = put_varint(out, offset, first);
+    offset = put_varint(out, offset, count);
+    long long int expected = 0;
+    for (j=first; j<first+count; j+=run) {
+        int start = ent->blocks[j].num;
+        for (run=1; j+run<first+count && ent->blocks[j+run].num == start+run; ++run);
+        offset = put_varint(out, offset, zigzag(start - expected));
+        offset = put_varint(out, offset, run-1);
+        expected = start + run;
+    }
+    for (j=first; j<first+count; ++j) {
+        if (out) *(uint32_t*)(out+offset) = htobe32(ent->blocks[j].iv);
+        offset += 4;
+    }
+    return offset;
+}
+
+/* Common prefix to encode the path with after the given one, the path keeps at least one byte of its own */
+static int dir_path_prefix(const char* prev, int prev_l, const char* path, int l) {
+    int i, n = imin(prev_l, l-1);
+    for (i=0; i<n && prev[i] == path[i]; ++i);
+    return i;
+}
+
+/* Path of the last record in the block into buf, returns its length (0 if there are no records) */
+static int dir_last_path(const struct dir_block* b, char* buf) {
+    if (!b->records_count) return 0;
+    const struct mydirent* ent = b->records[b->records_count-1].ent;
+    get_full_path(ent, buf);
+    return get_path_length(ent);
+}
+
+/*
+   How many of count blocks starting with first fit in a record of room bytes, -1 if not even
+   the record without blocks does. The record must also fit in an empty block with its whole path,
+   so it can always be moved to another block (see dir_fit_block). Its size goes to size.
+*/
+static int dir_record_fit(const struct mydirent* ent, const char* path, int l, int prefix,
+                          int first, int count, int room, int* size) {
+    int capacity = dir_block_capacity();
+    int lo = -1, hi = imin(count, room/4);
+    while (lo < hi) {
+        int n = (lo + hi + 1) / 2;
+        if (dir_encode_record(NULL, 0, ent, path, l, prefix, first, n) <= room &&
+                dir_encode_record(NULL, 0, ent, path, l, 0, first, n) <= capacity) {
+            lo = n;
+        } else {
+            hi = n - 1;
+        }
+    }
+    if (lo >= 0) *size = dir_encode_record(NULL, 0, ent, path, l, prefix, first, lo);
+    return lo;
+}
+
+/* 
+   Removing records changes how the following ones are encoded and they may grow. 
+   Recounts the sizes and moves the records beyond the capacity to a new block.
+*/
+static void dir_fit_block(struct dir_block* b, char* path, char* prev) {
+    int i, j, prev_l = 0, used = 0;
+    for (i=0; i<b->records_count; ++i) {
+        struct dir_record* r = &b->records[i];
+        int l = get_path_length(r->ent);
+        get_full_path(r->ent, path);
+        int prefix = i ? dir_path_prefix(prev, prev_l, path, l) : 0;
+        r->size = dir_encode_record(NULL, 0, r->ent, path, l, prefix, r->first, r->count);
+        if (i && used + r->size > dir_block_capacity()) break;
+        used += r->size;
+        memcpy(prev, path, l);
+        prev_l = l;
+    }
+    b->used = used;
+    if (i == b->records_count) return;
+    
+    struct dir_block* nb = dir_new_block();
+    for (j=i; j<b->records_count; ++j) {
+        struct dir_record* r = &b->records[j];
+        struct mydirent* ent = r->ent;
+        int k;
+        for (k=0; k<ent->saved_in_count && ent->saved_in[k] != b; ++k);
+        if (k < ent->saved_in_count) {
+            memmove(&ent->saved_in[k], &ent->saved_in[k+1], (ent->saved_in_count-k-1)*sizeof(*ent->saved_in));
+            --ent->saved_in_count;
+        }
+        dir_add_record(nb, ent, r->first, r->count, r->size);
+    }
+    b->records_count = i;
+    dir_fit_block(nb, path, prev);
+}
+
+/* Also notes where the records start, for the block lists loaded lazily from them */
+static void dir_serialize_block(struct dir_block* b, unsigned char* block) {
+    int i, prev_l = 0;
+    char* path = (char*) malloc(block_size);
+    char* prev = (char*) malloc(block_size);
+    random_bytes(block, 8);
+    memcpy(block+8, SIGNATURE, 8);
+    int offset = BLOCK_HEADER_SIZE;
+    for (i=0; i<b->records_count; ++i) {
+        struct dir_record* r = &b->records[i];
+        int l = get_path_length(r->ent);
+        get_full_path(r->ent, path);
+        int prefix = i ? dir_path_prefix(prev, prev_l, path, l) : 0;
+        r->offset = offset;
+        offset = dir_encode_record(block, offset, r->ent, path, l, prefix, r->first, r->count);
+        memcpy(prev, path, l);
+        prev_l = l;
+    }
+    if (offset < block_size) {
+        block[offset++] = 0;
+    }
+    random_bytes(block+offset, block_size-offset);
+    free(path);
+    free(prev);
+}
+
+/* Block numbers listed by the table block k'th at level (-1 is the root), count of them is returned */
+static int dir_table_children(int level, int k, uint32_t* out) {
+    int i, n, first, total;
+    if (level == -1) {
+        n = dir_root_fanout();
+        first = 0;
+    } else {
+        n = dir_table_fanout();
+        first = k*n;
+    }
+    int below = (level == -1) ? dir_table_depth-1 : level-1;
+    total = (below == -1) ? dir_slots_count : dir_table[below].count;
+    for (i=0; i<n && first+i<total; ++i) {
+        int num;
+        if (below == -1) {
+            num = dir_slots[first+i] ? dir_slots[first+i]->num : -1;
+        } else {
+            num = dir_table[below].nums[first+i];
+        }
+        out[i] = htobe32(num == -1 ? DIR_EMPTY_SLOT : (uint32_t)num);
+    }
+    return i;
+}
+
+static void dir_serialize_table_block(int level, int k, unsigned char* block) {
+    random_bytes(block, 8);
+    memcpy(block+8, SIGNATURE, 8);
+    int n = dir_table_children(level, k, (uint32_t*)(block+BLOCK_HEADER_SIZE));
+    memset(block+BLOCK_HEADER_SIZE+4*n, 0xFF, block_size-BLOCK_HEADER_SIZE-4*n);
+}
+
+static void dir_serialize_root(unsigned char* block) {
+    random_bytes(block, 8);
+    memcpy(block+8, SIGNATURE, 8);
+    *(uint32_t*)(block+BLOCK_HEADER_SIZE) = htobe32(dir_slots_count);
+    *(uint32_t*)(block+BLOCK_HEADER_SIZE+4) = htobe32(dir_table_depth);
+    *(uint32_t*)(block+BLOCK_HEADER_SIZE+8) = htobe32(journal_next_block);
+    *(uint64_t*)(block+BLOCK_HEADER_SIZE+12) = htobe64(journal_next_block == -1 ? 0 : journal_epoch);
+    memset(block+BLOCK_HEADER_SIZE+20, 0, 4);
+    int n = dir_table_children(-1, 0, (uint32_t*)(block+DIR_ROOT_HEADER_SIZE));
+    memset(block+DIR_ROOT_HEADER_SIZE+4*n, 0xFF, block_size-DIR_ROOT_HEADER_SIZE-4*n);
+}
+
+/*
+   The save read-locks many entries in no particular order. That can't deadlock:
+   writers hold only one entry lock and wait for nothing the save holds.
+   Returns 0 if the block list of the entry can't be loaded (it stays locked).
+*/
+static int dir_lock_for_save(struct mydirent* ent, struct mydirent** locked, int* locked_count) {
+    if (ent->saving) return 1;
+    pthread_rwlock_rdlock(&ent->lock);
+    ent->saving = 1;
+    locked[(*locked_count)++] = ent;
+    /* its records are going to be rewritten from the block list */
+    if (!load_block_list(ent)) {
+        fprintf(stderr, "Failed to load the block list of a file, the save is given up\n");
+        return 0;
+    }
+    return 1;
+}
+
+/*
+   Locks the entries whose records the save rewrites: the changed ones and everything sharing
+   a directory block with them. Their block lists are loaded before the layout changes.
+   Returns 0 if one can't be loaded, the directory blocks marked here are just rewritten later.
+*/
+static int dir_lock_all_for_save(struct mydirent** locked, int* locked_count) {
+    int i, j, ok = 1;
+    for (i=0; i<dirent_entries_count; ++i) {
+        struct mydirent* ent = dirents[i];
+        if (ent->saved_in_count && !__atomic_load_n(&ent->meta_dirty, __ATOMIC_RELAXED)) continue;
+        ok = dir_lock_for_save(ent, locked, locked_count) && ok;
+        for (j=0; j<ent->saved_in_count; ++j) ent->saved_in[j]->dirty = 1;
+    }
+    for (;;) {
+        int first_new = *locked_count;
+        for (i=0; i<dir_slots_count; ++i) {
+            struct dir_block* b = dir_slots[i];
+            if (!b || !b->dirty) continue;
+            for (j=0; j<b->records_count; ++j) ok = dir_lock_for_save(b->records[j].ent, locked, locked_count) && ok;
+        }
+        if (*locked_count == first_new) break;
+        for (i=first_new; i<*locked_count; ++i) {
+            struct mydirent* ent = locked[i];
+            if (!__atomic_load_n(&ent->meta_dirty, __ATOMIC_RELAXED)) continue;
+            for (j=0; j<ent->saved_in_count; ++j) ent->saved_in[j]->dirty = 1;
+        }
+    }
+    return ok;
+}
+
+/*
+   Returns the root block. -1 on failure, with errno ENOSPC or EIO. Called with save_lock 
+   and tree_lock held.
+
+   Only the directory blocks holding changed entries are written, each to a new place,
+   then the table blocks leading to them and the root last, so a sudden shutdown
+   leaves the previous directory intact.
+*/
+int save_entries_ll(int starting_block) {
+    int i, j, k;
+
+    /* Need to do this early, the changes made while saving go to the next save */
+    if (!__sync_lock_test_and_set(&dirty_status, 0)) {
+        return starting_block;
+    }
+    __sync_lock_test_and_set(&dirty_bytes, 0);
+
+    int capacity = dir_block_capacity();
+    struct mydirent** pending = (struct mydirent**) malloc((dirent_entries_count+1) * sizeof(*pending));
+    struct mydirent** locked = (struct mydirent**) malloc((dirent_entries_count+1) * sizeof(*locked));
+    int pending_count = 0;
+    int locked_count = 0;
+
+    int ok = dir_lock_all_for_save(locked, &locked_count);
+    if (ok && dir_needs_compaction()) {
+        /* lazy block lists are loaded from the records, while they are still there */
+        for (i=0; i<dirent_entries_count; ++i) {
+            if (dirents[i]->blocks_lazy) ok = dir_lock_for_save(dirents[i], locked, &locked_count) && ok;
+        }
+        if (ok) dir_reset_layout();
+    }
+    if (!ok) {
+        for (i=0; i<locked_count; ++i) {
+            locked[i]->saving = 0;
+            pthread_rwlock_unlock(&locked[i]->lock);
+        }
+        free(locked);
+        free(pending);
+        mark_dirty();
+        errno = EIO;
+        return -1;
+    }
+
+    /* the entries locked from here on have their block lists loaded already */
+    for (i=0; i<dirent_entries_count; ++i) {
+        struct mydirent* ent = dirents[i];
+        if (!ent->saved_in_count ||
+                (__atomic_load_n(&ent->meta_dirty, __ATOMIC_RELAXED) && __sync_lock_test_and_set(&ent->meta_dirty, 0))) {
+            dir_lock_for_save(ent, locked, &locked_count);
+            dir_unrecord(ent);
+            pending[pending_count++] = ent;
+        }
+    }
+
+    /*
+       Everything going to the rewritten blocks is read under the entries' locks, which are held
+       until it is serialized. Entries found changed meanwhile move to the pending ones,
+       which may make more blocks dirty.
+    */
+    for (;;) {
+        int first_new = locked_count;
+        for (i=0; i<dir_slots_count; ++i) {
+            struct dir_block* b = dir_slots[i];
+            if (!b || !b->dirty) continue;
+            for (j=0; j<b->records_count; ++j) dir_lock_for_save(b->records[j].ent, locked, &locked_count);
+        }
+        if (locked_count == first_new) break;
+        for (i=first_new; i<locked_count; ++i) {
+            struct mydirent* ent = locked[i];
+            if (__atomic_load_n(&ent->meta_dirty, __ATOMIC_RELAXED) && __sync_lock_test_and_set(&ent->meta_dirty, 0)) {
+                dir_unrecord(ent);
+                pending[pending_count++] = ent;
+            }
+        }
+    }
+
+    /* The pending entries go to the blocks being rewritten anyway, then to new ones */
+    int targets_count = 0;
+    int targets_size = 16;
+    struct dir_block** targets = (struct dir_block**) malloc(targets_size*sizeof(*targets));
+    for (i=0; i<dir_slots_count; ++i) {
+        if (!dir_slots[i] || !dir_slots[i]->dirty) continue;
+        if (targets_count == targets_size) {
+            targets_size *= 2;
+            targets = (struct dir_block**) realloc(targets, targets_size*sizeof(*targets));
+        }
+        targets[targets_count++] = dir_slots[i];
+    }
+    int t = 0;
+    char* path = (char*) malloc(block_size);
+    char* prev = (char*) malloc(block_size);
+    for (i=0; i<pending_count; ++i) {
+        struct mydirent* ent = pending[i];
+        int l = get_path_length(ent);
+        get_full_path(ent, path);
+        int bc = get_block_count_for_length(ent->length);
+        int position = 0;
+        int size;
+        /* there should be room for at least 2 blocks anywhere in the list or this is not serious */
+        int worst = dir_encode_record(NULL, 0, ent, path, l, 0, bc, 0) + 2*(4 + varint_size(zigzag(-2LL*block_count)) + 1);
+        if (worst > capacity) {
+            fprintf(stderr, "Filepath too long for this block size and will be skipped\n");
+            continue;
+        }
+        do {
+            int n;
+            for (;;) {
+                if (t == targets_count) {
+                    if (targets_count == targets_size) {
+                        targets_size *= 2;
+                        targets = (struct dir_block**) realloc(targets, targets_size*sizeof(*targets));
+                    }
+                    targets[targets_count++] = dir_new_block();
+                }
+                int prev_l = dir_last_path(targets[t], prev);
+                int prefix = prev_l ? dir_path_prefix(prev, prev_l, path, l) : 0;
+                n = dir_record_fit(ent, path, l, prefix, position, bc - position, capacity - targets[t]->used, &size);
+                if (n >= imin(bc - position, 2)) break;
+                ++t;
+            }
+            dir_add_record(targets[t], ent, position, n, size);
+            position += n;
+        } while (position < bc);
+    }
+    for (i=0; i<dir_slots_count; ++i) {
+        if (dir_slots[i] && dir_slots[i]->dirty) dir_fit_block(dir_slots[i], path, prev);
+    }
+    free(path);
+    free(prev);
+    free(targets);
+    free(pending);
+
+    dir_table_resize();
+
+    int writes_size = 16;
+    int writes_count = 0;
+    unsigned char** buffers = (unsigned char**) malloc(writes_size*sizeof(*buffers));
+    struct dir_block** written = (struct dir_block**) malloc(writes_size*sizeof(*written));
+    for (i=0; i<dir_slots_count; ++i) {
+        struct dir_block* b = dir_slots[i];
+        if (!b || !b->dirty) continue;
+        dir_table_mark(i);
+        if (!b->records_count) {
+            add_stale_directory_block(b->num);
+            dir_free_slot(i);
+            continue;
+        }
+        if (writes_count == writes_size) {
+            writes_size *= 2;
+            buffers = (unsigned char**) realloc(buffers, writes_size*sizeof(*buffers));
+            written = (struct dir_block**) realloc(written, writes_size*sizeof(*written));
+        }
+        buffers[writes_count] = (unsigned char*) valloc(block_size);
+        dir_serialize_block(b, buffers[writes_count]);
+        written[writes_count++] = b;
+    }
+
+    /* the checkpoint has everything the journal would get from these */
+    for (i=0; i<locked_count; ++i) {
+        locked[i]->journal_dirty = 0;
+        locked[i]->journal_first = locked[i]->journal_end = 0;
+        locked[i]->saving = 0;
+        pthread_rwlock_unlock(&locked[i]->lock);
+    }
+    journal_ops_len = 0;
+
+    /* New places for everything written, taken at once to be able to back off cleanly */
+    int table_writes = 0;
+    for (k=0; k<dir_table_depth; ++k) {
+        for (i=0; i<dir_table[k].count; ++i) table_writes += dir_table[k].dirty[i];
+    }
+    int total = writes_count + table_writes;
+    /* and the first block of the new journal */
+    int allocations = total + (journal_max_blocks ? 1 : 0);
+    int* nums = (int*) malloc((allocations+1)*sizeof(int));
+    for (i=0; i<allocations; ++i) {
+        nums[i] = allocate_block(1);
+        if (nums[i] == -1) {
+            for (j=0; j<i; ++j) mark_unused_block(nums[j]);
+            for (j=0; j<writes_count; ++j) free(buffers[j]);
+            free(buffers);
+            free(written);
+            free(nums);
+            /* the blocks stay dirty and are retried by the next save, which can't be a journal commit */
+            for (j=0; j<locked_count; ++j) __sync_lock_test_and_set(&locked[j]->journal_dirty, 1);
+            free(locked);
+            journal_stop();
+            mark_dirty();
+            errno = ENOSPC;
+            return -1;
+        }
+    }
+    
+    /* 
+       The layout gets the new places for serializing, it goes back to the old ones 
+       if anything fails to be written. The replaced blocks become stale only once
+       the new root is written, till then the old directory stays intact.
+    */
+    int* old_nums = (int*) malloc((total+1)*sizeof(int));
+    int old_journal_next_block = journal_next_block;
+    journal_next_block = journal_max_blocks ? nums[total] : -1;
+    do {
+        random_bytes(&journal_epoch, sizeof(journal_epoch));
+    } while (!journal_epoch);
+    journal_seq = 0;
+    journal_blocks_count = 0;
+
+    buffers = (unsigned char**) realloc(buffers, (total+1)*sizeof(*buffers));
+    for (i=0; i<writes_count; ++i) {
+        old_nums[i] = written[i]->num;
+        written[i]->num = nums[i];
+    }
+    /* lower levels first, upper ones list their new numbers */
+    for (k=0; k<dir_table_depth; ++k) {
+        for (j=0; j<dir_table[k].count; ++j) {
+            if (!dir_table[k].dirty[j]) continue;
+            old_nums[i] = dir_table[k].nums[j];
+            dir_table[k].nums[j] = nums[i];
+            buffers[i] = (unsigned char*) valloc(block_size);
+            dir_serialize_table_block(k, j, buffers[i]);
+            ++i;
+        }
+    }
+
+    for (i=0; i<total; ++i) {
+        encrypt_block_simple(buffers[i], nums[i]);
+    }
+    ok = rw_blocks_ll(buffers, nums, total, 1);
+    __sync_fetch_and_add(&foreground_block_writes, total);
+
+    unsigned char* root = (unsigned char*) valloc(block_size);
+    dir_serialize_root(root);
+    ok = ok && write_block_simple(root, starting_block);
+
+    /* the dirty flags are still set, so the next save writes the same blocks again */
+    i = writes_count;
+    for (k=0; k<dir_table_depth; ++k) {
+        for (j=0; j<dir_table[k].count; ++j) {
+            if (!dir_table[k].dirty[j]) continue;
+            if (ok) {
+                add_stale_directory_block(old_nums[i]);
+                dir_table[k].dirty[j] = 0;
+            } else {
+                dir_table[k].nums[j] = old_nums[i];
+            }
+            ++i;
+        }
+    }
+    for (i=0; i<writes_count; ++i) {
+        if (ok) {
+            add_stale_directory_block(old_nums[i]);
+            written[i]->dirty = 0;
+        } else {
+            written[i]->num = old_nums[i];
+        }
+    }
+    free(written);
+    free(old_nums);
+    for (i=0; i<total; ++i) free(buffers[i]);
+    free(buffers);
+    free(root);
+
+    if (!ok) {
+        fprintf(stderr, "Failed to write the directory, it is kept as it was\n");
+        for (i=0; i<allocations; ++i) mark_unused_block(nums[i]);
+        free(nums);
+        /* the changes taken out of the entries are only in the dirty blocks now, fsync still sees them */
+        for (i=0; i<locked_count; ++i) __sync_lock_test_and_set(&locked[i]->journal_dirty, 1);
+        free(locked);
+        journal_next_block = old_journal_next_block;
+        journal_stop();
+        mark_dirty();
+        errno = EIO;
+        return -1;
+    }
+    free(nums);
+    /* the old journal gets freed along with the replaced directory blocks */
+    add_stale_directory_block(old_journal_next_block);
+
+    /* the old directory is kept till the new one is known to be on the storage */
+    if (!no_sync && fdatasync(data)) {
+        int err = errno;
+        perror("fdatasync");
+        /* the written blocks may be lost: the next checkpoint writes these entries again, fsync still sees them */
+        for (i=0; i<locked_count; ++i) {
+            __sync_lock_test_and_set(&locked[i]->meta_dirty, 1);
+            __sync_lock_test_and_set(&locked[i]->journal_dirty, 1);
+        }
+        free(locked);
+        journal_stop();
+        mark_dirty();
+        errno = err;
+        return -1;
+    }
+    free(locked);
+
+    for (i=0; i<stale_directory_blocks_count; ++i) {
+        if (stale_directory_blocks[i]!=starting_block) {
+            mark_unused_block(stale_directory_blocks[i]);
+        }
+    }
+    stale_directory_blocks_count = 0;
+    return starting_block;
+}
+
+/* Journal block: header, epoch - 8 bytes, sequence number, next block, flags, used bytes - 4 bytes each, records */
+#define JOURNAL_SIGNATURE "RndAllJ1"
+#define JOURNAL_HEADER_SIZE (BLOCK_HEADER_SIZE+24)
+#define JOURNAL_COMMIT_END 1 /* last block of a commit */
+
+/* Journal blocks of the commit being built */
+struct journal_writer {
+    unsigned char** blocks;
+    int count;
+    int size;
+    int offset; /* in the last block */
+};
+
+static int journal_max_record() { return block_size - JOURNAL_HEADER_SIZE - JOURNAL_RECORD_HEADER_SIZE; }
+
+static void journal_writer_close_block(struct journal_writer* w) {
+    unsigned char* b = w->blocks[w->count-1];
+    *(uint32_t*)(b+BLOCK_HEADER_SIZE+20) = htobe32(w->offset);
+    random_bytes(b+w->offset, block_size-w->offset);
+}
+
+/* Appends a record (len is at most journal_max_record), returns where its body goes */
+static unsigned char* journal_writer_record(struct journal_writer* w, int type, int len) {
+    if (!w->count || w->offset + JOURNAL_RECORD_HEADER_SIZE + len > block_size) {
+        if (w->count) journal_writer_close_block(w);
+        if (w->count == w->size) {
+            w->size = w->size ? w->size*2 : 4;
+            w->blocks = (unsigned char**) realloc(w->blocks, (w->size+1)*sizeof(*w->blocks));
+        }
+        w->blocks[w->count++] = (unsigned char*) valloc(block_size);
+        w->offset = JOURNAL_HEADER_SIZE;
+    }
+    unsigned char* r = w->blocks[w->count-1] + w->offset;
+    r[0] = type;
+    *(uint32_t*)(r+1) = htobe32(len);
+    w->offset += JOURNAL_RECORD_HEADER_SIZE + len;
+    return r + JOURNAL_RECORD_HEADER_SIZE;
+}
+
+static void journal_writer_free(struct journal_writer* w) {
+    int i;
+    for (i=0; i<w->count; ++i) free(w->blocks[i]);
+    free(w->blocks);
+}
+
+/* 
+   Length of the entry and its blocks changed since the last commit. Caller holds the read lock of ent.
+   Returns -1 if the path is too long for a journal record.
+*/
+static int journal_put_entry(struct journal_writer* w, struct mydirent* ent) {
+    int l = get_path_length(ent);
+    int max_count = (journal_max_record() - 8 - l) / 8;
+    if (max_count < 1) return -1;
+    
+    unsigned char* r = journal_writer_record(w, JOURNAL_LENGTH, 8+l);
+    *(uint64_t*)r = htobe64(ent->length);
+    get_full_path(ent, (char*)r+8);
+    
+    int bc = get_block_count_for_length(ent->length);
+    int first = imax(ent->journal_first, 0);
+    int end = imin(ent->journal_end, bc);
+    while (first < end) {
+        int n = imin(end-first, max_count);
+        /* fill up the current block before starting a new one */
+        int room = (block_size - w->offset - JOURNAL_RECORD_HEADER_SIZE - 8 - l) / 8;
+        if (room >= 1) n = imin(n, room);
+        r = journal_writer_record(w, JOURNAL_BLOCKS, 8 + 8*n + l);
+        *(uint32_t*)r = htobe32(first);
+        *(uint32_t*)(r+4) = htobe32(n);
+        int j;
+        for (j=0; j<n; ++j) {
+            *(uint32_t*)(r+8+8*j) = htobe32(ent->blocks[first+j].num);
+            *(uint32_t*)(r+12+8*j) = htobe32(ent->blocks[first+j].iv);
+        }
+        get_full_path(ent, (char*)r+8+8*n);
+        first += n;
+    }
+    return 0;
+}
+
+/*
+   Appends the changes since the previous commit to the journal: the logged creations, removals 
+   and renames, then lengths and changed blocks of the entries. Much cheaper than a checkpoint, 
+   which is done instead when there is no journal or it would grow beyond journal_max_blocks.
+   Same conditions and return value as save_entries_ll.
+*/
+int commit_entries_ll(int starting_block) {
+    int i, j;
+    
+    if (journal_next_block == -1) {
+        return save_entries_ll(starting_block);
+    }
+    if (!__sync_lock_test_and_set(&dirty_status, 0)) {
+        return starting_block;
+    }
+    __sync_lock_test_and_set(&dirty_bytes, 0);
+    
+    struct journal_writer w = {NULL, 0, 0, 0};
+    int too_big = 0;
+    /* the entries the changes are taken from, they get journal_dirty back if the commit fails */
+    struct mydirent** taken = (struct mydirent**) malloc((dirent_entries_count+1) * sizeof(*taken));
+    int taken_count = 0;
+    for (i=0; i<journal_ops_len; ) {
+        int len = be32toh(*(uint32_t*)(journal_ops+i+1));
+        if (len > journal_max_record()) {
+            too_big = 1;
+            break;
+        }
+        memcpy(journal_writer_record(&w, journal_ops[i], len), journal_ops+i+JOURNAL_RECORD_HEADER_SIZE, len);
+        i += JOURNAL_RECORD_HEADER_SIZE + len;
+    }
+    journal_ops_len = 0;
+    
+    /* 
+       The changes are taken out of the entries here. If they don't get committed after all,
+       the entries are still meta_dirty and the checkpoint saves them.
+    */
+    for (i=0; i<dirent_entries_count && !too_big; ++i) {
+        struct mydirent* ent = dirents[i];
+        if (!__atomic_load_n(&ent->journal_dirty, __ATOMIC_RELAXED)) continue;
+        pthread_rwlock_rdlock(&ent->lock);
+        if (journal_put_entry(&w, ent) == -1) too_big = 1;
+        ent->journal_dirty = 0;
+        ent->journal_first = ent->journal_end = 0;
+        pthread_rwlock_unlock(&ent->lock);
+        taken[taken_count++] = ent;
+    }
+    
+    if (too_big || journal_blocks_count + w.count > journal_max_blocks) {
+        journal_writer_free(&w);
+        free(taken);
+        journal_stop();
+        __sync_fetch_and_add(&dirty_status, 1);
+        return save_entries_ll(starting_block);
+    }
+    if (!w.count) {
+        free(taken);
+        return starting_block;
+    }
+    journal_writer_close_block(&w);
+    
+    /* the first block was taken by the previous commit (or checkpoint), each block takes the next one */
+    int* nums = (int*) malloc((w.count+1)*sizeof(int));
+    nums[0] = journal_next_block;
+    for (i=1; i<=w.count; ++i) {
+        nums[i] = allocate_block(1);
+        if (nums[i] == -1) {
+            for (j=1; j<i; ++j) mark_unused_block(nums[j]);
+            journal_writer_free(&w);
+            free(nums);
+            /* the entries are still meta_dirty for the checkpoint */
+            for (j=0; j<taken_count; ++j) __sync_lock_test_and_set(&taken[j]->journal_dirty, 1);
+            free(taken);
+            journal_stop();
+            mark_dirty();
+            errno = ENOSPC;
+            return -1;
+        }
+    }
+    
+    for (i=0; i<w.count; ++i) {
+        unsigned char* b = w.blocks[i];
+        random_bytes(b, 8);
+        memcpy(b+8, JOURNAL_SIGNATURE, 8);
+        *(uint64_t*)(b+BLOCK_HEADER_SIZE) = htobe64(journal_epoch);
+        *(uint32_t*)(b+BLOCK_HEADER_SIZE+8) = htobe32(journal_seq+i);
+        *(uint32_t*)(b+BLOCK_HEADER_SIZE+12) = htobe32(nums[i+1]);
+        *(uint32_t*)(b+BLOCK_HEADER_SIZE+16) = htobe32(i == w.count-1 ? JOURNAL_COMMIT_END : 0);
+        encrypt_block_simple(b, nums[i]);
+    }
+    int ok = rw_blocks_ll(w.blocks, nums, w.count, 1);
+    __sync_fetch_and_add(&foreground_block_writes, w.count);
+    journal_writer_free(&w);
+    
+    if (!ok) {
+        /* an unfinished commit is not replayed, the entries are still meta_dirty for the checkpoint */
+        fprintf(stderr, "Failed to write the journal, saving the directory instead\n");
+        for (i=1; i<=w.count; ++i) mark_unused_block(nums[i]);
+        free(nums);
+        free(taken);
+        journal_stop();
+        __sync_fetch_and_add(&dirty_status, 1);
+        return save_entries_ll(starting_block);
+    }
+    /* freed when the next checkpoint replaces the journal */
+    for (i=0; i<w.count; ++i) add_stale_directory_block(nums[i]);
+    
+    journal_next_block = nums[w.count];
+    journal_seq += w.count;
+    journal_blocks_count += w.count;
+    free(nums);
+    
+    if (!no_sync && fdatasync(data)) {
+        int err = errno;
+        perror("fdatasync");
+        /* the commit may be lost, the entries are still meta_dirty for the checkpoint */
+        for (i=0; i<taken_count; ++i) __sync_lock_test_and_set(&taken[i]->journal_dirty, 1);
+        free(taken);
+        journal_stop();
+        mark_dirty();
+        errno = err;
+        return -1;
+    }
+    free(taken);
+    return starting_block;
+}
+
+/* Saves are serialized. The tree is only read-locked, so lookups and file IO go on meanwhile. */
+int save_entries(int starting_block) {
+    pthread_mutex_lock(&save_lock);
+    pthread_rwlock_rdlock(&tree_lock);
+    /* the saved IVs must match the data on disk */
+    cache_flush_all();
+    int ret = commit_entries_ll(starting_block);
+    int err = errno;
+    lru_evict_ll();
+    pthread_rwlock_unlock(&tree_lock);
+    pthread_mutex_unlock(&save_lock);
+    errno = err;
+    return ret;
+}
+
+/* Saves everything to the directory itself, leaving the journal empty (on unmount) */
+int checkpoint_entries(int starting_block) {
+    pthread_mutex_lock(&save_lock);
+    pthread_rwlock_rdlock(&tree_lock);
+    cache_flush_all();
+    if (journal_blocks_count) {
+        __sync_fetch_and_add(&dirty_status, 1);
+    }
+    int ret = save_entries_ll(starting_block);
+    lru_evict_ll();
+    pthread_rwlock_unlock(&tree_lock);
+    pthread_mutex_unlock(&save_lock);
+    return ret;
+}
+
+/* return number of loaded entries on success, 0 on failure */
+static int load_entries_v0(unsigned char* block, int starting_block, int only_mark_blocks) {
+    int current_block = starting_block;
+    int offset=BLOCK_HEADER_SIZE;
+
+    int j;
+    int counter = 0;
+
+    char* previous_entry_name = strdup("///"); /* non-existing name */
+
+    struct mydirent *ent = NULL;
+
+    for(;;) {
+        int pathlen = be32toh(*(long int*)(block+offset)); offset+=4;
+        if(pathlen < 0 || pathlen >= block_size-32) { free(previous_entry_name); return 0; }
+        if (!only_mark_blocks) {
+            char* path = strndup((char*)(block+offset), pathlen);
+            if (!strcmp(previous_entry_name, path)) {
+                /* continued blocks for old entry, not a new one */
+                free(path);
+            } else {
+                free(previous_entry_name);
+                previous_entry_name = path;
+                /* may already exist if it was created as a parent of some earlier entry */
+                ent = find_dirent(path);
+                if (!ent) ent = create_dirent(path);
+                if (!ent) {
+                    fprintf(stderr, "Entry name too long and ignored\n");
+                }
+            }
+        }
+        offset+=pathlen;
+        long long int filelen = be64toh(*(long long int*)(block+offset)); offset+=8;
+        if (ent) {
+            ent->length = filelen;
+        }
+
+        int bc = get_block_count_for_length(filelen);
+        int blocks_here = be32toh(*(long int*)(block+offset)); offset+=4;
+        int position_in_block_list = be32toh(*(long int*)(block+offset)); offset+=4;
+        if (ent && !ent->blocks && bc) {
+            ent->blocks_array_size = nearest_power_of_two(bc);
+            ent->blocks = (struct myblock*)malloc(ent->blocks_array_size * sizeof(*ent->blocks));
+            memset(ent->blocks, 0, ent->blocks_array_size);
+        }
+        for (j=0; j<blocks_here; ++j) {
+            int idx = be32toh(*(long int*)(block+offset)); offset+=4;
+            unsigned long iv = be32toh(*(long int*)(block+offset)); offset+=4;
+            if(idx>=0 && idx<block_count) {
+                mark_used_block(idx);
+                if (ent) {
+                    ent->blocks[j+position_in_block_list].num = idx;
+                    ent->blocks[j+position_in_block_list].iv = iv;
+                }
+            } else {
+                free(previous_entry_name);
+                return 0;
+            }
+        }
+
+        ++counter;
+
+        int next_block = be32toh(*(long int*)(block+offset)); offset+=4;
+        int next_offset = be32toh(*(long int*)(block+offset)); offset+=4;
+
+        if (next_block == 0 && next_offset == 0) break;
+
+        if (next_block < 0 || next_block >= block_count) { free(previous_entry_name); return 0; }
+        if (next_offset < BLOCK_HEADER_SIZE || next_offset >= block_size-32) { free(previous_entry_name); return 0; }
+
+        if (next_block != current_block) {
+            current_block = next_block;
+            read_block_simple(block, current_block);
+            if (memcmp(block+8, SIGNATURE_V0, 8)) {
+                fprintf(stderr, "Signature failed in loading block\n");
+                free(previous_entry_name);
+                return counter;
+            }
+            mark_used_block(current_block);
+            /* the whole chain is replaced by the next save */
+            if (!only_mark_blocks) add_stale_directory_block(current_block);
+        }
+
+        offset = next_offset;
+    }
+
+    free(previous_entry_name);
+    return counter;
+}
+
+/* Remembers where a part of the lazily loaded block list is */
+static void lazy_add_record(struct mydirent* ent, int num, const struct dir_record* r) {
+    int n = ent->lazy_records_count;
+    if (!(n & (n-1))) {
+        ent->lazy_records = (struct saved_record*)realloc(ent->lazy_records, (n ? 2*n : 1)*sizeof(*ent->lazy_records));
+    }
+    struct saved_record* l = &ent->lazy_records[ent->lazy_records_count++];
+    l->num = num;
+    l->offset = r->offset;
+    l->first = r->first;
+    l->count = r->count;
+}
+
+/* 
+   Entry of a loaded record, with room for its blocks unless they are loaded lazily. 
+   NULL if b is NULL (only marking blocks) or the path is unusable.
+*/
+static struct mydirent* dir_record_entry(struct dir_block* b, const char* path, int pathlen, long long int filelen, int lazy) {
+    if (!b) return NULL;
+    char* p = strndup(path, pathlen);
+    /* may already exist if it was created as a parent of some earlier entry, or by its other records */
+    struct mydirent* ent = find_dirent(p);
+    if (!ent) ent = create_dirent(p);
+    if (!ent) fprintf(stderr, "Entry name too long and ignored\n");
+    free(p);
+    if (ent) {
+        int bc = get_block_count_for_length(filelen);
+        ent->length = filelen;
+        if (lazy && bc) {
+            ent->blocks_lazy = 1;
+        } else if (bc > ent->blocks_array_size) {
+            ent->blocks_array_size = nearest_power_of_two(bc);
+            ent->blocks = (struct myblock*)realloc(ent->blocks, ent->blocks_array_size * sizeof(*ent->blocks));
+        }
+    }
+    return ent;
+}
+
+/*
+   Decodes count blocks of a record starting at offset (extents, then IVs) into blocks if not NULL,
+   marking them used if mark is set. Returns the offset past the record, -1 if malformed.
+*/
+static int dir_decode_blocks(const unsigned char* block, int offset, struct myblock* blocks, int count, int mark) {
+    int j, k;
+    uint64_t v;
+    long long int expected = 0;
+    /* extents: distance from the end of the previous one (zigzag encoded), length minus one */
+    for (j=0; j<count; ) {
+        if ((offset = get_varint(block, offset, block_size, &v)) == -1) return -1;
+        long long int first = expected + unzigzag(v);
+        if ((offset = get_varint(block, offset, block_size, &v)) == -1) return -1;
+        if (v >= (uint64_t)(count - j) || first < 0 || first + (long long int)v >= block_count) return -1;
+        for (k=0; k<=(int)v; ++k, ++j) {
+            if (mark) mark_used_block(first+k);
+            if (blocks) blocks[j].num = first+k;
+        }
+        expected = first + v + 1;
+    }
+    if (offset + 4*count > block_size) return -1;
+    for (j=0; j<count; ++j) {
+        if (blocks) blocks[j].iv = be32toh(*(uint32_t*)(block+offset));
+        offset += 4;
+    }
+    return offset;
+}
+
+/* Parses the records of a directory block into b (if not NULL). Returns the number of records, -1 if malformed. */
+static int dir_load_block(const unsigned char* block, struct dir_block* b) {
+    int offset = BLOCK_HEADER_SIZE;
+    int count = 0, l = 0;
+    uint64_t suffix, prefix, filelen, position, blocks_here;
+    char* path = (char*) malloc(block_size);
+    /* offset becomes -1 on malformed records */
+    while (offset < block_size) {
+        int start = offset;
+        if ((offset = get_varint(block, offset, block_size, &suffix)) == -1) break;
+        if (suffix == 0) break;
+        if ((offset = get_varint(block, offset, block_size, &prefix)) == -1) break;
+        if (prefix > (uint64_t)l || suffix > (uint64_t)(block_size - offset)) { offset = -1; break; }
+        memcpy(path+prefix, block+offset, suffix);
+        offset += suffix;
+        l = prefix + suffix;
+        if ((offset = get_varint(block, offset, block_size, &filelen)) == -1) break;
+        if ((offset = get_varint(block, offset, block_size, &position)) == -1) break;
+        if ((offset = get_varint(block, offset, block_size, &blocks_here)) == -1) break;
+        if ((long long int)filelen < 0) { offset = -1; break; }
+        int bc = get_block_count_for_length(filelen);
+        if (position > (uint64_t)bc || blocks_here > (uint64_t)bc - position || 
+                blocks_here > (uint64_t)(block_size - offset) / 4) { 
+            offset = -1; 
+            break; 
+        }
+        
+        struct mydirent* ent = dir_record_entry(b, path, l, filelen, lazy_block_lists);
+        struct myblock* blocks = (ent && !ent->blocks_lazy) ? ent->blocks + position : NULL;
+        if ((offset = dir_decode_blocks(block, offset, blocks, blocks_here, 1)) == -1) break;
+        if (ent) {
+            dir_add_record(b, ent, position, blocks_here, offset - start);
+            b->records[b->records_count-1].offset = start;
+            if (ent->blocks_lazy) lazy_add_record(ent, b->num, &b->records[b->records_count-1]);
+        }
+        ++count;
+    }
+    free(path);
+    return (offset == -1) ? -1 : count;
+}
+
+/* Parses the records of a V1 directory block, like dir_load_block */
+static int dir_load_block_v1(const unsigned char* block, struct dir_block* b) {
+    int offset = BLOCK_HEADER_SIZE;
+    int count = 0;
+    int j;
+    while (offset+4 <= block_size) {
+        int pathlen = be32toh(*(uint32_t*)(block+offset));
+        if (pathlen == 0) break;
+        if (pathlen < 0 || pathlen > block_size - offset - DIR_RECORD_HEADER_SIZE) return -1;
+        const char* path = (const char*)block+offset+4;
+        offset += 4+pathlen;
+        long long int filelen = be64toh(*(uint64_t*)(block+offset)); offset+=8;
+        int blocks_here = be32toh(*(uint32_t*)(block+offset)); offset+=4;
+        int position = be32toh(*(uint32_t*)(block+offset)); offset+=4;
+        int bc = get_block_count_for_length(filelen);
+        if (filelen < 0 || blocks_here < 0 || position < 0 || position > bc - blocks_here) return -1;
+        if (blocks_here > (block_size - offset) / 8) return -1;
+
+        struct mydirent* ent = dir_record_entry(b, path, pathlen, filelen, 0);
+        for (j=0; j<blocks_here; ++j) {
+            int idx = be32toh(*(uint32_t*)(block+offset)); offset+=4;
+            uint32_t iv = be32toh(*(uint32_t*)(block+offset)); offset+=4;
+            if (idx<0 || idx>=block_count) return -1;
+            mark_used_block(idx);
+            if (ent) {
+                ent->blocks[position+j].num = idx;
+                ent->blocks[position+j].iv = iv;
+            }
+        }
+        if (ent) dir_add_record(b, ent, position, blocks_here, DIR_RECORD_HEADER_SIZE + pathlen + 8*blocks_here);
+        ++count;
+    }
+    return count;
+}
+
+/*
+   Decodes the block list of a lazily loaded entry from its saved records. They stay in place 
+   while it is loading: the blocks holding them are only replaced by a save, which locks
+   the entry and loads its list first. Caller holds the locks listed for it in the locking notes.
+   Returns 0 on failure, the entry stays without its blocks then.
+*/
+int load_block_list(struct mydirent* ent) {
+    int i, j, ok;
+    if (!ent->blocks_lazy) return 1;
+    int bc = get_block_count_for_length(ent->length);
+    int n = ent->lazy_records_count;
+    int size = nearest_power_of_two(bc);
+    struct myblock* blocks = (struct myblock*) malloc(size * sizeof(*blocks));
+    unsigned char** buffers = (unsigned char**) malloc((n+1) * sizeof(*buffers));
+    int* nums = (int*) malloc((n+1) * sizeof(int));
+    for (i=0; i<n; ++i) {
+        buffers[i] = (unsigned char*) valloc(block_size);
+        nums[i] = ent->lazy_records[i].num;
+    }
+    for (j=0; j<bc; ++j) blocks[j].num = -1;
+    
+    ok = read_blocks_simple(buffers, nums, n);
+    for (i=0; i<n && ok; ++i) {
+        const unsigned char* block = buffers[i];
+        const struct saved_record* r = &ent->lazy_records[i];
+        uint64_t suffix, prefix, filelen, position, count;
+        int offset = r->offset;
+        /* skip the path and the length, the rest has to be what was seen at mount */
+        ok = 0;
+        if (memcmp(block+8, SIGNATURE, 8) || r->first < 0 || r->count > bc - r->first) break;
+        if ((offset = get_varint(block, offset, block_size, &suffix)) == -1) break;
+        if ((offset = get_varint(block, offset, block_size, &prefix)) == -1) break;
+        if (suffix > (uint64_t)(block_size - offset)) break;
+        offset += suffix;
+        if ((offset = get_varint(block, offset, block_size, &filelen)) == -1) break;
+        if ((offset = get_varint(block, offset, block_size, &position)) == -1) break;
+        if ((offset = get_varint(block, offset, block_size, &count)) == -1) break;
+        if (position != (uint64_t)r->first || count != (uint64_t)r->count) break;
+        ok = dir_decode_blocks(block, offset, blocks + r->first, r->count, 0) != -1;
+    }
+    for (j=0; j<bc && ok; ++j) ok = (blocks[j].num != -1);
+    
+    for (i=0; i<n; ++i) free(buffers[i]);
+    free(buffers);
+    free(nums);
+    if (!ok) {
+        free(blocks);
+        fprintf(stderr, "Failed to load the block list of a file\n");
+        return 0;
+    }
+    ent->blocks = blocks;
+    ent->blocks_array_size = size;
+    ent->blocks_lazy = 0;
+    free(ent->lazy_records);
+    ent->lazy_records = NULL;
+    ent->lazy_records_count = 0;
+    if (!ent->open_count) lru_add(ent);
+    return 1;
+}
+
+/* Whether the block list can be loaded from the saved records again. Caller holds the write lock of ent and save_lock. */
+static int block_list_evictable(const struct mydirent* ent) {
+    int i, j;
+    if (ent->open_count || ent->unlinked || ent->meta_dirty || ent->journal_dirty || !ent->saved_in_count) return 0;
+    for (i=0; i<ent->saved_in_count; ++i) {
+        const struct dir_block* b = ent->saved_in[i];
+        if (b->dirty || b->num == -1) return 0;
+        for (j=0; j<b->records_count; ++j) {
+            if (b->records[j].ent == ent && b->records[j].offset == -1) return 0;
+        }
+    }
+    return 1;
+}
+
+/* 
+   Drops the block lists of closed unchanged files, least recently used first, while they take too much.
+   Caller holds save_lock and tree_lock.
+*/
+void lru_evict_ll() {
+    int i, j;
+    if (!lazy_block_lists) return;
+    pthread_mutex_lock(&lru_lock);
+    struct mydirent* ent = lru_head;
+    while (ent && block_lists_bytes > block_lists_max_bytes) {
+        struct mydirent* next = ent->lru_next;
+        /* the lock order is the other way round, don't wait */
+        if (!pthread_rwlock_trywrlock(&ent->lock)) {
+            if (block_list_evictable(ent)) {
+                lru_unlink(ent);
+                for (i=0; i<ent->saved_in_count && ent->length > 0; ++i) {
+                    struct dir_block* b = ent->saved_in[i];
+                    for (j=0; j<b->records_count; ++j) {
+                        if (b->records[j].ent == ent) lazy_add_record(ent, b->num, &b->records[j]);
+                    }
+                }
+                free(ent->blocks);
+                ent->blocks = NULL;
+                ent->blocks_array_size = 0;
+                ent->blocks_lazy = (ent->length > 0);
+            }
+            pthread_rwlock_unlock(&ent->lock);
+        }
+        ent = next;
+    }
+    pthread_mutex_unlock(&lru_lock);
+}
+
+/* Directory blocks of a list read ahead of parsing, see dir_batch_get */
+struct dir_batch {
+    unsigned char* arena;
+    unsigned char** buffers;
+    int* nums;
+    int size;  /* blocks fitting in the arena */
+    int first; /* the arena holds list entries [first, end) */
+    int end;
+};
+
+static void dir_batch_init(struct dir_batch* bb, int total) {
+    bb->size = imax(1, imin(total, LOAD_BATCH_BYTES / block_size));
+    bb->arena = (unsigned char*) valloc((size_t)bb->size * block_size);
+    bb->buffers = (unsigned char**) malloc(bb->size * sizeof(*bb->buffers));
+    bb->nums = (int*) malloc(bb->size * sizeof(*bb->nums));
+    bb->first = bb->end = 0;
+}
+
+static void dir_batch_free(struct dir_batch* bb) {
+    free(bb->arena);
+    free(bb->buffers);
+    free(bb->nums);
+}
+
+/*
+   Decrypted block nums[k] of the list of total block numbers. When k is outside
+   of the current batch, reads the next one: all valid numbers of up to bb->size entries
+   starting from k at once. Only valid entries may be asked for. NULL on failure.
+*/
+static unsigned char* dir_batch_get(struct dir_batch* bb, const int* nums, int k, int total) {
+    if (k < bb->first || k >= bb->end) {
+        int j, n = 0;
+        bb->first = k;
+        bb->end = imin(k + bb->size, total);
+        for (j=k; j<bb->end; ++j) {
+            if (nums[j] < 0 || nums[j] >= block_count) continue;
+            bb->buffers[n] = bb->arena + (size_t)(j-k) * block_size;
+            bb->nums[n] = nums[j];
+            ++n;
+        }
+        if (!read_blocks_simple(bb->buffers, bb->nums, n)) {
+            bb->end = bb->first;
+            return NULL;
+        }
+    }
+    return bb->arena + (size_t)(k - bb->first) * block_size;
+}
+
+/*
+   Reads the table blocks listed in parents and returns block numbers listed by them
+   (children_count of them, empty slots are -1). NULL on failure.
+*/
+static int* dir_read_table_level(const int* parents, int parents_count, int children_count, int mark, const unsigned char* signature) {
+    int i, j;
+    int n = dir_table_fanout();
+    int* children = (int*) malloc((children_count+1)*sizeof(int));
+    struct dir_batch bb;
+    dir_batch_init(&bb, parents_count);
+    for (i=0; i<parents_count; ++i) {
+        if (parents[i] < 0 || parents[i] >= block_count) break;
+        unsigned char* block = dir_batch_get(&bb, parents, i, parents_count);
+        if (!block || memcmp(block+8, signature, 8)) break;
+        if (mark) mark_used_block(parents[i]);
+        for (j=0; j<n && i*n+j<children_count; ++j) {
+            children[i*n+j] = be32toh(*(uint32_t*)(block+BLOCK_HEADER_SIZE+4*j));
+        }
+    }
+    dir_batch_free(&bb);
+    if (i < parents_count) {
+        free(children);
+        return NULL;
+    }
+    return children;
+}
+
+/* Block numbers of the slots listed by the root, through all the table levels (signed like the root). NULL on failure. */
+static int* dir_read_table(const unsigned char* root, int* slots_count, int mark, int keep) {
+    int k, i;
+    int slots = be32toh(*(uint32_t*)(root+BLOCK_HEADER_SIZE));
+    int depth = be32toh(*(uint32_t*)(root+BLOCK_HEADER_SIZE+4));
+    if (slots < 0 || depth < 0 || depth > DIR_MAX_DEPTH || depth != dir_table_depth_for(slots)) return NULL;
+
+    int counts[DIR_MAX_DEPTH];
+    dir_table_counts(slots, depth, counts);
+    int n = depth ? counts[depth-1] : slots;
+    int* nums = (int*) malloc((n+1)*sizeof(int));
+    for (i=0; i<n; ++i) nums[i] = be32toh(*(uint32_t*)(root+DIR_ROOT_HEADER_SIZE+4*i));
+
+    for (k=depth-1; k>=0; --k) {
+        int* children = dir_read_table_level(nums, counts[k], k ? counts[k-1] : slots, mark, root+8);
+        if (keep && children) {
+            dir_table[k].nums = nums;
+            dir_table[k].dirty = (unsigned char*) calloc(counts[k], 1);
+            dir_table[k].count = counts[k];
+            dir_table_depth = depth;
+        } else {
+            free(nums);
+        }
+        nums = children;
+        if (!nums) return NULL;
+    }
+    *slots_count = slots;
+    return nums;
+}
+
+int compare_ints(const void* a, const void* b) {
+    int x = *(const int*)a;
+    int y = *(const int*)b;
+    return (x > y) - (x < y);
 }
 
-/* Returns first entry's block. -1 on failure */
-int save_entries(int starting_block) {
-    int i, j;
+/* 
+   Reads the journal listed in the root: blocks of the current epoch linked one after another.
+   Returns the number of blocks belonging to complete commits, they (and their numbers) are 
+   returned in blocks and nums. The caller frees both and the blocks.
+*/
+static int journal_read_chain(const unsigned char* root, unsigned char*** blocks, int** nums) {
+    int first = (int)be32toh(*(uint32_t*)(root+BLOCK_HEADER_SIZE+8));
+    uint64_t epoch = be64toh(*(uint64_t*)(root+BLOCK_HEADER_SIZE+12));
+    int count = 0, size = 0, committed = 0;
+    *blocks = NULL;
+    *nums = NULL;
+    if (!epoch) return 0;
     
-    if (!dirty_status) {
-        return starting_block;
+    int num = first;
+    while (num >= 0 && num < block_count && count < block_count) {
+        unsigned char* b = (unsigned char*) malloc(block_size);
+        read_block_simple(b, num);
+        int used = be32toh(*(uint32_t*)(b+BLOCK_HEADER_SIZE+20));
+        if (memcmp(b+8, JOURNAL_SIGNATURE, 8) ||
+                be64toh(*(uint64_t*)(b+BLOCK_HEADER_SIZE)) != epoch ||
+                (int)be32toh(*(uint32_t*)(b+BLOCK_HEADER_SIZE+8)) != count ||
+                used < JOURNAL_HEADER_SIZE || used > block_size) {
+            free(b);
+            break;
+        }
+        if (count == size) {
+            size = size ? size*2 : 16;
+            *blocks = (unsigned char**) realloc(*blocks, size*sizeof(**blocks));
+            *nums = (int*) realloc(*nums, size*sizeof(**nums));
+        }
+        (*blocks)[count] = b;
+        (*nums)[count++] = num;
+        if (be32toh(*(uint32_t*)(b+BLOCK_HEADER_SIZE+16)) & JOURNAL_COMMIT_END) committed = count;
+        num = be32toh(*(uint32_t*)(b+BLOCK_HEADER_SIZE+12));
     }
+    /* the rest is an interrupted commit */
+    while (count > committed) free((*blocks)[--count]);
+    return committed;
+}
+
+/* Applies one journal record to the loaded tree. With only_mark_blocks, just marks the blocks given to files. */
+static void journal_replay_record(int type, const unsigned char* r, int len, int only_mark_blocks) {
+    struct mydirent* ent;
+    int j;
     
-    /* Need to do this early to prevent stray SIGALRM re-enter save_entries */
-    dirty_status=0;
-    dirty_bytes=0;
-    
-    
-    
-    int allocated_blocks_journal_size=32;
-    int *allocated_blocks_journal = (int*) malloc(allocated_blocks_journal_size*sizeof(int));
-    int number_of_allocated_blocks=0;
-    
-    int first_block = starting_block;
-    if(!first_block==-1) {
-        free(allocated_blocks_journal);
-        return -1;
+    if (type == JOURNAL_BLOCKS) {
+        if (len < 8) return;
+        int first = be32toh(*(uint32_t*)r);
+        int count = be32toh(*(uint32_t*)(r+4));
+        if (first < 0 || count < 0 || count > (len-8)/8) return;
+        ent = only_mark_blocks ? NULL : find_dirent_len((const char*)r+8+8*count, len-8-8*count);
+        if (ent && (is_directory(ent) || first+count > get_block_count_for_length(ent->length))) ent = NULL;
+        if (ent && !load_block_list(ent)) ent = NULL;
+        for (j=0; j<count; ++j) {
+            int num = be32toh(*(uint32_t*)(r+8+8*j));
+            uint32_t iv = be32toh(*(uint32_t*)(r+12+8*j));
+            if (num < 0 || num >= block_count) continue;
+            /* may still belong to the entry which released it earlier in the journal */
+            mark_used_block_if_free(num);
+            if (ent) {
+                if (ent->blocks[first+j].num != num && ent->blocks[first+j].num != -1) {
+                    release_block(ent->blocks[first+j].num);
+                }
+                ent->blocks[first+j].num = num;
+                ent->blocks[first+j].iv = iv;
+            }
+        }
+        if (ent) mark_ent_dirty(ent);
+        return;
     }
-    allocated_blocks_journal[number_of_allocated_blocks++] = first_block;
-    
-    int current_block = first_block;
-    
-    /* First block is saved last to prevent entirely corrupting the filesystem in case of sudden shutdown */
-    unsigned char* first_block_buffer = (unsigned char*) malloc(block_size);
-    unsigned char* block_buffer = (unsigned char*) malloc(block_size);
-    unsigned char* block = first_block_buffer;
-    fread(block, 1, 8, rnd);
-    memcpy(block+8, SIGNATURE, 8);
-    int offset = BLOCK_HEADER_SIZE; 
-    
-    int next_dirent_size = 0;
-    next_dirent_size = get_saved_entry_minimal_size(&dirents[0]);
-    
-    int position_in_block_list = 0;
-    int dirent_fully_saved = 0;
+    if (only_mark_blocks) return;
     
-    for (i=0; i<dirent_entries_count; ++i) {
-        struct mydirent* ent = &dirents[i];
-        
-        int current_dirent_size = next_dirent_size;
-        //fprintf(stderr, "i=%d bs=%d off=%d crs=%d\n", i, block_size, offset, current_dirent_size);
-        if (block_size - offset - current_dirent_size<4) {
-            fprintf(stderr, "Filepath too long for this block size and will be skipped\n");
-             if (i==dirent_entries_count-1) {
-                break;
-            } else {
-                next_dirent_size = get_saved_entry_minimal_size(&dirents[i+1]);
-            }
-            continue;
+    if (type == JOURNAL_LENGTH) {
+        if (len < 8) return;
+        long long int length = be64toh(*(uint64_t*)r);
+        ent = find_dirent_len((const char*)r+8, len-8);
+        if (!ent || is_directory(ent) || length < 0 || !load_block_list(ent)) return;
+        int old_bc = get_block_count_for_length(ent->length);
+        int bc = get_block_count_for_length(length);
+        for (j=bc; j<old_bc; ++j) {
+            if (ent->blocks[j].num != -1) release_block(ent->blocks[j].num);
         }
-        int number_of_blocks_we_will_save = (block_size - offset - current_dirent_size) / sizeof(struct myblock);
-        if (i==dirent_entries_count-1) {
-            next_dirent_size = 0;
-        } else {
-            next_dirent_size = get_saved_entry_minimal_size(&dirents[i+1]);
+        if (bc > ent->blocks_array_size) {
+            ent->blocks_array_size = nearest_power_of_two(bc);
+            ent->blocks = (struct myblock*)realloc(ent->blocks, ent->blocks_array_size * sizeof(*ent->blocks));
         }
-        //fprintf(stderr, "nds=%d\n", next_dirent_size);
-        
-        int path_string_length = strlen(ent->full_path);
-        long long int file_lenght = ent->length;
+        /* filled by the following blocks records */
+        for (j=old_bc; j<bc; ++j) ent->blocks[j].num = -1;
+        ent->length = length;
+        mark_ent_dirty(ent);
+    } else if (type == JOURNAL_CREATE) {
+        char* p = strndup((const char*)r, len);
+        if (!find_dirent(p)) create_dirent(p);
+        free(p);
+    } else if (type == JOURNAL_UNLINK) {
+        ent = find_dirent_len((const char*)r, len);
+        if (ent && ent != root_dirent && !ent->first_child) remove_dirent(ent);
+    } else if (type == JOURNAL_RENAME) {
+        if (len < 4) return;
+        int old_len = be32toh(*(uint32_t*)r);
+        if (old_len <= 0 || old_len > len-4) return;
+        const char* new_path = (const char*)r+4+old_len;
+        int l = len-4-old_len;
+        ent = find_dirent_len((const char*)r+4, old_len);
+        if (!ent || ent == root_dirent || find_dirent_len(new_path, l)) return;
+        if (l > 0 && new_path[l-1] == '/') --l;
+        int s = l;
+        while (s > 0 && new_path[s-1] != '/') --s;
+        if (s == l) return;
+        struct mydirent* newdir = find_dirent_len(new_path, s);
+        if (!newdir || !is_directory(newdir)) return;
+        struct mydirent* i;
+        for (i = newdir; i; i = i->parent) {
+            if (i == ent) return;
+        }
+        move_dirent(ent, newdir, new_path+s, l-s);
+    }
+}
+
+/* 
+   Frees the blocks released during the replay which nothing refers to in the end, 
+   journal_replaying is still set. Entries missing some blocks are cut short before them.
+*/
+static void journal_release_replayed(const int* chain, int chain_count) {
+    int i, j, k, n = 0;
+    int total = chain_count;
+    for (i=0; i<dirent_entries_count; ++i) {
+        total += get_block_count_for_length(dirents[i]->length);
+    }
+    int* used = (int*) malloc((total+1)*sizeof(int));
+    for (i=0; i<chain_count; ++i) used[n++] = chain[i];
+    for (i=0; i<dirent_entries_count; ++i) {
+        struct mydirent* ent = dirents[i];
         int bc = get_block_count_for_length(ent->length);
-        
-        if (bc <= position_in_block_list + number_of_blocks_we_will_save) {
-            number_of_blocks_we_will_save = bc - position_in_block_list;
-            dirent_fully_saved = 1;
-        } else {
-            dirent_fully_saved = 0;
-            next_dirent_size = current_dirent_size;
+        /* not touched by the journal, its blocks are all there */
+        if (ent->blocks_lazy) continue;
+        for (j=0; j<bc && ent->blocks[j].num != -1; ++j) {
+            used[n++] = ent->blocks[j].num;
         }
-        
-        *(long int*)(block+offset) = htobe32(path_string_length); offset+=4;
-        memcpy(block+offset, ent->full_path, path_string_length); offset+=path_string_length;
-        *(long long int*)(block+offset) = htobe64(file_lenght); offset+=8;
-        *(long int*)(block+offset) = htobe32(number_of_blocks_we_will_save); offset+=4;
-        *(long int*)(block+offset) = htobe32(position_in_block_list); offset+=4;
-        for (j=position_in_block_list; j<position_in_block_list + number_of_blocks_we_will_save; ++j) {
-            *(long int*)(block+offset) = htobe32(ent->blocks[j].num); offset+=4;
-            *(long int*)(block+offset) = htobe32(ent->blocks[j].iv); offset+=4;
-        }
-        position_in_block_list += number_of_blocks_we_will_save;
-        //fprintf(stderr, "Offset: %d\n", offset);
-        if (next_dirent_size == 0) {
-            *(long int*)(block+offset) = htobe32(0); offset+=4;
-            *(long int*)(block+offset) = htobe32(0); offset+=4;
-            memset(block+offset, 0, 8); offset+=8;            
-        } else if(offset+16+next_dirent_size < block_size) {
-            *(long int*)(block+offset) = htobe32(current_block); offset+=4;
-            *(long int*)(block+offset) = htobe32(offset+12); offset+=4;
-            memset(block+offset, 0, 8); offset+=8;            
-        } else {
-            int new_block = allocate_block(1);
-            if(new_block==-1) {                
-                free(first_block_buffer);
-                free(block_buffer);
-                /* rolling back block allocations... */
-                for (j=0; j<number_of_allocated_blocks; ++j) {
-                    if (allocated_blocks_journal[i]!=starting_block) {
-                        mark_unused_block(allocated_blocks_journal[i]);
-                    }
-                }
-                free(allocated_blocks_journal);
-                return -1;
-            } else {
-                if (allocated_blocks_journal_size == number_of_allocated_blocks) {
-                   allocated_blocks_journal_size*=2;
-                   allocated_blocks_journal = (int*)realloc(allocated_blocks_journal,
-                        allocated_blocks_journal_size*sizeof(int));
-                }
-                allocated_blocks_journal[number_of_allocated_blocks++] = new_block;
-            }
-            *(long int*)(block+offset) = htobe32(new_block); offset+=4;
-            *(long int*)(block+offset) = htobe32(BLOCK_HEADER_SIZE); offset+=4;
-            memset(block+offset, 0, 8); offset+=8;            
-            
-            if (block == first_block_buffer) {
-                block = block_buffer;
-            } else {
-                write_block_simple(block, current_block);
+        if (j < bc) {
+            fprintf(stderr, "Journal lacks some blocks of a file, it is truncated\n");
+            for (k=j+1; k<bc; ++k) {
+                if (ent->blocks[k].num != -1) release_block(ent->blocks[k].num);
             }
-            
-            current_block = new_block;
-            fread(block, 1, 8, rnd);
-            memcpy(block+8, SIGNATURE, 8);
-            offset = BLOCK_HEADER_SIZE; 
-        }
-        if (dirent_fully_saved) {
-            position_in_block_list = 0;
-        } else {
-            --i;
+            ent->length = (long long int)j*block_size;
+            mark_ent_dirty(ent);
         }
     }
-    /*
-    fprintf(stderr, "Dir blocks:");
-    for(i=0; i<saved_directory_blocks_size; ++i) {
-        fprintf(stderr, " %d", saved_directory_blocks[i]);
+    journal_replaying = 0;
+    
+    qsort(used, n, sizeof(int), &compare_ints);
+    qsort(replay_released, replay_released_count, sizeof(int), &compare_ints);
+    for (i=0; i<replay_released_count; ++i) {
+        int num = replay_released[i];
+        if (i && num == replay_released[i-1]) continue;
+        if (n && bsearch(&num, used, n, sizeof(int), &compare_ints)) continue;
+        release_block(num);
     }
-    fprintf(stderr, "\n");
-    */
+    replay_released_count = 0;
+    free(used);
+}
+
+/*
+   Applies the complete commits of the journal listed in the root to the just loaded directory
+   and continues the journal if it is empty. Releases are collected till the end, as a block 
+   released by one commit may be given to a file by a later one.
+   With only_mark_blocks, just marks the journal blocks and the blocks it gave to files.
+*/
+static void journal_replay(const unsigned char* root, int only_mark_blocks) {
+    int i;
+    int first = (int)be32toh(*(uint32_t*)(root+BLOCK_HEADER_SIZE+8));
+    uint64_t epoch = be64toh(*(uint64_t*)(root+BLOCK_HEADER_SIZE+12));
+    if (!epoch || first < 0 || first >= block_count) return;
     
-    write_block_simple(block, current_block);
-    write_block_simple(first_block_buffer, starting_block);
+    unsigned char** blocks;
+    int* nums;
+    int count = journal_read_chain(root, &blocks, &nums);
     
-    if (!no_sync) {
-        fdatasync(data);
-    }
+    /* the first block is reserved by the checkpoint even while nothing is written to it */
+    int first_free = mark_used_block_if_free(first);
+    for (i=1; i<count; ++i) mark_used_block_if_free(nums[i]);
     
-    for (i=0; i<saved_directory_blocks_size; ++i) {
-        if (saved_directory_blocks[i]!=starting_block) {
-            mark_unused_block(saved_directory_blocks[i]);
+    /* other branches may be loading concurrently, only the mounted one touches the global state */
+    if (!only_mark_blocks) journal_replaying = 1;
+    for (i=0; i<count; ++i) {
+        const unsigned char* b = blocks[i];
+        int used = be32toh(*(uint32_t*)(b+BLOCK_HEADER_SIZE+20));
+        int offset = JOURNAL_HEADER_SIZE;
+        while (offset + JOURNAL_RECORD_HEADER_SIZE <= used) {
+            int len = be32toh(*(uint32_t*)(b+offset+1));
+            if (len < 0 || len > used - offset - JOURNAL_RECORD_HEADER_SIZE) break;
+            journal_replay_record(b[offset], b+offset+JOURNAL_RECORD_HEADER_SIZE, len, only_mark_blocks);
+            offset += JOURNAL_RECORD_HEADER_SIZE + len;
         }
     }
-    saved_directory_blocks_size = number_of_allocated_blocks;
-    free(saved_directory_blocks);
-    saved_directory_blocks = (int*)malloc(saved_directory_blocks_size*sizeof(int));
-    memcpy(saved_directory_blocks, allocated_blocks_journal, sizeof(int)*number_of_allocated_blocks);
     
-    /*
-    fprintf(stderr, "Dir blocks:");
-    for(i=0; i<saved_directory_blocks_size; ++i) {
-        fprintf(stderr, " %d", saved_directory_blocks[i]);
+    if (!only_mark_blocks) {
+        journal_release_replayed(nums, count);
+        if (count) {
+            /* the replayed changes go to the next checkpoint, which also frees the journal */
+            for (i=0; i<count; ++i) add_stale_directory_block(nums[i]);
+            __sync_fetch_and_add(&dirty_status, 1);
+        } else if (first_free) {
+            journal_next_block = first;
+            journal_epoch = epoch;
+            journal_seq = 0;
+            journal_blocks_count = 0;
+        }
     }
-    fprintf(stderr, "\n");
-    */
     
-    free(first_block_buffer);
-    free(block_buffer);
-    free(allocated_blocks_journal);
-    return first_block;
+    for (i=0; i<count; ++i) free(blocks[i]);
+    free(blocks);
+    free(nums);
 }
 
-/* return number of loaded entries on success, 0 on failure */
-int load_entries(int starting_block, int only_mark_blocks) {
-    if (!busy_map[starting_block]) {
-        mark_used_block(starting_block);
-    }
-    int current_block = starting_block;
-    
-    unsigned char* block = (unsigned char*) malloc(block_size);
-    
-    read_block_simple(block, starting_block);
-    int offset;
-    if (memcmp(block+8, SIGNATURE, 8)) {
-        return 0;
+/* 
+   return number of loaded entries on success, 0 on failure.
+   V1 directories have the same root and table, only their records are not compacted.
+*/
+static int load_entries_v2(const unsigned char* root, int only_mark_blocks) {
+    int i, slots;
+    int v1 = !memcmp(root+8, SIGNATURE_V1, 8);
+    int* nums = dir_read_table(root, &slots, 1, !only_mark_blocks);
+    if (!nums) return 0;
+
+    int counter = 0;
+    struct dir_batch bb;
+    dir_batch_init(&bb, slots);
+    if (!only_mark_blocks) {
+        dir_slots_size = nearest_power_of_two(slots+1);
+        dir_slots = (struct dir_block**)realloc(dir_slots, dir_slots_size*sizeof(*dir_slots));
     }
-    offset=BLOCK_HEADER_SIZE;
-    
-    int j;
-    int counter;
-    
-    char* previous_entry_name = strdup("///"); /* non-existing name */
-    
-    struct mydirent *ent = NULL;
-            
-    for(;;) {            
-        int pathlen = be32toh(*(long int*)(block+offset)); offset+=4;
-        if(pathlen < 0 || pathlen >= block_size-32) { free(block); return 0; }
-        if (!only_mark_blocks) {
-            char* path = strndup((char*)(block+offset), pathlen);
-            if (!strcmp(previous_entry_name, path)) {
-                /* continued blocks for old entry, not a new one */
-            } else {
-                free(previous_entry_name);
-                previous_entry_name = path;
-                ent = create_dirent(path);
-                if (!ent) {
-                    fprintf(stderr, "Entry name too long and ignored\n");
-                }
-            }
-        }
-        offset+=pathlen;
-        long long int filelen = be64toh(*(long long int*)(block+offset)); offset+=8;
-        if (ent) {
-            ent->length = filelen;
+    for (i=0; i<slots; ++i) {
+        struct dir_block* b = NULL;
+        if (!only_mark_blocks) dir_slots[dir_slots_count++] = NULL;
+        if (nums[i] == -1) continue;
+        if (nums[i] < 0 || nums[i] >= block_count) break;
+        unsigned char* block = dir_batch_get(&bb, nums, i, slots);
+        if (!block) {
+            fprintf(stderr, "Failed to read directory blocks\n");
+            break;
         }
-        
-        int bc = get_block_count_for_length(filelen);
-        int blocks_here = be32toh(*(long int*)(block+offset)); offset+=4;
-        int position_in_block_list = be32toh(*(long int*)(block+offset)); offset+=4;
-        if (ent && !ent->blocks && bc) {
-            ent->blocks_array_size = nearest_power_of_two(bc);
-            ent->blocks = (struct myblock*)malloc(ent->blocks_array_size * sizeof(*ent->blocks));
-            memset(ent->blocks, 0, ent->blocks_array_size);
+        if (memcmp(block+8, root+8, 8)) {
+            fprintf(stderr, "Signature failed in loading block\n");
+            break;
         }
-        for (j=0; j<blocks_here; ++j) {
-            int idx = be32toh(*(long int*)(block+offset)); offset+=4;
-            unsigned long iv = be32toh(*(long int*)(block+offset)); offset+=4;
-            if(idx>=0 && idx<block_count) {
-                mark_used_block(idx);
-                if (ent) {
-                    ent->blocks[j+position_in_block_list].num = idx;
-                    ent->blocks[j+position_in_block_list].iv = iv;
-                }
-            } else {
-                free(block);
-                return 0;
-            }
+        mark_used_block(nums[i]);
+        if (!only_mark_blocks) {
+            b = (struct dir_block*)calloc(1, sizeof(*b));
+            b->num = nums[i];
+            dir_slots[i] = b;
         }
-        
-        ++counter;
-        
-        int next_block = be32toh(*(long int*)(block+offset)); offset+=4;
-        int next_offset = be32toh(*(long int*)(block+offset)); offset+=4;
-        
-        if (next_block == 0 && next_offset == 0) break;
-        
-        if (next_block < 0 || next_block >= block_count) { free(block); return 0; }
-        if (next_offset < BLOCK_HEADER_SIZE || next_offset >= block_size-32) { free(block); return 0; }
-            
-        if (next_block != current_block) {
-            current_block = next_block;
-            read_block_simple(block, current_block);
-            if (memcmp(block+8, SIGNATURE, 8)) {
-                fprintf(stderr, "Signature failed in loading block\n");
-                return counter;
-            }
-            mark_used_block(current_block);
-        }        
-        
-        offset = next_offset;
+        int r = v1 ? dir_load_block_v1(block, b) : dir_load_block(block, b);
+        if (r == -1) break;
+        counter += r;
+    }
+    dir_batch_free(&bb);
+    free(nums);
+    if (i < slots) return 0;
+    journal_replay(root, only_mark_blocks);
+    if (v1 && !only_mark_blocks) {
+        /* converted by rewriting everything on the next save, which has to be a checkpoint */
+        dir_reset_layout();
+        journal_stop();
     }
-    
-    free(block);
-    free(previous_entry_name);
     return counter;
 }
 
-/* return 1 on success, 0 on failure */
-void traverse_entries_and_debug_print(int starting_block) {
-    int current_block = starting_block;
-    
+/* return number of loaded entries on success, 0 on failure */
+int load_entries(int starting_block, int only_mark_blocks) {
+    mark_used_block_if_free(starting_block);
+
     unsigned char* block = (unsigned char*) malloc(block_size);
-    unsigned char* block2 = (unsigned char*) malloc(block_size);
-    
     read_block_simple(block, starting_block);
-    int offset;
-    {
-        if (memcmp(block+8, SIGNATURE, 8)) {
-            char buf[10];
-            snprintf(buf, 9, "%s", block+8);
-            printf("Block signature is %s instead of %s\n", buf, SIGNATURE);
-        }
+    int ret = 0;
+    if (!memcmp(block+8, SIGNATURE, 8) || !memcmp(block+8, SIGNATURE_V1, 8)) {
+        ret = load_entries_v2(block, only_mark_blocks);
+    } else if (!memcmp(block+8, SIGNATURE_V0, 8)) {
+        ret = load_entries_v0(block, starting_block, only_mark_blocks);
     }
-    offset=BLOCK_HEADER_SIZE;
-    
+    free(block);
+    return ret;
+}
+
+static void debug_print_block(int idx, uint32_t iv, unsigned char* block2) {
+    fprintf(stdout, "  block %d iv %08X\n", idx, iv);
+    if (idx>=0 && idx<block_count) {
+        struct myblock b;
+        b.num = idx;
+        b.iv = iv;
+        read_block(block2, &b);
+        fprintf(stdout, "    %02X%02X%02X%02X\n", block2[0], block2[1], block2[2], block2[3]);
+    }
+    fflush(stdout);
+}
+
+static void debug_print_records(const unsigned char* block, int offset, int v0, unsigned char* block2) {
     int j;
-    
     for(;;) {
-        int pathlen = be32toh(*(long int*)(block+offset)); offset+=4;
+        if (offset+4 > block_size) return;
+        int pathlen = be32toh(*(uint32_t*)(block+offset)); offset+=4;
+        if (!v0 && pathlen == 0) return;
         if(pathlen < 0 || pathlen >= block_size-32) {
             fprintf(stderr, "pathlen = %d is too big\n", pathlen);
-            free(block2); free(block);
             return;
         }
         {
@@ -829,54 +4470,166 @@ void traverse_entries_and_debug_print(int starting_block) {
             fprintf(stdout, "entry %s\n", buf); fflush(stdout);
         }
         offset+=pathlen;
-        long long int filelen = be64toh(*(long long int*)(block+offset)); offset+=8;
+        long long int filelen = be64toh(*(uint64_t*)(block+offset)); offset+=8;
         fprintf(stdout, "  size %lld (", filelen); fflush(stdout);
         int bc = get_block_count_for_length(filelen);
         fprintf(stdout, "block_count %d)\n", bc); fflush(stdout);
-        int blocks_here = be32toh(*(long int*)(block+offset)); offset+=4;
+        int blocks_here = be32toh(*(uint32_t*)(block+offset)); offset+=4;
         fprintf(stdout, "  block here %d\n", blocks_here); fflush(stdout);
-        int blocks_offset = be32toh(*(long int*)(block+offset)); offset+=4;
+        int blocks_offset = be32toh(*(uint32_t*)(block+offset)); offset+=4;
         fprintf(stdout, "  blocks offset %d\n", blocks_offset); fflush(stdout);
+        if (blocks_here < 0 || blocks_here > (block_size-offset)/8) return;
         for (j=0; j<blocks_here; ++j) {
-            int idx = be32toh(*(long int*)(block+offset)); offset+=4;
-            int iv = be32toh(*(long int*)(block+offset)); offset+=4;
-            fprintf(stdout, "  block %d iv %08X\n", idx, iv); fflush(stdout);
-            if(idx>=0 && idx<block_count) {
-                struct myblock b;
-                b.num = idx;
-                b.iv = iv;
-                read_block(block2, &b);
-                fprintf(stdout, "    %02X%02X%02X%02X\n", 
-                    block2[0], block2[1], block2[2], block2[3]); 
-                fflush(stdout);
+            int idx = be32toh(*(uint32_t*)(block+offset)); offset+=4;
+            uint32_t iv = be32toh(*(uint32_t*)(block+offset)); offset+=4;
+            debug_print_block(idx, iv, block2);
+        }
+        if (v0) return;
+    }
+}
+
+static void debug_print_records_v2(const unsigned char* block, unsigned char* block2) {
+    int j, k, offset = BLOCK_HEADER_SIZE;
+    uint64_t suffix, prefix, filelen, position, blocks_here, v;
+    char path[256];
+    int l = 0;
+    while (offset < block_size) {
+        if ((offset = get_varint(block, offset, block_size, &suffix)) == -1 || suffix == 0) return;
+        if ((offset = get_varint(block, offset, block_size, &prefix)) == -1) return;
+        if (prefix > (uint64_t)l || prefix + suffix >= sizeof(path) || suffix > (uint64_t)(block_size - offset)) {
+            fprintf(stderr, "path prefix %d suffix %d is too big\n", (int)prefix, (int)suffix);
+            return;
+        }
+        memcpy(path+prefix, block+offset, suffix);
+        offset += suffix;
+        l = prefix + suffix;
+        path[l] = 0;
+        fprintf(stdout, "entry %s (%d bytes shared)\n", path, (int)prefix);
+        if ((offset = get_varint(block, offset, block_size, &filelen)) == -1) return;
+        if ((offset = get_varint(block, offset, block_size, &position)) == -1) return;
+        if ((offset = get_varint(block, offset, block_size, &blocks_here)) == -1) return;
+        fprintf(stdout, "  size %lld (block_count %d)\n", (long long int)filelen, get_block_count_for_length(filelen));
+        fprintf(stdout, "  block here %d\n  blocks offset %d\n", (int)blocks_here, (int)position);
+        if (blocks_here > (uint64_t)(block_size - offset) / 4) return;
+        int* nums = (int*) malloc((blocks_here+1)*sizeof(int));
+        long long int expected = 0;
+        for (j=0; j<(int)blocks_here; ) {
+            if ((offset = get_varint(block, offset, block_size, &v)) == -1) break;
+            long long int first = expected + unzigzag(v);
+            if ((offset = get_varint(block, offset, block_size, &v)) == -1) break;
+            fprintf(stdout, "  extent %lld length %d\n", first, (int)v+1);
+            for (k=0; k<=(int)v && j<(int)blocks_here; ++k) nums[j++] = first+k;
+            expected = first + v + 1;
+        }
+        if (offset == -1 || offset + 4*(int)blocks_here > block_size) {
+            free(nums);
+            return;
+        }
+        for (j=0; j<(int)blocks_here; ++j) {
+            debug_print_block(nums[j], be32toh(*(uint32_t*)(block+offset)), block2);
+            offset += 4;
+        }
+        free(nums);
+    }
+}
+
+void traverse_entries_and_debug_print(int starting_block) {
+    int current_block = starting_block;
+
+    unsigned char* block = (unsigned char*) malloc(block_size);
+    unsigned char* block2 = (unsigned char*) malloc(block_size);
+
+    read_block_simple(block, starting_block);
+    int offset;
+    if (!memcmp(block+8, SIGNATURE, 8) || !memcmp(block+8, SIGNATURE_V1, 8)) {
+        int i, slots;
+        int v1 = !memcmp(block+8, SIGNATURE_V1, 8);
+        fprintf(stdout, "%sslots %d depth %d\n", v1 ? "old format, " : "",
+            (int)be32toh(*(uint32_t*)(block+BLOCK_HEADER_SIZE)),
+            (int)be32toh(*(uint32_t*)(block+BLOCK_HEADER_SIZE+4)));
+        int* nums = dir_read_table(block, &slots, 0, 0);
+        if (!nums) {
+            printf("Broken table of directory blocks\n");
+            free(block); free(block2);
+            return;
+        }
+        unsigned char* block_root = (unsigned char*) malloc(block_size);
+        memcpy(block_root, block, block_size);
+        for (i=0; i<slots; ++i) {
+            fprintf(stdout, "directory block %d\n", nums[i]); fflush(stdout);
+            if (nums[i] < 0 || nums[i] >= block_count) continue;
+            read_block_simple(block, nums[i]);
+            if (v1) {
+                debug_print_records(block, BLOCK_HEADER_SIZE, 0, block2);
+            } else {
+                debug_print_records_v2(block, block2);
             }
         }
-        int next_block = be32toh(*(long int*)(block+offset)); offset+=4;
+        free(nums);
+        
+        unsigned char** journal;
+        int count = journal_read_chain(block_root, &journal, &nums);
+        for (i=0; i<count; ++i) {
+            fprintf(stdout, "journal block %d\n", nums[i]);
+            int used = be32toh(*(uint32_t*)(journal[i]+BLOCK_HEADER_SIZE+20));
+            int offset = JOURNAL_HEADER_SIZE;
+            while (offset + JOURNAL_RECORD_HEADER_SIZE <= used) {
+                int len = be32toh(*(uint32_t*)(journal[i]+offset+1));
+                fprintf(stdout, "  record %c length %d\n", journal[i][offset], len);
+                if (len < 0) break;
+                offset += JOURNAL_RECORD_HEADER_SIZE + len;
+            }
+            free(journal[i]);
+        }
+        fflush(stdout);
+        free(journal);
+        free(nums);
+        free(block_root);
+        free(block); free(block2);
+        return;
+    }
+    if (memcmp(block+8, SIGNATURE_V0, 8)) {
+        char buf[10];
+        snprintf(buf, 9, "%s", block+8);
+        printf("Block signature is %s instead of %s\n", buf, SIGNATURE);
+    }
+    offset=BLOCK_HEADER_SIZE;
+
+    for(;;) {
+        debug_print_records(block, offset, 1, block2);
+        /* skip the record to get to its next entry pointer */
+        int pathlen = be32toh(*(uint32_t*)(block+offset));
+        if(pathlen < 0 || pathlen >= block_size-32) break;
+        offset += 4+pathlen+8;
+        int blocks_here = be32toh(*(uint32_t*)(block+offset));
+        if (blocks_here < 0 || blocks_here > (block_size-offset)/8) break;
+        offset += 8 + 8*blocks_here;
+
+        int next_block = be32toh(*(uint32_t*)(block+offset)); offset+=4;
         fprintf(stdout, "  next_block %d\n", next_block); fflush(stdout);
-        int next_offset = be32toh(*(long int*)(block+offset)); offset+=4;
+        int next_offset = be32toh(*(uint32_t*)(block+offset)); offset+=4;
         fprintf(stdout, "  next_offset %d\n", next_offset); fflush(stdout);
-        
+
         if (next_block == 0 && next_offset == 0) break;
-        
-        if (next_block < 0 || next_block >= block_count) { free(block); free(block2); return; }
-        if (next_offset < 8  || next_offset >= block_size-32) { free(block); free(block2); return; }
-            
+
+        if (next_block < 0 || next_block >= block_count) break;
+        if (next_offset < 8  || next_offset >= block_size-32) break;
+
         if (next_block != current_block) {
             current_block = next_block;
             read_block_simple(block, current_block);
-            if (memcmp(block+8, SIGNATURE, 8)) {
+            if (memcmp(block+8, SIGNATURE_V0, 8)) {
                 char buf[10];
                 snprintf(buf, 9, "%s", block+8);
-                printf("Block signature is %s instead of %s\n", buf, SIGNATURE);
+                printf("Block signature is %s instead of %s\n", buf, SIGNATURE_V0);
             }
-        }        
-        
+        }
+
         offset = next_offset;
     }
-    
+
     free(block);
     free(block2);
-    return;
 }
 
 void generate_test_dirents() {
@@ -906,20 +4659,183 @@ void generate_test_dirents() {
     }
     
     
-    free(block);
-    
-    dirty_status=1;
-    
-    int s = save_entries(user_first_block);
-    
-    fprintf(stderr, "%d\n", s);
+    free(block);
+    
+    dirty_status=1;
+    
+    int s = save_entries(user_first_block);
+    
+    fprintf(stderr, "%d\n", s);
+}
+
+/*
+   Writeback: metadata is saved by the flusher thread, dirty_expire_timeout seconds after
+   the first unsaved change, or as soon as asked to when the dirty data exceeds the limits.
+   Writers are only held back when it gets beyond DIRTY_THROTTLE_FACTOR times the limits.
+   Closes of written files are committed in groups: commit_window_ms after the first one 
+   or once there are commit_group_closes of them, all with one save.
+*/
+#define DIRTY_THROTTLE_FACTOR 2
+
+int commit_window_ms = 20; /* 0 - every close waits for its own commit */
+int commit_group_closes = 256;
+
+time_t writeback_dirty_since; /* when the first unsaved change was made, 0 - nothing to save */
+int writeback_closes;         /* closes waiting for the group commit */
+struct timespec writeback_closes_due;
+int writeback_requested;
+long long writeback_started;   /* saves done by the flusher, counting the running one */
+long long writeback_completed;
+int writeback_status;          /* of the completed save: 0 or the error (ENOSPC, EIO) */
+int writeback_thread_running;
+int writeback_thread_stop;
+pthread_t writeback_thread;
+pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t writeback_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t writeback_done_cond = PTHREAD_COND_INITIALIZER;
+
+static int timespec_before(const struct timespec* a, const struct timespec* b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+void* writeback_thread_func(void* arg) {
+    pthread_mutex_lock(&writeback_lock);
+    for(;;) {
+        while (!writeback_thread_stop && !writeback_requested) {
+            if (!writeback_dirty_since && !writeback_closes) {
+                pthread_cond_wait(&writeback_cond, &writeback_lock);
+                continue;
+            }
+            struct timespec deadline = {writeback_dirty_since + dirty_expire_timeout, 0};
+            if (writeback_closes && (!writeback_dirty_since || timespec_before(&writeback_closes_due, &deadline))) {
+                deadline = writeback_closes_due;
+            }
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            if (!timespec_before(&now, &deadline)) break;
+            pthread_cond_timedwait(&writeback_cond, &writeback_lock, &deadline);
+        }
+        /* the last save is the checkpoint on unmount */
+        if (writeback_thread_stop) break;
+        writeback_requested = 0;
+        writeback_closes = 0;
+        __atomic_store_n(&writeback_dirty_since, 0, __ATOMIC_RELAXED);
+        long long n = ++writeback_started;
+        pthread_mutex_unlock(&writeback_lock);
+        
+        int status = save_entries(user_first_block) == -1 ? errno : 0;
+        
+        pthread_mutex_lock(&writeback_lock);
+        writeback_completed = n;
+        writeback_status = status;
+        pthread_cond_broadcast(&writeback_done_cond);
+    }
+    pthread_mutex_unlock(&writeback_lock);
+    return NULL;
+}
+
+void start_writeback_thread() {
+    writeback_thread_stop = 0;
+    writeback_dirty_since = dirty_status ? time(NULL) : 0;
+    if (pthread_create(&writeback_thread, NULL, &writeback_thread_func, NULL)) {
+        perror("pthread_create");
+        return;
+    }
+    writeback_thread_running = 1;
+}
+
+void stop_writeback_thread() {
+    pthread_mutex_lock(&writeback_lock);
+    if (!writeback_thread_running) {
+        pthread_mutex_unlock(&writeback_lock);
+        return;
+    }
+    writeback_thread_stop = 1;
+    pthread_cond_signal(&writeback_cond);
+    pthread_mutex_unlock(&writeback_lock);
+    
+    pthread_join(writeback_thread, NULL);
+    
+    pthread_mutex_lock(&writeback_lock);
+    writeback_thread_running = 0;
+    /* nobody is left to wake the waiters */
+    pthread_cond_broadcast(&writeback_done_cond);
+    pthread_mutex_unlock(&writeback_lock);
+}
+
+/* 
+   Asks the flusher for a save which starts after this call, so it has all the changes made so far.
+   With wait, returns once it is done. Saves in this thread if there is no flusher.
+   Returns 0 or the error of the save (ENOSPC, EIO), EIO if the flusher stopped before it.
+*/
+int writeback_request(int wait) {
+    pthread_mutex_lock(&writeback_lock);
+    if (!writeback_thread_running || writeback_thread_stop) {
+        pthread_mutex_unlock(&writeback_lock);
+        return save_entries(user_first_block) == -1 ? errno : 0;
+    }
+    long long n = writeback_started + 1;
+    writeback_requested = 1;
+    pthread_cond_signal(&writeback_cond);
+    int status = 0;
+    if (wait) {
+        while (writeback_completed < n && writeback_thread_running) {
+            pthread_cond_wait(&writeback_done_cond, &writeback_lock);
+        }
+        /* a later save has the changes too, its status counts */
+        status = writeback_completed < n ? EIO : writeback_status;
+    }
+    pthread_mutex_unlock(&writeback_lock);
+    return status;
+}
+
+/* Waits for the save the flusher is doing right now, if any. Returns its status like writeback_request. */
+int writeback_wait_running() {
+    pthread_mutex_lock(&writeback_lock);
+    long long n = writeback_started;
+    int status = 0;
+    if (writeback_completed < n) {
+        while (writeback_completed < n && writeback_thread_running) {
+            pthread_cond_wait(&writeback_done_cond, &writeback_lock);
+        }
+        status = writeback_completed < n ? EIO : writeback_status;
+    }
+    pthread_mutex_unlock(&writeback_lock);
+    return status;
+}
+
+/* A written file was closed: its changes are committed with the current group of closes */
+void writeback_close() {
+    if (!commit_window_ms) {
+        writeback_request(1);
+        return;
+    }
+    pthread_mutex_lock(&writeback_lock);
+    if (!writeback_thread_running || writeback_thread_stop) {
+        pthread_mutex_unlock(&writeback_lock);
+        save_entries(user_first_block);
+        return;
+    }
+    if (!writeback_closes) {
+        clock_gettime(CLOCK_REALTIME, &writeback_closes_due);
+        writeback_closes_due.tv_nsec += commit_window_ms * 1000000L;
+        writeback_closes_due.tv_sec += writeback_closes_due.tv_nsec / 1000000000L;
+        writeback_closes_due.tv_nsec %= 1000000000L;
+    }
+    if (++writeback_closes >= commit_group_closes) writeback_requested = 1;
+    pthread_cond_signal(&writeback_cond);
+    pthread_mutex_unlock(&writeback_lock);
 }
 
-void raise_alarm() {
-    if(!alarm_triggered) {
-        alarm(dirty_alarm_timeout);
-        alarm_triggered=1;
+void mark_dirty() {
+    __sync_fetch_and_add(&dirty_status, 1);
+    if (__atomic_load_n(&writeback_dirty_since, __ATOMIC_RELAXED)) return;
+    pthread_mutex_lock(&writeback_lock);
+    if (!writeback_dirty_since) {
+        __atomic_store_n(&writeback_dirty_since, time(NULL), __ATOMIC_RELAXED);
+        pthread_cond_signal(&writeback_cond);
     }
+    pthread_mutex_unlock(&writeback_lock);
 }
 
 void debug_print_dirents(int starting_block) {
@@ -928,7 +4844,7 @@ void debug_print_dirents(int starting_block) {
     int i;
     fprintf(stdout, "busy blocks: ");
     for(i=0; i<block_count; ++i) {
-        if (busy_map[i]) {
+        if (bitmap_test(busy_map, i)) {
             fprintf(stdout, "%d ", i);
         }
     }
@@ -936,298 +4852,552 @@ void debug_print_dirents(int starting_block) {
     fprintf(stdout, "usage: %d of %d (%g%%)\n", busy_blocks_count, block_count, 100.0*busy_blocks_count/block_count);
 }
 
+double get_monotonic_time() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Measures per-block encryption cost with context reuse vs initialization for every block */
+#define BENCH_CRYPTO_ROUNDS 64
 
-static int xmp_getattr(const char *path, struct stat *stbuf)
-{
-    struct mydirent* ent = find_dirent(path);
-    if(!ent) return -ENOENT;
-        
+/* 
+   Per-block encrypt/decrypt time with the context reused and with the old init per block.
+   The two are run by turns, the best round of each is printed, so that other load doesn't skew the comparison.
+*/
+void debug_bench_crypto() {
+    if (mcrypt == MCRYPT_FAILED) {
+        fprintf(stdout, "Encryption is off\n");
+        return;
+    }
+    struct thread_state* ts = get_thread_state();
+    if (!ts) return;
     
+    /* short rounds, a burst of other load spoils only some of them */
+    int n = (512 << 10) / block_size;
+    if (n < 8) n = 8;
+    unsigned char* buf = (unsigned char*) malloc(block_size);
+    random_bytes(buf, block_size);
+    
+    int saved_state_size = mcrypt_state_size;
+    int modes = saved_state_size ? 2 : 1;
+    double best[2][2];
+    int round, reuse, i;
+    if (!saved_state_size) {
+        fprintf(stdout, "context reuse is not available for %s/%s\n", mcrypt_algo, mcrypt_mode);
+    }
+    for (round=0; round<BENCH_CRYPTO_ROUNDS; ++round) {
+        for (reuse=0; reuse<modes; ++reuse) {
+            mcrypt_state_size = reuse ? saved_state_size : 0;
+            
+            double t0 = get_monotonic_time();
+            for (i=0; i<n; ++i) crypt_buffer(ts, buf, i, 0);
+            double t1 = get_monotonic_time();
+            for (i=0; i<n; ++i) crypt_buffer(ts, buf, i, 1);
+            double t2 = get_monotonic_time();
+            
+            if (!round || t1-t0 < best[reuse][0]) best[reuse][0] = t1-t0;
+            if (!round || t2-t1 < best[reuse][1]) best[reuse][1] = t2-t1;
+        }
+    }
+    for (reuse=0; reuse<modes; ++reuse) {
+        fprintf(stdout, "%s/%s BLOCK_SIZE=%d %s: encrypt %.2f us/block, decrypt %.2f us/block\n",
+            mcrypt_algo, mcrypt_mode, block_size, reuse ? "context reused" : "init per block",
+            best[reuse][0]*1e6/n, best[reuse][1]*1e6/n);
+    }
+    mcrypt_state_size = saved_state_size;
+    free(buf);
+}
+
+void fill_stat(struct mydirent* ent, struct stat* stbuf) {
     memset(stbuf, 0, sizeof(*stbuf));
     if (is_directory(ent)) {
         stbuf->st_mode = 0750 | S_IFDIR;
     } else {
         stbuf->st_mode = 0750 | S_IFREG;
+        pthread_rwlock_rdlock(&ent->lock);
         stbuf->st_size = ent->length;
-        stbuf->st_blocks = get_block_count_for_length(ent->length);
+        pthread_rwlock_unlock(&ent->lock);
+        stbuf->st_blocks = get_block_count_for_length(stbuf->st_size);
         stbuf->st_blksize = block_size;
     }
-    stbuf->st_ino = ent - dirents;
-    return 0;
+    /* nlink=0 would make the kernel drop the inode as soon as it is unused */
+    stbuf->st_nlink = 1;
+    stbuf->st_ino = ent->ino;
+}
+
+/* Replies with the entry and takes a lookup reference for the kernel */
+void reply_entry(fuse_req_t req, struct mydirent* ent) {
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = ent->ino;
+    e.generation = 1;
+    fill_stat(ent, &e.attr);
+    e.attr_timeout = cache_timeout;
+    e.entry_timeout = cache_timeout;
+    __sync_fetch_and_add(&ent->nlookup, 1);
+    fuse_reply_entry(req, &e);
+}
+
+/* Returns NULL and replies with error if parent is not a directory */
+struct mydirent* get_parent_dirent(fuse_req_t req, fuse_ino_t parent) {
+    struct mydirent* dir = get_dirent_by_ino(parent);
+    if (!dir) {
+        fuse_reply_err(req, ENOENT);
+        return NULL;
+    }
+    if (!is_directory(dir)) {
+        fuse_reply_err(req, ENOTDIR);
+        return NULL;
+    }
+    return dir;
 }
 
-static int xmp_access(const char *path, int mask)
+struct mydirent* find_child_by_name(const struct mydirent* dir, const char* name) {
+    const char* nm = find_interned_name(name, strlen(name));
+    if (!nm) return NULL;
+    return find_child(dir, nm);
+}
+
+static void xmp_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-        return 0;
+    pthread_rwlock_rdlock(&tree_lock);
+    struct mydirent* dir = get_parent_dirent(req, parent);
+    if (!dir) { pthread_rwlock_unlock(&tree_lock); return; }
+    
+    struct mydirent* ent = find_child_by_name(dir, name);
+    if (!ent) {
+        pthread_rwlock_unlock(&tree_lock);
+        /* Nobody else modifies the storage, so the kernel may cache negative entries as well */
+        struct fuse_entry_param e;
+        memset(&e, 0, sizeof(e));
+        e.ino = 0;
+        e.entry_timeout = cache_timeout;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    reply_entry(req, ent);
+    pthread_rwlock_unlock(&tree_lock);
+}
+
+static void xmp_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    pthread_rwlock_wrlock(&tree_lock);
+    struct mydirent* ent = get_dirent_by_ino(ino);
+    if (ent) {
+        if (ent->nlookup < nlookup) {
+            fprintf(stderr, "Forgetting more lookups than done for inode %lu\n", (unsigned long)ino);
+            nlookup = ent->nlookup;
+        }
+        ent->nlookup -= nlookup;
+        maybe_free_dirent(ent);
+    }
+    pthread_rwlock_unlock(&tree_lock);
+    fuse_reply_none(req);
 }
 
-static int xmp_readlink(const char *path, char *buf, size_t size) { return -ENOSYS; }
-static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                       off_t offset, struct fuse_file_info *fi)
+static void xmp_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
+    pthread_rwlock_rdlock(&tree_lock);
+    struct mydirent* ent = get_dirent_by_ino(ino);
+    if(!ent) { pthread_rwlock_unlock(&tree_lock); fuse_reply_err(req, ENOENT); return; }
+    
     struct stat st;
-    //struct mydirent* ent = find_dirent(path);
+    fill_stat(ent, &st);
+    pthread_rwlock_unlock(&tree_lock);
+    fuse_reply_attr(req, &st, cache_timeout);
+}
+
+static void xmp_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                        int to_set, struct fuse_file_info *fi)
+{
+    pthread_rwlock_rdlock(&tree_lock);
+    struct mydirent* ent = get_dirent_by_ino(ino);
+    if(!ent) { pthread_rwlock_unlock(&tree_lock); fuse_reply_err(req, ENOENT); return; }
+    
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        if(readonly_flag) { pthread_rwlock_unlock(&tree_lock); fuse_reply_err(req, EROFS); return; }
+        if(is_directory(ent)) { pthread_rwlock_unlock(&tree_lock); fuse_reply_err(req, EISDIR); return; }
         
-    //if(!ent) return -ENOENT;
-    //if(!is_directory(ent)) return -ENOENT;
+        pthread_rwlock_wrlock(&ent->lock);
+        int ret = d_truncate(ent, attr->st_size);
+        int err = errno;
+        pthread_rwlock_unlock(&ent->lock);
+        mark_dirty();
+        if(!ret) { pthread_rwlock_unlock(&tree_lock); fuse_reply_err(req, err); return; }
+    }
+    /* Modes, owners and times are not stored */
     
-    memset(&st, 0, sizeof(st));
-    st.st_ino = 0;
-    st.st_mode = 0640 | S_IFDIR;
-    filler(buf, ".", &st, 0);
-    filler(buf, "..", &st, 0);
+    struct stat st;
+    fill_stat(ent, &st);
+    pthread_rwlock_unlock(&tree_lock);
+    fuse_reply_attr(req, &st, cache_timeout);
+}
+
+static void xmp_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+    fuse_reply_err(req, 0);
+}
+
+static void xmp_readlink(fuse_req_t req, fuse_ino_t ino) { fuse_reply_err(req, ENOSYS); }
+
+struct mydirbuf {
+    char* p;
+    size_t size;
+};
+
+void dirbuf_add(fuse_req_t req, struct mydirbuf* b, const char* name, const struct stat* st) {
+    size_t oldsize = b->size;
+    b->size += fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+    b->p = (char*) realloc(b->p, b->size);
+    fuse_add_direntry(req, b->p + oldsize, b->size - oldsize, name, st, b->size);
+}
+
+/* The whole listing is prepared at opendir, so readdir offsets stay valid while the directory changes */
+static void xmp_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    pthread_rwlock_rdlock(&tree_lock);
+    struct mydirent* dir = get_parent_dirent(req, ino);
+    if (!dir) { pthread_rwlock_unlock(&tree_lock); return; }
     
-    int i;
-    int l = strlen(path);
-    if (path[l-1]=='/') --l;
+    struct mydirbuf* b = (struct mydirbuf*) malloc(sizeof(*b));
+    b->p = NULL;
+    b->size = 0;
     
-    // suppose path is "/ololo"
-    for (i=0; i<dirent_entries_count; ++i) {
-        struct mydirent* ent = &dirents[i];
-        if(!strncmp(path, ent->full_path, l)) {
-            // /ololoWHATEVER
-            if (!strcmp(ent->full_path+l, "/")) continue; //  /ololo/ itself
-            if (ent->full_path[l] != '/') continue; // /ololo2
-                
-            char pbuf[256];
-            strncpy(pbuf, ent->full_path+l+1, 256);
-            pbuf[255]=0;
-            
-            if (strchr(ent->full_path+l+1, '/')) {
-                // /ololo/*/*
-                if (strcmp(strchr(ent->full_path+l+1, '/'), "/")) {
-                    // /ololo/something/nested
-                    continue; // in subdirectory
-                } else {
-                    // /ololo/something/
-                    // just directory mydirent
-                }
-            } 
-            
-            if (is_directory(ent)) {                
-                st.st_mode = 0750 | S_IFDIR;
-                pbuf[strlen(pbuf)-1]=0; // strip trailing '/'
-            } else {
-                st.st_mode = 0750 | S_IFREG;
-                st.st_size = ent->length;
-                st.st_blocks = get_block_count_for_length(ent->length);
-                st.st_blksize = block_size;
-            }
-            st.st_ino = i;
-            if (filler(buf, pbuf, &st, 0)) {
-                return 0;
-            }
-        }
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_ino = dir->ino;
+    st.st_mode = S_IFDIR;
+    dirbuf_add(req, b, ".", &st);
+    st.st_ino = dir->parent ? dir->parent->ino : dir->ino;
+    dirbuf_add(req, b, "..", &st);
+    
+    struct mydirent* ent;
+    for (ent = dir->first_child; ent; ent = ent->next_sibling) {
+        fill_stat(ent, &st);
+        dirbuf_add(req, b, ent->name, &st);
     }
+    pthread_rwlock_unlock(&tree_lock);
     
-    return 0;
+    fi->fh = (intptr_t)b;
+    fuse_reply_open(req, fi);
 }
-static int xmp_mkdir(const char *path, mode_t mode)
+
+static void xmp_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                        off_t off, struct fuse_file_info *fi)
 {
-    if(readonly_flag) return -EROFS;
-    struct mydirent* ent = find_dirent(path);
-    if(ent) return -EEXIST;
-    
-    int l = strlen(path);
+    struct mydirbuf* b = (struct mydirbuf*)(intptr_t)fi->fh;
     
-    if(l>PATH_MAX-2) return -ENOSYS;
-        
-    ++dirty_status; raise_alarm();
-    
-    char buf[PATH_MAX];
-    strncpy(buf, path, PATH_MAX);
-    buf[PATH_MAX-1]=0;
+    if (off < b->size) {
+        size_t s = b->size - off;
+        if (s > size) s = size;
+        fuse_reply_buf(req, b->p + off, s);
+    } else {
+        fuse_reply_buf(req, NULL, 0);
+    }
+}
+
+static void xmp_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct mydirbuf* b = (struct mydirbuf*)(intptr_t)fi->fh;
+    free(b->p);
+    free(b);
+    fuse_reply_err(req, 0);
+}
+
+static void xmp_mkdir_locked(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    if(readonly_flag) { fuse_reply_err(req, EROFS); return; }
+    struct mydirent* dir = get_parent_dirent(req, parent);
+    if (!dir) return;
     
-    // ensure the path ends in trailing slash
-    if(buf[l-1]!='/') buf[l]='/'; 
+    if(find_child_by_name(dir, name)) { fuse_reply_err(req, EEXIST); return; }
     
-    ent = create_dirent(buf);
+    struct mydirent* ent = create_child(dir, name, 1);
+    if (!ent) { fuse_reply_err(req, ENAMETOOLONG); return; }
     
-    return ent?0:-ENAMETOOLONG;
+    journal_log_path(JOURNAL_CREATE, ent);
+    mark_dirty();
+    reply_entry(req, ent);
+}
+
+static void xmp_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    pthread_rwlock_wrlock(&tree_lock);
+    xmp_mkdir_locked(req, parent, name, mode);
+    pthread_rwlock_unlock(&tree_lock);
 }
 
-static int xmp_unlink(const char *path)
+static void xmp_unlink_locked(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-    if(readonly_flag) return -EROFS;
-    struct mydirent* ent = find_dirent(path);
-    if (!ent) return -ENOENT;
-    if (is_directory(ent)) return -EISDIR;
+    if(readonly_flag) { fuse_reply_err(req, EROFS); return; }
+    struct mydirent* dir = get_parent_dirent(req, parent);
+    if (!dir) return;
+    
+    struct mydirent* ent = find_child_by_name(dir, name);
+    if (!ent) { fuse_reply_err(req, ENOENT); return; }
+    if (is_directory(ent)) { fuse_reply_err(req, EISDIR); return; }
     
+    journal_log_path(JOURNAL_UNLINK, ent);
     remove_dirent(ent);
-    ++dirty_status; raise_alarm();
+    mark_dirty();
     
-    return 0;
+    fuse_reply_err(req, 0);
+}
+
+static void xmp_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    pthread_rwlock_wrlock(&tree_lock);
+    xmp_unlink_locked(req, parent, name);
+    pthread_rwlock_unlock(&tree_lock);
 }
 
-static int xmp_rmdir(const char *path)
+static void xmp_rmdir_locked(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-    if(readonly_flag) return -EROFS;
-    struct mydirent* ent = find_dirent(path);
-    if (!ent) return -ENOENT;
-    if (!is_directory(ent)) return -ENOTDIR;
+    if(readonly_flag) { fuse_reply_err(req, EROFS); return; }
+    struct mydirent* dir = get_parent_dirent(req, parent);
+    if (!dir) return;
     
-    int l = strlen(path);
-    if (path[l-1]=='/') --l;
-    int i;
-    for (i=0; i<dirent_entries_count; ++i) {
-        struct mydirent* ent2 = &dirents[i];
-        if(!strncmp(path, ent2->full_path, l)) {
-            // /ololoWHATEVER
-            if (ent2 == ent) continue; //  /ololo/ itself
-            if (ent->full_path[l] != '/') continue; // /ololo2
-                
-            return -ENOTEMPTY;
-        }   
-    }
+    struct mydirent* ent = find_child_by_name(dir, name);
+    if (!ent) { fuse_reply_err(req, ENOENT); return; }
+    if (!is_directory(ent)) { fuse_reply_err(req, ENOTDIR); return; }
+    if (ent->first_child) { fuse_reply_err(req, ENOTEMPTY); return; }
     
+    journal_log_path(JOURNAL_UNLINK, ent);
     remove_dirent(ent);
-    ++dirty_status; raise_alarm();
+    mark_dirty();
     
-    return 0;
+    fuse_reply_err(req, 0);
 }
-static int xmp_rename(const char *from, const char *to)
+
+static void xmp_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-    if(readonly_flag) return -EROFS;
-    struct mydirent* ent = find_dirent(from);
-    struct mydirent* ent2 = find_dirent(to);
-        
-    if(!ent) return -ENOENT;
-    if(ent2) return -ENOTEMPTY;
-    
-    if(strlen(to) > get_maximum_path_length()-12) return -ENAMETOOLONG;
-    ++dirty_status; raise_alarm();
-    
-    int l = strlen(to);
+    pthread_rwlock_wrlock(&tree_lock);
+    xmp_rmdir_locked(req, parent, name);
+    pthread_rwlock_unlock(&tree_lock);
+}
+
+static void xmp_rename_locked(fuse_req_t req, fuse_ino_t parent, const char *name,
+                              fuse_ino_t newparent, const char *newname)
+{
+    if(readonly_flag) { fuse_reply_err(req, EROFS); return; }
+    struct mydirent* dir = get_parent_dirent(req, parent);
+    if (!dir) return;
+    struct mydirent* newdir = get_parent_dirent(req, newparent);
+    if (!newdir) return;
     
-    if(l>PATH_MAX-2) return -ENOSYS;
+    struct mydirent* ent = find_child_by_name(dir, name);
+    if(!ent) { fuse_reply_err(req, ENOENT); return; }
+    if(find_child_by_name(newdir, newname)) { fuse_reply_err(req, ENOTEMPTY); return; }
     
-    char buf[PATH_MAX];
-    strncpy(buf, to, PATH_MAX);
-    buf[PATH_MAX-1]=0;
+    int l = strlen(newname);
+    /* every path in the moved subtree has to fit, or the save would skip it */
+    if(get_path_length(newdir) + l + get_subtree_depth(ent) > get_maximum_path_length()-12) {
+        fuse_reply_err(req, ENAMETOOLONG);
+        return;
+    }
     
-    if(is_directory(ent)) {
-        // ensure the path ends in trailing slash
-        if(buf[l-1]!='/') buf[l]='/'; 
-    } else {
-        // ensure that file path has not trailing slash
-        if(buf[l-1]=='/') buf[l-1]=0;
+    // can't move a directory inside itself
+    struct mydirent* i;
+    for (i = newdir; i; i = i->parent) {
+        if (i == ent) { fuse_reply_err(req, EINVAL); return; }
     }
     
-    free(ent->full_path);
-    ent->full_path = strdup(buf);
+    mark_dirty();
     
+    int old_len = get_path_length(ent);
+    char* old_path = (char*) malloc(old_len);
+    get_full_path(ent, old_path);
+    move_dirent(ent, newdir, newname, l);
+    journal_log_rename(old_path, old_len, ent);
+    free(old_path);
     
-    return 0;
+    fuse_reply_err(req, 0);
 }
-static int xmp_chmod(const char *path, mode_t mode) { return 0; }
-static int xmp_chown(const char *path, uid_t uid, gid_t gid) { return 0; }
 
-static int xmp_truncate(const char *path, off_t size)
+static void xmp_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                       fuse_ino_t newparent, const char *newname)
 {
-    if(readonly_flag) return -EROFS;
-    struct mydirent* ent = find_dirent(path);
-    if (!ent) return -ENOENT;   
-        
-    int ret = d_truncate(ent, size);
-    ++dirty_status; raise_alarm();
-    if(ret) return 0;
-        
-	return -ENOSPC;
+    pthread_rwlock_wrlock(&tree_lock);
+    xmp_rename_locked(req, parent, name, newparent, newname);
+    pthread_rwlock_unlock(&tree_lock);
 }
 
-static int xmp_utimens(const char *path, const struct timespec ts[2]) { return 0; }
+struct myhandle* open_handle(struct mydirent* ent, struct fuse_file_info *fi) {
+    struct myhandle *h = (struct myhandle*)malloc(sizeof(*h));
+    
+    h->ent = ent;
+    pthread_mutex_init(&h->lock, NULL);
+    h->ra_next_offset = 0;
+    h->ra_window = 0;
+    h->ra_end = 0;
+    h->readahead_refs = 0;
+    __sync_fetch_and_add(&ent->open_count, 1);
+    lru_remove(ent);
+    fi->fh = (intptr_t)h;
+    return h;
+}
 
+static void xmp_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    pthread_rwlock_rdlock(&tree_lock);
+    struct mydirent* ent = get_dirent_by_ino(ino);
+    if (!ent) { pthread_rwlock_unlock(&tree_lock); fuse_reply_err(req, ENOENT); return; }
+    if (is_directory(ent)) { pthread_rwlock_unlock(&tree_lock); fuse_reply_err(req, EISDIR); return; }
+    if ((fi->flags&O_TRUNC) && readonly_flag) { pthread_rwlock_unlock(&tree_lock); fuse_reply_err(req, EROFS); return; }
+    
+    /* the list can't be dropped once the file is open */
+    pthread_rwlock_wrlock(&ent->lock);
+    if (!load_block_list(ent)) {
+        pthread_rwlock_unlock(&ent->lock);
+        pthread_rwlock_unlock(&tree_lock);
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    if (fi->flags&O_TRUNC) d_truncate(ent, 0);
+    open_handle(ent, fi);
+    pthread_rwlock_unlock(&ent->lock);
+    if (fi->flags&O_TRUNC) mark_dirty();
+    pthread_rwlock_unlock(&tree_lock);
+    fuse_reply_open(req, fi);
+}
 
-static int xmp_open(const char *path, struct fuse_file_info *fi)
+static void xmp_create_locked(fuse_req_t req, fuse_ino_t parent, const char *name,
+                              mode_t mode, struct fuse_file_info *fi)
 {
-	struct mydirent* ent = find_dirent(path);
+    if(readonly_flag) { fuse_reply_err(req, EROFS); return; }
+    struct mydirent* dir = get_parent_dirent(req, parent);
+    if (!dir) return;
     
-    if (ent && is_directory(ent)) return -EISDIR;
-        
     int flags = fi->flags;
+    struct mydirent* ent = find_child_by_name(dir, name);
     
-    if (flags&O_CREAT) {
-        if (ent) {
-            if (flags&O_EXCL) return -EEXIST;
-            if (flags&O_TRUNC) {
-                d_truncate(ent, 0);
-            }
-        } else {
-            ent = create_dirent(path);
-            if(!ent) return -ENAMETOOLONG;
+    if (ent) {
+        if (flags&O_EXCL) { fuse_reply_err(req, EEXIST); return; }
+        if (is_directory(ent)) { fuse_reply_err(req, EISDIR); return; }
+        if (!load_block_list(ent)) { fuse_reply_err(req, EIO); return; }
+        if (flags&O_TRUNC) {
+            pthread_rwlock_wrlock(&ent->lock);
+            d_truncate(ent, 0);
+            pthread_rwlock_unlock(&ent->lock);
         }
     } else {
-        if (!ent) return -ENOENT;
+        ent = create_child(dir, name, 0);
+        if(!ent) { fuse_reply_err(req, ENAMETOOLONG); return; }
+        journal_log_path(JOURNAL_CREATE, ent);
     }
+    mark_dirty();
     
-    struct myhandle *h = (struct myhandle*)malloc(sizeof(*h));
-    
-    h->tmpbuf = (char*)malloc(block_size);
-    h->current_block = -1;
-    h->ent = ent;
-    fi->fh = (intptr_t)h;
-    h->is_dirty = 0;
+    open_handle(ent, fi);
     
-    return 0;
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = ent->ino;
+    e.generation = 1;
+    fill_stat(ent, &e.attr);
+    e.attr_timeout = cache_timeout;
+    e.entry_timeout = cache_timeout;
+    __sync_fetch_and_add(&ent->nlookup, 1);
+    fuse_reply_create(req, &e, fi);
 }
 
-static int xmp_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+static void xmp_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                       mode_t mode, struct fuse_file_info *fi)
 {
-	return xmp_open(path, fi);
+    pthread_rwlock_wrlock(&tree_lock);
+    xmp_create_locked(req, parent, name, mode, fi);
+    pthread_rwlock_unlock(&tree_lock);
 }
 
-static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
-		    struct fuse_file_info *fi)
+static void xmp_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                     struct fuse_file_info *fi)
 {
     struct myhandle* h = (struct myhandle*)(intptr_t)fi->fh;
     struct mydirent* ent = h->ent;
     
-    if(offset > ent->length) return 0;
+    pthread_rwlock_rdlock(&ent->lock);
     
-    if (size + offset > ent->length) size=ent->length - offset;
-        
-    if (size<=0) return 0;
+    if(offset > ent->length) size = 0;
+    else if (size + offset > ent->length) size=ent->length - offset;
         
+    if (size<=0) {
+        pthread_rwlock_unlock(&ent->lock);
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    
+    readahead_update(h, offset, size);
+    
+    char* buf = (char*) malloc(size);
     int buf_offset = 0;
         
     int saved_size = size;
     
+    /* blocks of multi-block reads are got in batches, the missing ones are read together */
+    struct cache_entry* batch[CACHE_RANGE_MAX];
+    int batch_first = 0, batch_count = 0;
+    
     while (size>0) {
         int block_number = (offset / block_size);
-        
-        if(h->current_block != block_number) {
-            if (h->is_dirty) {
-                int ret = write_block((unsigned char*)h->tmpbuf, &ent->blocks[h->current_block]);
-                if (!ret) readonly_flag=1;
-                h->is_dirty = 0;
-            }
-            read_block((unsigned char*)h->tmpbuf, &ent->blocks[block_number]);
-            h->current_block = block_number;
-        }
-        
         int minioffset = offset - block_size*block_number;
         int minilen = block_size-minioffset;
         if (size < minilen) minilen = size;
-            
-        memcpy(buf+buf_offset, h->tmpbuf + minioffset, minilen);
+        
+        struct cache_entry* e;
+        if (block_number >= batch_first + batch_count) {
+            int remaining = (offset + size - 1) / block_size - block_number + 1;
+            batch_first = block_number;
+            batch_count = 0;
+            if (remaining > 1) batch_count = cache_get_range(ent, block_number, remaining, batch);
+            if (batch_count == -1) {
+                pthread_rwlock_unlock(&ent->lock);
+                free(buf);
+                fuse_reply_err(req, EIO);
+                return;
+            }
+        }
+        if (block_number < batch_first + batch_count) {
+            e = batch[block_number - batch_first];
+        } else {
+            e = cache_get(ent, block_number, 1, 0);
+        }
+        if (e) {
+            memcpy(buf+buf_offset, e->data + minioffset, minilen);
+            cache_put(e);
+        } else {
+            /* the cache is busy, bypass it */
+            struct thread_state* ts = get_thread_state();
+            if (!ts || !read_block(ts->block_buf, &ent->blocks[block_number])) {
+                pthread_rwlock_unlock(&ent->lock);
+                free(buf);
+                fuse_reply_err(req, EIO);
+                return;
+            }
+            memcpy(buf+buf_offset, ts->block_buf + minioffset, minilen);
+        }
         
         buf_offset += minilen;
         size-=minilen;
         offset+=minilen;
     }
+    pthread_rwlock_unlock(&ent->lock);
     
-	return saved_size;
+    fuse_reply_buf(req, buf, saved_size);
+    free(buf);
 }
 
-static int xmp_write(const char *path, const char *buf, size_t size,
-		     off_t offset, struct fuse_file_info *fi)
+static void xmp_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                      off_t offset, struct fuse_file_info *fi)
 {
-    if(readonly_flag) return -EROFS;
+    if(readonly_flag) { fuse_reply_err(req, EROFS); return; }
     struct myhandle* h = (struct myhandle*)(intptr_t)fi->fh;
     struct mydirent* ent = h->ent;
     
-    int ret = ensure_size(ent, offset+size);
-    if(!ret) return -ENOSPC;
+    pthread_rwlock_wrlock(&ent->lock);
+    /* the blocks to be overwritten are not zeroed, on failure the length goes back to what got written */
+    long long int old_length = ent->length;
+    int ret = ensure_size_ll(ent, offset+size, offset, offset+size);
+    if(!ret) { int err = errno; pthread_rwlock_unlock(&ent->lock); fuse_reply_err(req, err); return; }
         
     int buf_offset = 0;
     
@@ -1235,100 +5405,172 @@ static int xmp_write(const char *path, const char *buf, size_t size,
     
     while (size>0) {
         int block_number = (offset / block_size);
+        int minioffset = offset - block_size*block_number;
+        int minilen = block_size-minioffset;
+        if (size < minilen) minilen = size;
+        
+        if (block_number >= ent->blocks_array_size) {
+            d_truncate(ent, offset > old_length ? offset : old_length);
+            pthread_rwlock_unlock(&ent->lock);
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        
+        /* no need to read the block if it gets overwritten completely */
+        int full_block = (minilen == block_size);
         
-        if(h->current_block != block_number) {
-            if (block_number >= ent->blocks_array_size) {
-                return -EINVAL;
+        struct cache_entry* e = cache_get(ent, block_number, !full_block, 1);
+        if (e) {
+            memcpy(e->data + minioffset, buf+buf_offset, minilen);
+            e->dirty = 1;
+            cache_put(e);
+        } else {
+            /* the cache is busy, write through */
+            struct thread_state* ts = get_thread_state();
+            int ok = ts && (full_block || read_block(ts->block_buf, &ent->blocks[block_number]));
+            if (ok) {
+                memcpy(ts->block_buf + minioffset, buf+buf_offset, minilen);
+                ok = write_block(ts->block_buf, &ent->blocks[block_number]);
+                mark_ent_blocks_dirty(ent, block_number, block_number+1);
             }
-            if (h->is_dirty) {
-                int ret = write_block((unsigned char*)h->tmpbuf, &ent->blocks[h->current_block]);
-                if (!ret) readonly_flag=1;
-                h->is_dirty = 0;
-                if (!ret) return -EINVAL;
+            if (!ok) {
+                readonly_flag=1;
+                d_truncate(ent, offset > old_length ? offset : old_length);
+                pthread_rwlock_unlock(&ent->lock);
+                fuse_reply_err(req, EINVAL);
+                return;
             }
-            read_block((unsigned char*)h->tmpbuf, &ent->blocks[block_number]);
-            h->current_block = block_number;
         }
         
-        int minioffset = offset - block_size*block_number;
-        int minilen = block_size-minioffset;
-        if (size < minilen) minilen = size;
-            
-        memcpy(h->tmpbuf + minioffset, buf+buf_offset, minilen);
-        h->is_dirty=1;
-        
         buf_offset += minilen;
         size-=minilen;
         offset+=minilen;
     }
     
-    dirty_bytes+=saved_size;
-    ++dirty_status;
+    pthread_rwlock_unlock(&ent->lock);
     
-    if (dirty_bytes > max_dirty_bytes || dirty_status > max_dirty_calls) {
-        save_entries(user_first_block);
-    } else {
-        raise_alarm();
+    int bytes = __sync_add_and_fetch(&dirty_bytes, saved_size);
+    mark_dirty();
+    int calls = __atomic_load_n(&dirty_status, __ATOMIC_RELAXED);
+    
+    if (bytes > max_dirty_bytes || calls > max_dirty_calls) {
+        int throttle = bytes > (long long)max_dirty_bytes*DIRTY_THROTTLE_FACTOR ||
+                       calls > (long long)max_dirty_calls*DIRTY_THROTTLE_FACTOR;
+        writeback_request(throttle);
     }
-	return saved_size;
+    fuse_reply_write(req, saved_size);
 }
 
-static int xmp_statfs(const char *path, struct statvfs *stbuf)
+static void xmp_statfs(fuse_req_t req, fuse_ino_t ino)
 {
-	return -ENOENT;
+    fuse_reply_err(req, ENOENT);
 }
 
-static int xmp_flush(const char *path, struct fuse_file_info *fi)
+/* Writes back the cached data of the file, so that write errors are reported on close */
+static void xmp_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	return 0;
+    struct myhandle* h = (struct myhandle*)(intptr_t)fi->fh;
+    struct mydirent* ent = h->ent;
+    int failed_before = readonly_flag;
+    
+    pthread_rwlock_wrlock(&ent->lock);
+    cache_flush_ent(ent);
+    pthread_rwlock_unlock(&ent->lock);
+    
+    fuse_reply_err(req, (readonly_flag && !failed_before) ? EIO : 0);
 }
 
-static int xmp_release(const char *path, struct fuse_file_info *fi)
+static void xmp_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	(void) path;
     struct myhandle* h = (struct myhandle*)(intptr_t)fi->fh;
-        
-    if (h->is_dirty) {
-        int ret = write_block((unsigned char*)h->tmpbuf, &h->ent->blocks[h->current_block]);
-        if (!ret) readonly_flag=1;
-        h->is_dirty = 0;
-    }
+    struct mydirent* ent = h->ent;
     
-    free(h->tmpbuf);
+    /* other handles of the file keep their readahead */
+    readahead_cancel(h);
+    pthread_rwlock_wrlock(&ent->lock);
+    cache_flush_ent(ent);
+    pthread_rwlock_unlock(&ent->lock);
+    
+    pthread_mutex_destroy(&h->lock);
     free(h);
+    pthread_rwlock_wrlock(&tree_lock);
+    --ent->open_count;
+    if (!ent->open_count) lru_add(ent);
+    maybe_free_dirent(ent);
+    pthread_rwlock_unlock(&tree_lock);
     
-    if (dirty_bytes>0) {
-        save_entries(user_first_block);
+    /* closing a written file commits it, along with the other files closed about the same time */
+    if (__atomic_load_n(&dirty_bytes, __ATOMIC_RELAXED) > 0) {
+        writeback_close();
+    } else if (__atomic_load_n(&block_lists_bytes, __ATOMIC_RELAXED) > block_lists_max_bytes) {
+        /* every save evicts */
+        writeback_request(0);
     }
-	return 0;
+    fuse_reply_err(req, 0);
 }
 
-static int xmp_fsync(const char *path, int isdatasync,
-		     struct fuse_file_info *fi)
+/*
+   Writes back the cached data of the file and commits it if its length or blocks changed 
+   (every block written gets a new IV, which is in the block list). Without datasync, 
+   pending creations, removals and renames are committed too, as the path of the file
+   may be among them. Otherwise only the storage is synced.
+*/
+static void xmp_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                      struct fuse_file_info *fi)
 {
-	return 0;
+    struct myhandle* h = (struct myhandle*)(intptr_t)fi->fh;
+    struct mydirent* ent = h->ent;
+    
+    pthread_rwlock_wrlock(&ent->lock);
+    cache_flush_ent(ent);
+    int commit = __atomic_load_n(&ent->journal_dirty, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&ent->lock);
+    
+    if (!commit && !datasync) {
+        pthread_rwlock_rdlock(&tree_lock);
+        /* without the journal, every save is a checkpoint and clears meta_dirty */
+        commit = __atomic_load_n(&journal_ops_len, __ATOMIC_RELAXED) > 0 || 
+            (!journal_max_blocks && __atomic_load_n(&ent->meta_dirty, __ATOMIC_RELAXED));
+        pthread_rwlock_unlock(&tree_lock);
+    }
+    
+    int status;
+    if (commit) {
+        /* the commit syncs the storage after writing */
+        status = writeback_request(1);
+    } else {
+        /* the changes may have been taken by the commit running now */
+        status = writeback_wait_running();
+        if (!status && !no_sync && fdatasync(data)) status = errno;
+    }
+    fuse_reply_err(req, status ? status : (readonly_flag ? EIO : 0));
 }
 
 
 static void xmp_destroy(void* unused)
 {
-    save_entries(user_first_block);
+    stop_readahead_threads();
+    stop_cover_thread();
+    stop_writeback_thread();
+    checkpoint_entries(user_first_block);
+    stop_shred_thread();
 }
 
 
-static struct fuse_operations xmp_oper = {
+static struct fuse_lowlevel_ops xmp_oper = {
+	.lookup		= xmp_lookup,
+	.forget		= xmp_forget,
 	.getattr	= xmp_getattr,
+	.setattr	= xmp_setattr,
 	.access		= xmp_access,
 	.readlink	= xmp_readlink,
+	.opendir	= xmp_opendir,
 	.readdir	= xmp_readdir,
+	.releasedir	= xmp_releasedir,
 	.mkdir		= xmp_mkdir,
 	.unlink		= xmp_unlink,
 	.rmdir		= xmp_rmdir,
 	.rename		= xmp_rename,
-	.chmod		= xmp_chmod,
-	.chown		= xmp_chown,
-	.truncate	= xmp_truncate,
-	.utimens	= xmp_utimens,
 	.create		= xmp_create,
 	.open		= xmp_open,
 	.read		= xmp_read,
@@ -1340,37 +5582,99 @@ static struct fuse_operations xmp_oper = {
     .destroy    = xmp_destroy,
 };
 
-void sigalm() {
-    //save_entries(user_first_block);
-    alarm_triggered=0;
+char passwords_area[65536];
+
+/* A branch given at mount: its first block and the key derived from its password */
+struct branch {
+    char* password;
+    int first_block;
+    struct cipher_key key;
+    int ok;
+    pthread_t thread;
+    int started;
+};
+
+static void* derive_key_thread_func(void* arg) {
+    struct branch* br = (struct branch*) arg;
+    KEYGEN kg;
+    kg.hash_algorithm[0]=hash_algo;
+    kg.hash_algorithm[1]=hash_algo;
+    kg.count=keygen_count;
+    kg.salt = keygen_salt;
+    kg.salt_size = strlen(keygen_salt);
+    
+    int ret = mhash_keygen_ext(keygen_algo, kg, br->key.key, mcrypt_keysize, (unsigned char*)br->password, strlen(br->password));
+    if (ret!=0) perror("mhash_keygen_ext");
+    br->ok = (ret==0);
+    return NULL;
+}
+
+/* Marks the blocks of an auxiliary branch used, reading it with the branch's key */
+static void* load_branch_thread_func(void* arg) {
+    struct branch* br = (struct branch*) arg;
+    struct thread_state* ts = get_thread_state();
+    br->ok = 0;
+    if (!ts) return NULL;
+    ts->key = &br->key;
+    br->ok = (load_entries(br->first_block, 1) != 0);
+    ts->key = &main_key;
+    return NULL;
 }
 
-char passwords_area[65536];
+/* Calls func for every branch, each in a thread of its own (or in this one if it can't be started) */
+static void run_for_branches(struct branch* branches, int count, void* (*func)(void*)) {
+    int i;
+    for (i=0; i<count; ++i) {
+        branches[i].started = !pthread_create(&branches[i].thread, NULL, func, &branches[i]);
+    }
+    for (i=0; i<count; ++i) {
+        if (branches[i].started) {
+            pthread_join(branches[i].thread, NULL);
+        } else {
+            func(&branches[i]);
+        }
+    }
+}
 
 int main(int argc, char* argv[]) {
     block_size = 8192;
-    rnd_name = "/dev/urandom";
+    rnd_name = NULL;
     max_dirty_bytes = 1000000;
     max_dirty_calls = 1000;
     no_shred = 0;
     no_sync = 0;
-    dirty_alarm_timeout=5;
+    dirty_expire_timeout=5;
     reserved_percent=5;
-    int no_o_direct = 0;
+    int multithreaded_flag = 0;
+    cache_timeout = 60;
     
     
     if (argc < 3) {
         fprintf(stderr, "Usage: chaoticfs data_file mountpoint [FUSE options]\n");
         fprintf(stderr, "Environment variables:\n");
         fprintf(stderr, "   BLOCK_SIZE, default %d\n", block_size);
-        fprintf(stderr, "   RANDOM_FILE, default %s\n", rnd_name);
+        fprintf(stderr, "   RANDOM_FILE - read the random generator seed from this file instead of getrandom\n");
         fprintf(stderr, "   MAX_DIRTY_BYTES, default %d\n", max_dirty_bytes);
         fprintf(stderr, "   MAX_DIRTY_CALLS, default %d\n", max_dirty_calls);
+        fprintf(stderr, "   DIRTY_ALARM, default %d - seconds before changes are saved in the background\n", dirty_expire_timeout);
+        fprintf(stderr, "   COMMIT_WINDOW_MS, default %d - closes of written files within it share one commit, 0 - commit on every close\n", commit_window_ms);
+        fprintf(stderr, "   COMMIT_GROUP_CLOSES, default %d - commit at once when that many closes wait\n", commit_group_closes);
         fprintf(stderr, "   NO_SHRED\n");
         fprintf(stderr, "   NO_SYNC\n");
         fprintf(stderr, "   NO_O_DIRECT\n");
         fprintf(stderr, "   RESERVED_PERCENT, default %d\n", reserved_percent);
-        fprintf(stderr, "   RANDOM_SHRED_PROBABILITY %d of 1000\n", random_shred_probability);
+        fprintf(stderr, "   RANDOM_SHRED_PROBABILITY %d of 1000 - cover writes per block written\n", random_shred_probability);
+        fprintf(stderr, "   COVER_WRITES_PER_SEC, default %g - constant rate of cover writes\n", cover_writes_per_sec);
+        fprintf(stderr, "   COVER_BYTES_PER_SEC - the same in bytes\n");
+        fprintf(stderr, "   CACHE_TIMEOUT, default %g seconds\n", cache_timeout);
+        fprintf(stderr, "   BLOCK_CACHE_SIZE, default %lld - bytes of decrypted file data to keep in memory\n", block_cache_bytes);
+        fprintf(stderr, "   READAHEAD_MAX_BYTES, default %lld - how far ahead of a sequential reader to prefetch\n", readahead_max_bytes);
+        fprintf(stderr, "   READAHEAD_THREADS, default %d - threads reading and decrypting prefetched blocks, 0 to disable\n", readahead_threads_count);
+        fprintf(stderr, "   LAZY_BLOCK_LISTS - load block lists of files when they are opened, not at mount\n");
+        fprintf(stderr, "   BLOCK_LISTS_MAX_BYTES, default %lld - lazy block lists of closed files to keep in memory\n", block_lists_max_bytes);
+        fprintf(stderr, "   LOAD_THREADS, default %d - threads decrypting the directory at mount\n", load_threads_count);
+        fprintf(stderr, "   JOURNAL_MAX_BLOCKS, default %d - checkpoint the directory after this many journal blocks, 0 - no journal\n", journal_max_blocks);
+        fprintf(stderr, "   MULTITHREADED - serve requests from several threads\n");
         fprintf(stderr, "\n");
         fprintf(stderr, "   MCRYPT_ALGO, default %s\n", mcrypt_algo);
         fprintf(stderr, "   MCRYPT_MODE, default %s\n", mcrypt_mode);
@@ -1393,17 +5697,29 @@ int main(int argc, char* argv[]) {
     if (getenv("RANDOM_FILE")) rnd_name = getenv("RANDOM_FILE");
     if (getenv("MAX_DIRTY_BYTES")) max_dirty_bytes = atoi(getenv("MAX_DIRTY_BYTES"));
     if (getenv("MAX_DIRTY_CALLS")) max_dirty_calls = atoi(getenv("MAX_DIRTY_CALLS"));
-    if (getenv("DIRTY_ALARM")) dirty_alarm_timeout = atoi(getenv("DIRTY_ALARM"));
+    if (getenv("DIRTY_ALARM")) dirty_expire_timeout = atoi(getenv("DIRTY_ALARM"));
+    if (getenv("COMMIT_WINDOW_MS")) commit_window_ms = atoi(getenv("COMMIT_WINDOW_MS"));
+    if (getenv("COMMIT_GROUP_CLOSES")) commit_group_closes = atoi(getenv("COMMIT_GROUP_CLOSES"));
     if (getenv("NO_SHRED")) no_shred=1;
     if (getenv("NO_SYNC")) no_sync=1;
     if (getenv("RESERVED_PERCENT")) reserved_percent = atoi(getenv("RESERVED_PERCENT"));
     if (getenv("RANDOM_SHRED_PROBABILITY")) random_shred_probability = atoi(getenv("RANDOM_SHRED_PROBABILITY"));
+    if (getenv("COVER_WRITES_PER_SEC")) cover_writes_per_sec = atof(getenv("COVER_WRITES_PER_SEC"));
+    if (getenv("COVER_BYTES_PER_SEC")) cover_writes_per_sec = atof(getenv("COVER_BYTES_PER_SEC")) / block_size;
+    if (getenv("CACHE_TIMEOUT")) cache_timeout = atof(getenv("CACHE_TIMEOUT"));
+    if (getenv("BLOCK_CACHE_SIZE")) block_cache_bytes = atoll(getenv("BLOCK_CACHE_SIZE"));
+    if (getenv("READAHEAD_MAX_BYTES")) readahead_max_bytes = atoll(getenv("READAHEAD_MAX_BYTES"));
+    if (getenv("READAHEAD_THREADS")) readahead_threads_count = atoi(getenv("READAHEAD_THREADS"));
+    if (getenv("LAZY_BLOCK_LISTS")) lazy_block_lists = 1;
+    if (getenv("BLOCK_LISTS_MAX_BYTES")) block_lists_max_bytes = atoll(getenv("BLOCK_LISTS_MAX_BYTES"));
+    if (getenv("LOAD_THREADS")) load_threads_count = atoi(getenv("LOAD_THREADS"));
+    if (getenv("JOURNAL_MAX_BLOCKS")) journal_max_blocks = atoi(getenv("JOURNAL_MAX_BLOCKS"));
+    if (getenv("MULTITHREADED")) multithreaded_flag = 1;
     
     data_name = argv[1];
     user_first_block = 2;
     
-    rnd= fopen(rnd_name, "rb");
-    if(!rnd) { perror("fopen random"); return 2; }
+    if (!seed_random()) return 2;
     data = open(data_name, O_RDWR | (no_o_direct?0:O_DIRECT), 0777);
     if(data<0) { perror("open data"); return 3; }
     
@@ -1418,14 +5734,19 @@ int main(int argc, char* argv[]) {
         }
     }
     
-    shred_buffer = (unsigned char*) malloc(block_size);
-    busy_map = (unsigned char*) malloc(block_count);
-    mcrypt_buf = (unsigned char*) valloc(block_size);
+    pthread_key_create(&thread_state_key, &free_thread_state);
+    busy_map = bitmap_alloc();
+    if (!busy_map || bitmap_init(busy_map, block_count)) {
+        fprintf(stderr, "Can't allocate the busy map\n");
+        return 4;
+    }
     busy_blocks_count = 0;
-    memset(busy_map, 0, block_count);
-    saved_directory_blocks_size = 0;
-    saved_directory_blocks = NULL;
-    alarm_triggered = 0;
+    if (cache_init()) {
+        fprintf(stderr, "Can't allocate the block cache\n");
+        return 4;
+    }
+    stale_directory_blocks_count = stale_directory_blocks_size = 0;
+    stale_directory_blocks = NULL;
     
     {
         if (getenv("MCRYPT_ALGO")) { mcrypt_algo = getenv("MCRYPT_ALGO"); }
@@ -1468,79 +5789,95 @@ int main(int argc, char* argv[]) {
         
         passwords_area[sizeof(passwords_area)-1]=0;
         if (passwords_area[strlen(passwords_area)-1] == '\n') passwords_area[strlen(passwords_area)-1]=0;
+        struct branch* branches = NULL;
+        int branches_count = 0, i;
         char* s = strtok(passwords_area, ",");
-        char* n;
         while(s) {
-            user_first_block = atoi(s);
-            if (user_first_block<0 || user_first_block>=block_count) {
+            int num = atoi(s);
+            if (num<0 || num>=block_count) {
                fprintf(stderr, "Block number is out of range\n");
                return 39; 
             }
-            if (busy_map[user_first_block]) {
+            if (bitmap_test(busy_map, num)) {
                 fprintf(stderr, "Duplicate/used block number\n");
                 return 40;
             }
-            if (mcrypt != MCRYPT_FAILED) {
-                if (!mcrypt_key) {
-                    mcrypt_key = (char*)malloc(mcrypt_keysize);
-                    mlock(mcrypt_key, mcrypt_keysize);
-                }
-                if (!mcrypt_ivbuf) {
-                    mcrypt_ivbuf = (unsigned char*) malloc(mcrypt_ivsize);
-                }
-                
-                KEYGEN kg;
-                kg.hash_algorithm[0]=hash_algo;
-                kg.hash_algorithm[1]=hash_algo;
-                kg.count=keygen_count;
-                kg.salt = keygen_salt;
-                kg.salt_size = strlen(keygen_salt);
-                
-                int ret = mhash_keygen_ext(keygen_algo, kg, mcrypt_key, mcrypt_keysize, (unsigned char*)s, strlen(s));
-                
-                if (ret!=0) {
+            mark_used_block(num);
+            branches = (struct branch*) realloc(branches, (branches_count+1)*sizeof(*branches));
+            memset(&branches[branches_count], 0, sizeof(*branches));
+            branches[branches_count].password = s;
+            branches[branches_count].first_block = num;
+            ++branches_count;
+            s = strtok(NULL, ",");
+        }
+        branch_roots = (int*) malloc((branches_count+1)*sizeof(int));
+        for (i=0; i<branches_count; ++i) branch_roots[i] = branches[i].first_block;
+        branch_roots_count = branches_count;
+        if (branches_count) {
+            user_first_block = branches[branches_count-1].first_block;
+        } else {
+            mark_used_block(user_first_block);
+        }
+        
+        if (mcrypt != MCRYPT_FAILED && branches_count) {
+            for (i=0; i<branches_count; ++i) {
+                branches[i].key.key = (char*)malloc(mcrypt_keysize);
+                mlock(branches[i].key.key, mcrypt_keysize);
+                branches[i].key.generation = ++key_generations;
+            }
+            /* the key derivation is slow on purpose, do it for all the branches at once */
+            run_for_branches(branches, branches_count, &derive_key_thread_func);
+            for (i=0; i<branches_count; ++i) {
+                if (!branches[i].ok) {
                     fprintf(stderr, "Failed to generate key for password\n");
-                    perror("mhash_keygen_ext");
                     return 42;
                 }
-                
-                /*
-                ret = mcrypt_generic_init(mcrypt, mcrypt_key, mcrypt_keysize/8, NULL);
-                
-                if (ret) {
-                    mcrypt_perror(ret);
-                    return 44;
-                }*/
-                
             }
-            n = strtok(NULL, ",");
-            if (n) {
-                mark_used_block(user_first_block);
-                int r = load_entries(user_first_block, 1);
-                if (!r) {
-                    fprintf(stderr, "No entries loaded for auxilary branch, maybe need better password\n");
-                    return 43;
-                }
-                //mcrypt_generic_deinit(mcrypt);
+            main_key = branches[branches_count-1].key;
+            
+            struct thread_state* ts = get_thread_state();
+            if (!ts) return 11;
+            if (!probe_cipher_state(ts)) {
+                fprintf(stderr, "Cipher context can't be reused for %s/%s, it will be initialized for every block\n", mcrypt_algo, mcrypt_mode);
+            }
+        }
+        
+        /* the auxiliary branches only have their blocks marked, independently of each other */
+        run_for_branches(branches, branches_count-1, &load_branch_thread_func);
+        for (i=0; i<branches_count-1; ++i) {
+            if (!branches[i].ok) {
+                fprintf(stderr, "No entries loaded for auxilary branch, maybe need better password\n");
+                return 43;
             }
-            s=n;
-        }    
+        }
+        if (branch_root_collision) {
+            fprintf(stderr, "Duplicate/used block number\n");
+            return 40;
+        }
+        for (i=0; i<branches_count-1; ++i) {
+            if (!branches[i].key.key) continue;
+            memset(branches[i].key.key, 0, mcrypt_keysize);
+            munlock(branches[i].key.key, mcrypt_keysize);
+            free(branches[i].key.key);
+        }
+        free(branches);
     }
-    mlock(busy_map, block_count);
-    mark_used_block(user_first_block);
+    bitmap_mlock(busy_map);
     
     current_dirent_array_size = 128;
-    dirents = (struct mydirent*) malloc(current_dirent_array_size * sizeof(*dirents));
+    dirents = (struct mydirent**) malloc(current_dirent_array_size * sizeof(*dirents));
     dirent_entries_count=0;
+    dirent_index = NULL;
+    dirent_index_size = 0;
+    index_grow();
+    inode_table = NULL;
+    inode_table_size = 0;
+    inode_count = 0;
+    next_ino = FUSE_ROOT_ID+1;
     
     readonly_flag = 0;
     dirty_status = 0;
     
-    {
-        struct sigaction sa = {{&sigalm}};
-        sigaction(SIGALRM, &sa, NULL);
-    }
-    
     int ret;
     
     if (!strcmp(argv[2], "--debug-generate")) {
@@ -1548,6 +5885,9 @@ int main(int argc, char* argv[]) {
     }
     else if (!strcmp(argv[2], "--debug-print")) {
         debug_print_dirents(user_first_block);        
+    }
+    else if (!strcmp(argv[2], "--debug-bench-crypto")) {
+        debug_bench_crypto();
     } else {
         int r = load_entries(user_first_block, 0);
         
@@ -1561,23 +5901,64 @@ int main(int argc, char* argv[]) {
         
         #define MY 2
         char** new_argv = (char**)malloc( (argc-1+MY+1) * sizeof(char*));
-        new_argv[0]="chaoticfs";
+        int new_argc = 0;
+        new_argv[new_argc++]="chaoticfs";
         // "My" args
-        new_argv[1]="-s"; // single threaded
-        new_argv[2]="-osubtype=chaoticfs";
+        if (!multithreaded_flag) new_argv[new_argc++]="-s"; // single threaded
+        new_argv[new_argc++]="-osubtype=chaoticfs";
         int i;
         for(i=2; i<argc; ++i) {
-            new_argv[i-1+MY] = argv[i];
+            new_argv[new_argc++] = argv[i];
+        }
+        new_argv[new_argc]=NULL;
+        
+        struct fuse_args args = FUSE_ARGS_INIT(new_argc, new_argv);
+        char* mountpoint = NULL;
+        int multithreaded, foreground;
+        ret = 1;
+        if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1 && mountpoint) {
+            struct fuse_chan* ch = fuse_mount(mountpoint, &args);
+            if (ch) {
+                struct fuse_session* se = fuse_lowlevel_new(&args, &xmp_oper, sizeof(xmp_oper), NULL);
+                if (se) {
+                    if (fuse_set_signal_handlers(se) != -1) {
+                        fuse_session_add_chan(se, ch);
+                        /* the directory was loaded through this thread's ring */
+                        free_thread_ring();
+                        fuse_daemonize(foreground);
+                        if (cache_mlock()) {
+                            perror("mlock of the block cache (see BLOCK_CACHE_SIZE and ulimit -l)");
+                        }
+                        /* after daemonizing, threads don't survive fork */
+                        start_shred_thread();
+                        start_cover_thread();
+                        start_readahead_threads();
+                        start_writeback_thread();
+                        if (multithreaded) {
+                            ret = fuse_session_loop_mt(se);
+                        } else {
+                            ret = fuse_session_loop(se);
+                        }
+                        ret = ret ? 1 : 0;
+                        fuse_remove_signal_handlers(se);
+                        fuse_session_remove_chan(ch);
+                    }
+                    fuse_session_destroy(se);
+                }
+                fuse_unmount(mountpoint, ch);
+            }
         }
-        new_argv[i-1+MY]=NULL;
-        ret = fuse_main(i-1+MY, new_argv, &xmp_oper, NULL);
+        free(mountpoint);
+        fuse_opt_free_args(&args);
         free(new_argv);
     }
     
     
     free(dirents);
-    free(busy_map);
+    free(dirent_index);
+    free(inode_table);
+    bitmap_free(busy_map);
+    cache_destroy();
     close(data);
-    fclose(rnd);
     return ret;
 }
\ No newline at end of file
@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "bitmap.h"
+
+#define BITMAP_MAX_LEVELS 11 /* 64^11 > 2^63 */
+
+struct bitmap {
+    long long n;
+    long long count_set;
+    int levels;
+    long long words[BITMAP_MAX_LEVELS];
+    uint64_t* level[BITMAP_MAX_LEVELS]; /* level[0] - the bits themselves */
+    uint32_t* free_tree; /* Fenwick tree of clear bit counts per level 0 word, 1-based */
+    long long free_tree_top; /* the highest power of two <= words[0] */
+};
+
+static inline int ctz64(uint64_t w) {
+    return __builtin_ctzll(w);
+}
+
+/* Add delta to the clear bit count of level 0 word j */
+static inline void free_tree_add(struct bitmap* bm, long long j, int delta) {
+    for (++j; j<=bm->words[0]; j += j & -j) {
+        bm->free_tree[j] += delta;
+    }
+}
+
+/* Whether a word of the given level still has a clear bit below it */
+static inline int word_has_clear(int level, uint64_t w) {
+    return level ? w != 0 : ~w != 0;
+}
+
+struct bitmap* bitmap_alloc() {
+    struct bitmap* bm = (struct bitmap*) malloc(sizeof(struct bitmap));
+    if (!bm) return NULL;
+    memset(bm, 0, sizeof(*bm));
+    return bm;
+}
+
+void bitmap_free(struct bitmap* bm) {
+    int k;
+    if (!bm) return;
+    for (k=0; k<bm->levels; ++k) {
+        free(bm->level[k]);
+    }
+    free(bm->free_tree);
+    free(bm);
+}
+
+/* Sets the padding bits after n and recomputes the summary levels and the free tree from level 0 */
+static void bitmap_rebuild(struct bitmap* bm) {
+    int k;
+    long long j;
+    if (bm->n & 63) {
+        bm->level[0][bm->words[0]-1] |= ~0ULL << (bm->n & 63);
+    }
+    memset(bm->free_tree, 0, (bm->words[0]+1)*sizeof(uint32_t));
+    for (j=1; j<=bm->words[0]; ++j) {
+        long long parent = j + (j & -j);
+        bm->free_tree[j] += 64 - __builtin_popcountll(bm->level[0][j-1]);
+        if (parent <= bm->words[0]) bm->free_tree[parent] += bm->free_tree[j];
+    }
+    for (bm->free_tree_top=1; bm->free_tree_top*2 <= bm->words[0]; bm->free_tree_top*=2);
+    for (k=1; k<bm->levels; ++k) {
+        memset(bm->level[k], 0, bm->words[k]*sizeof(uint64_t));
+        for (j=0; j<bm->words[k-1]; ++j) {
+            if (word_has_clear(k-1, bm->level[k-1][j])) {
+                bm->level[k][j>>6] |= 1ULL << (j&63);
+            }
+        }
+    }
+}
+
+/* Allocates levels for n bits, level 0 is copied from the old one (if any) */
+static int bitmap_setup(struct bitmap* bm, long long n) {
+    struct bitmap nb;
+    int k;
+    long long w;
+
+    if (n < 1) n = 1;
+    memset(&nb, 0, sizeof(nb));
+    nb.n = n;
+    w = (n + 63) / 64;
+    for (k=0; ; ++k) {
+        if (k == BITMAP_MAX_LEVELS) return -1;
+        nb.words[k] = w;
+        nb.level[k] = (uint64_t*) calloc(w, sizeof(uint64_t));
+        if (!nb.level[k]) {
+            nb.levels = k;
+            for (k=0; k<nb.levels; ++k) free(nb.level[k]);
+            return -1;
+        }
+        if (w == 1) break;
+        w = (w + 63) / 64;
+    }
+    nb.levels = k+1;
+    nb.free_tree = (uint32_t*) calloc(nb.words[0]+1, sizeof(uint32_t));
+    if (!nb.free_tree) {
+        for (k=0; k<nb.levels; ++k) free(nb.level[k]);
+        return -1;
+    }
+
+    if (bm->levels) {
+        long long keep = bm->n < n ? bm->n : n;
+        long long i;
+        memcpy(nb.level[0], bm->level[0], (keep/64)*sizeof(uint64_t));
+        for (i = keep & ~63LL; i<keep; ++i) {
+            if (bm->level[0][i>>6] & (1ULL << (i&63))) {
+                nb.level[0][i>>6] |= 1ULL << (i&63);
+            }
+        }
+        nb.count_set = 0;
+        for (i=0; i<keep/64; ++i) {
+            nb.count_set += __builtin_popcountll(nb.level[0][i]);
+        }
+        if (keep & 63) {
+            nb.count_set += __builtin_popcountll(nb.level[0][keep/64] & ~(~0ULL << (keep & 63)));
+        }
+        for (k=0; k<bm->levels; ++k) free(bm->level[k]);
+        free(bm->free_tree);
+    }
+
+    *bm = nb;
+    bitmap_rebuild(bm);
+    return 0;
+}
+
+int bitmap_init(struct bitmap* bm, long long n) {
+    int k;
+    for (k=0; k<bm->levels; ++k) free(bm->level[k]);
+    free(bm->free_tree);
+    memset(bm, 0, sizeof(*bm));
+    return bitmap_setup(bm, n);
+}
+
+int bitmap_resize(struct bitmap* bm, long long n) {
+    return bitmap_setup(bm, n);
+}
+
+long long bitmap_size(const struct bitmap* bm) {
+    return bm->n;
+}
+
+int bitmap_test(const struct bitmap* bm, long long i) {
+    return (bm->level[0][i>>6] >> (i&63)) & 1;
+}
+
+int bitmap_set(struct bitmap* bm, long long i) {
+    int k;
+    uint64_t* w = &bm->level[0][i>>6];
+    uint64_t mask = 1ULL << (i&63);
+    if (*w & mask) return 1;
+    *w |= mask;
+    ++bm->count_set;
+    free_tree_add(bm, i>>6, -1);
+
+    /* the word became full - propagate upwards */
+    for (k=0; k+1<bm->levels && !word_has_clear(k, *w); ++k) {
+        i >>= 6;
+        w = &bm->level[k+1][i>>6];
+        *w &= ~(1ULL << (i&63));
+    }
+    return 0;
+}
+
+int bitmap_clear(struct bitmap* bm, long long i) {
+    int k;
+    uint64_t* w = &bm->level[0][i>>6];
+    uint64_t mask = 1ULL << (i&63);
+    if (!(*w & mask)) return 0;
+    int was_full = !word_has_clear(0, *w);
+    *w &= ~mask;
+    --bm->count_set;
+    free_tree_add(bm, i>>6, 1);
+
+    /* the word was full - propagate upwards */
+    for (k=0; k+1<bm->levels && was_full; ++k) {
+        i >>= 6;
+        w = &bm->level[k+1][i>>6];
+        was_full = !word_has_clear(k+1, *w);
+        *w |= 1ULL << (i&63);
+    }
+    return 1;
+}
+
+long long bitmap_count_set(const struct bitmap* bm) {
+    return bm->count_set;
+}
+
+long long bitmap_count_clear(const struct bitmap* bm) {
+    return bm->n - bm->count_set;
+}
+
+long long bitmap_find_clear(const struct bitmap* bm, long long i) {
+    int k;
+    long long pos;
+    uint64_t w;
+
+    if (i < 0) i = 0;
+    if (i >= bm->n) return -1;
+
+    w = ~bm->level[0][i>>6] & (~0ULL << (i&63));
+    if (w) return (i & ~63LL) + ctz64(w);
+
+    /* look for the next non-full word in the upper levels */
+    pos = (i>>6) + 1;
+    for (k=1; k<bm->levels; ++k) {
+        if (pos >= bm->words[k-1]) return -1;
+        w = bm->level[k][pos>>6] & (~0ULL << (pos&63));
+        if (w) {
+            pos = (pos & ~63LL) + ctz64(w);
+            /* descend to the first non-full word */
+            for (--k; k>0; --k) {
+                pos = pos*64 + ctz64(bm->level[k][pos]);
+            }
+            return pos*64 + ctz64(~bm->level[0][pos]);
+        }
+        pos = (pos>>6) + 1;
+    }
+    return -1;
+}
+
+long long bitmap_find_clear_wrap(const struct bitmap* bm, long long i) {
+    long long r = bitmap_find_clear(bm, i);
+    if (r == -1 && i > 0) r = bitmap_find_clear(bm, 0);
+    return r;
+}
+
+long long bitmap_find_nth_clear(const struct bitmap* bm, long long k) {
+    long long pos = 0;
+    long long step;
+    uint64_t w;
+
+    if (k < 0 || k >= bitmap_count_clear(bm)) return -1;
+
+    /* find the word containing the k-th clear bit */
+    for (step = bm->free_tree_top; step; step >>= 1) {
+        if (pos + step <= bm->words[0] && bm->free_tree[pos + step] <= k) {
+            pos += step;
+            k -= bm->free_tree[pos];
+        }
+    }
+
+    /* then the bit inside that word */
+    w = ~bm->level[0][pos];
+    while (k--) w &= w - 1;
+    return pos*64 + ctz64(w);
+}
+
+int bitmap_mlock(struct bitmap* bm) {
+    int k;
+    int ret = 0;
+    for (k=0; k<bm->levels; ++k) {
+        if (mlock(bm->level[k], bm->words[k]*sizeof(uint64_t))) ret = -1;
+    }
+    if (mlock(bm->free_tree, (bm->words[0]+1)*sizeof(uint32_t))) ret = -1;
+    return ret;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+/*
+    Hierarchical bitmap.
+
+    Level 0 holds one bit per item. Each upper level holds one bit per
+    64-bit word of the level below, set if that word still has a clear bit.
+    The top level is a single word.
+
+    This makes finding the next clear bit O(log64 n) and
+    uses n/8 bytes plus about 1/64 of that for the summary levels.
+
+    A Fenwick tree of clear bit counts per level 0 word (another n/16 bytes)
+    allows picking the k-th clear bit in O(log n), so a uniformly random
+    free block can be chosen at any fill level without probing.
+
+    Used as the block busy map: set - busy, clear - free.
+    Not thread safe, callers do the locking.
+*/
+
+#include <stdint.h>
+
+struct bitmap;
+
+/* Allocate new bitmap structure */
+struct bitmap* bitmap_alloc(void);
+
+/* Initialize the bitmap for n bits, all clear. Returns -1 on failure */
+int bitmap_init(struct bitmap* bm, long long n);
+
+/* Change the number of bits, new bits are clear. Returns -1 on failure */
+int bitmap_resize(struct bitmap* bm, long long n);
+
+/* Free bitmap structure */
+void bitmap_free(struct bitmap* bm);
+
+long long bitmap_size(const struct bitmap* bm);
+
+int bitmap_test(const struct bitmap* bm, long long i);
+
+/* Return the previous value of the bit */
+int bitmap_set(struct bitmap* bm, long long i);
+int bitmap_clear(struct bitmap* bm, long long i);
+
+long long bitmap_count_set(const struct bitmap* bm);
+long long bitmap_count_clear(const struct bitmap* bm);
+
+/* First clear bit at or after i. Returns -1 if there is none */
+long long bitmap_find_clear(const struct bitmap* bm, long long i);
+
+/* First clear bit at or after i, wrapping around to the beginning. Returns -1 if all bits are set */
+long long bitmap_find_clear_wrap(const struct bitmap* bm, long long i);
+
+/* The k-th (counting from 0) clear bit. Returns -1 if there are not that many clear bits */
+long long bitmap_find_nth_clear(const struct bitmap* bm, long long k);
+
+/* Prevent the bitmap from being swapped out. Returns -1 on failure */
+int bitmap_mlock(struct bitmap* bm);
@@ -8,11 +8,13 @@
 #include <sys/stat.h>
 
 #include "block.h"
+#include "bitmap.h"
+#include "uring.h"
 
 
 struct block_level {
     /* 0 - free, 1 - busy */
-    unsigned char* busy_map;
+    struct bitmap* busy_map;
     unsigned long long busy_blocks_count;
     unsigned long long block_count;
     int block_size;
@@ -24,29 +26,26 @@ struct block_level {
     int no_shred;
     int readonly_flag;
     int random_shred_probability; /* from 0 to 1000 */
+    struct uring* ring;
 };
 
 
-static int nearest_power_of_two(int s) {
-    int r=1;
-    while(r<s) r*=2;
-    return r;
-}
-
 struct block_level* block_alloc() {
     struct block_level* bl = (struct block_level*) malloc(sizeof (struct block_level));
     if (!bl) return NULL;
     bl->busy_map = NULL;
     bl->random_file = NULL;
     bl->shred_buffer = NULL;
+    bl->ring = NULL;
     return bl;
 }
 
 void block_free (struct block_level* bl) {
     if(!bl) return;
-    free(bl->busy_map);
+    bitmap_free(bl->busy_map);
     if(bl->random_file) { fclose(bl->random_file); }
     free(bl->shred_buffer);
+    uring_free(bl->ring);
     free(bl);
 }
 
@@ -80,9 +79,18 @@ int block_init (struct block_level* bl,
     }
     
     bl->shred_buffer = (unsigned char*) malloc(bl->block_size);
-    bl->busy_map = (unsigned char*) malloc(bl->block_count);
+    bl->busy_map = bitmap_alloc();
+    if (!bl->shred_buffer || !bl->busy_map || bitmap_init(bl->busy_map, bl->block_count)) {
+        fprintf(stderr, "Can't allocate the busy map\n");
+        return -1;
+    }
     bl->busy_blocks_count = 0;
-    memset(bl->busy_map, 0, bl->block_count);
+    
+    bl->ring = uring_alloc();
+    if (!bl->ring || uring_init(bl->ring, bl->data_fd, BLOCK_QUEUE_DEPTH)) {
+        fprintf(stderr, "Can't set up the I/O queue\n");
+        return -1;
+    }
     
     bl->random_shred_probability=5;
     bl->reserved_percent=5;
@@ -96,8 +104,7 @@ int block_init (struct block_level* bl,
    returns -1 on failure 
 */
 int block_allocate(struct block_level *bl, int privileged_mode) {
-    int i;
-    int index=0;
+    long long free_count;
     
     if (!privileged_mode && bl->busy_blocks_count*100.0 >= 
             bl->block_count*(100.0 - bl->reserved_percent)) {
@@ -105,31 +112,17 @@ int block_allocate(struct block_level *bl, int privileged_mode) {
         return -1; /* out of free space */
     }
     
-    if (bl->busy_blocks_count < bl->block_count - 5) {
-        for (i=0; i<100; ++i) {
-            unsigned long long int rrr;
-            fread(&rrr, sizeof(rrr), 1, bl->random_file);
-            index = rrr % bl->block_count;
-            if (bl->busy_map[index]) continue;
-            bl->busy_map[index] = 1;
-            ++bl->busy_blocks_count;
-            //fprintf(stderr, "Normal: %d\n", index);
-            return index;
-        }
-    } 
-    
-    for(i=index+1; i<bl->block_count; ++i) {
-        if (bl->busy_map[i]) continue;
-        bl->busy_map[i]=1;
-        //fprintf(stderr, "Alt1: %d\n", i);
-        return i;
-    }
-    
-    for(i=0; i<index; ++i) {
-        if (bl->busy_map[i]) continue;
-        bl->busy_map[i]=1;
-        //fprintf(stderr, "Alt2: %d\n", i);
-        return i;        
+    free_count = bitmap_count_clear(bl->busy_map);
+    if (free_count > 0) {
+        /* uniformly random free block, no matter how full the storage is */
+        unsigned long long int rrr;
+        long long index;
+        fread(&rrr, sizeof(rrr), 1, bl->random_file);
+        index = bitmap_find_nth_clear(bl->busy_map, rrr % free_count);
+        bitmap_set(bl->busy_map, index);
+        ++bl->busy_blocks_count;
+        //fprintf(stderr, "Normal: %lld\n", index);
+        return index;
     }
     
     /* No more free blocks at all */
@@ -140,9 +133,8 @@ int block_allocate(struct block_level *bl, int privileged_mode) {
         fprintf(stderr, "Expanding the data file to store the directory\n");
         ++bl->block_count;
         ++bl->busy_blocks_count;
-        int po2 = nearest_power_of_two(bl->block_count);
-        bl->busy_map = realloc(bl->busy_map, po2*sizeof(int));
-        bl->busy_map[bl->block_count-1]=1;
+        bitmap_resize(bl->busy_map, bl->block_count);
+        bitmap_set(bl->busy_map, bl->block_count-1);
         fprintf(stderr, "Emeg: %lld\n", bl->block_count-1);
         return bl->block_count-1;
     }
@@ -152,12 +144,11 @@ int block_allocate(struct block_level *bl, int privileged_mode) {
 }
 
 void block_mark_unused(struct block_level *bl, int i) {
-    if (!bl->busy_map[i]) {
+    if (!bitmap_clear(bl->busy_map, i)) {
         fprintf(stderr, "Freeing not occupied block %d\n", i);
     } else {
         --bl->busy_blocks_count;
     }
-    bl->busy_map[i] = 0;
 }
 
 void block_shred(struct block_level *bl, int i) {
@@ -168,23 +159,14 @@ void block_shred(struct block_level *bl, int i) {
 
 void block_maybe_shred_some_random(struct block_level *bl) {
     unsigned int r;
-    int i;
     if (bl->readonly_flag) return;
     fread(&r, 4, 1, bl->random_file);
     r %= 1000;
     if (r < bl->random_shred_probability) {
-        int target = -1;
+        long long target = -1;
+        long long free_count = bitmap_count_clear(bl->busy_map);
         fread(&r, 4, 1, bl->random_file);
-        r %= bl->block_count;
-        if (!bl->busy_map[r]) target=r;
-        else {
-            for(i=(r+1)%bl->block_count; i != r; i=(i+1)%bl->block_count) {
-                if (!bl->busy_map[i]) { 
-                    target=i;
-                    break;
-                }
-            }
-        }
+        if (free_count > 0) target = bitmap_find_nth_clear(bl->busy_map, r % free_count);
         if (target!= -1) {
             fread(bl->shred_buffer, 1, bl->block_size, bl->random_file);
             block_write(bl, bl->shred_buffer, target);
@@ -193,15 +175,14 @@ void block_maybe_shred_some_random(struct block_level *bl) {
 }
 
 void block_mark_used(struct block_level *bl, int i) {
-    if (bl->busy_map[i]) {
+    if (bitmap_set(bl->busy_map, i)) {
         fprintf(stderr, "Marking the block %d twice\n", i);
     } else {
         ++bl->busy_blocks_count;
     }
-    bl->busy_map[i] = 1;
 }
 
-int block_write(struct block_level *bl, const unsigned char* buffer, int i) {
+static int block_write_ll(struct block_level *bl, const unsigned char* buffer, int i) {
     int fd = bl->data_fd;
     off_t off = i*bl->block_size;
     size_t s = bl->block_size;
@@ -215,6 +196,11 @@ int block_write(struct block_level *bl, const unsigned char* buffer, int i) {
         off+=ret;
         s-=ret;
     }
+    return 1;
+}
+
+int block_write(struct block_level *bl, const unsigned char* buffer, int i) {
+    if (!block_write_ll(bl, buffer, i)) return 0;
     block_maybe_shred_some_random(bl);
     return 1;
 }
@@ -235,3 +221,64 @@ int block_read(struct block_level *bl, unsigned char* buffer, int i) {
     }
     return 1;
 }
+
+int block_register_buffers(struct block_level *bl, unsigned char* buffer, size_t size) {
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = size;
+    return uring_register_buffers(bl->ring, &iov, 1);
+}
+
+int block_submit(struct block_level *bl, struct block_request* reqs, int count) {
+    int i, ret;
+    for (i=0; i<count; ++i) {
+        struct block_request* r = &reqs[i];
+        off_t off = (off_t)r->block * bl->block_size;
+        if (r->write) {
+            ret = uring_queue_write(bl->ring, r->buffer, bl->block_size, off, r);
+        } else {
+            ret = uring_queue_read(bl->ring, r->buffer, bl->block_size, off, r);
+        }
+        if (ret == -1) break;
+    }
+    if (uring_submit(bl->ring) == -1) return -1;
+    return i;
+}
+
+int block_reap(struct block_level *bl, int min_complete) {
+    struct uring_completion c[BLOCK_QUEUE_DEPTH];
+    int i, n;
+    
+    n = uring_reap(bl->ring, c, BLOCK_QUEUE_DEPTH, min_complete);
+    for (i=0; i<n; ++i) {
+        struct block_request* r = (struct block_request*) c[i].tag;
+        if (c[i].result == bl->block_size) {
+            r->result = 1;
+        } else if (r->write) {
+            r->result = block_write_ll(bl, r->buffer, r->block);
+        } else {
+            r->result = block_read(bl, r->buffer, r->block);
+        }
+        if (r->write) block_maybe_shred_some_random(bl);
+    }
+    return n;
+}
+
+int block_io_many(struct block_level *bl, struct block_request* reqs, int count) {
+    int i, submitted = 0;
+    
+    while (submitted < count) {
+        int ret = block_submit(bl, reqs + submitted, count - submitted);
+        if (ret == -1) break;
+        submitted += ret;
+        if (submitted < count && block_reap(bl, 1) == -1) break;
+    }
+    while (uring_pending(bl->ring)) {
+        if (block_reap(bl, 1) == -1) break;
+    }
+    if (submitted < count) return 0;
+    for (i=0; i<count; ++i) {
+        if (!reqs[i].result) return 0;
+    }
+    return 1;
+}
@@ -13,6 +13,8 @@
     5. Read the given block;
     6. Write the given block;
         may also shred some random unused block. Just because.
+    7. Read or write many blocks at once, keeping a deep queue of requests
+        in flight (io_uring when available).
     
     No crypto is working on this level.
     
@@ -52,3 +54,29 @@ void block_maybe_shred_some_random(struct block_level *bl);
 
 int block_write(struct block_level *bl, const unsigned char* buffer, int i);
 int block_read(struct block_level *bl,        unsigned char* buffer, int i);
+
+
+/*
+    Multi-block I/O. Up to BLOCK_QUEUE_DEPTH requests are in flight at once.
+    Requests that fail or come back short are retried synchronously.
+*/
+#define BLOCK_QUEUE_DEPTH 64
+
+struct block_request {
+    int block;
+    unsigned char* buffer;
+    int write;
+    int result; /* set on completion: 1 - success, 0 - failure */
+};
+
+/* Queue the requests and hand them to the kernel. Returns how many were accepted */
+int block_submit(struct block_level *bl, struct block_request* reqs, int count);
+
+/* Wait until at least min_complete submitted requests are finished. Returns the number finished, -1 on failure */
+int block_reap(struct block_level *bl, int min_complete);
+
+/* Do all the requests. Returns 1 if all of them succeeded */
+int block_io_many(struct block_level *bl, struct block_request* reqs, int count);
+
+/* Buffers inside [buffer, buffer+size) will use registered-buffer I/O. Returns -1 on failure */
+int block_register_buffers(struct block_level *bl, unsigned char* buffer, size_t size);
@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+struct uring {
+    int fd;
+    int ring_fd; /* -1 - requests are done synchronously */
+    unsigned entries;
+    unsigned pending;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned sq_local_tail; /* queued, the kernel sees it after uring_submit */
+    unsigned to_submit;
+
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+
+    struct iovec* fixed;
+    int fixed_count;
+
+    struct uring_completion* done; /* synchronous mode completions */
+    int done_count;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+struct uring* uring_alloc() {
+    struct uring* r = (struct uring*) malloc(sizeof(struct uring));
+    if (!r) return NULL;
+    memset(r, 0, sizeof(*r));
+    r->ring_fd = -1;
+    return r;
+}
+
+static void uring_unmap(struct uring* r) {
+    if (r->sqes) munmap(r->sqes, r->sqes_size);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_size);
+    if (r->sq_ptr) munmap(r->sq_ptr, r->sq_size);
+    r->sqes = NULL;
+    r->cq_ptr = r->sq_ptr = NULL;
+    if (r->ring_fd != -1) close(r->ring_fd);
+    r->ring_fd = -1;
+}
+
+/* returns -1 if io_uring can't be used */
+static int uring_setup(struct uring* r) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->ring_fd = sys_io_uring_setup(r->entries, &p);
+    if (r->ring_fd < 0) {
+        r->ring_fd = -1;
+        return -1;
+    }
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+        r->cq_size = r->sq_size;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->ring_fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) { r->sq_ptr = NULL; uring_unmap(r); return -1; }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->ring_fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) { r->cq_ptr = NULL; uring_unmap(r); return -1; }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe*) mmap(NULL, r->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->ring_fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) { r->sqes = NULL; uring_unmap(r); return -1; }
+
+    r->sq_head  = (unsigned*)((char*)r->sq_ptr + p.sq_off.head);
+    r->sq_tail  = (unsigned*)((char*)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask  = (unsigned*)((char*)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)((char*)r->sq_ptr + p.sq_off.array);
+    r->cq_head  = (unsigned*)((char*)r->cq_ptr + p.cq_off.head);
+    r->cq_tail  = (unsigned*)((char*)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask  = (unsigned*)((char*)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe*)((char*)r->cq_ptr + p.cq_off.cqes);
+    r->sq_local_tail = *r->sq_tail;
+    /* the completion queue is at least twice as big, so it can't overflow */
+    r->entries = p.sq_entries;
+    return 0;
+}
+
+int uring_init(struct uring* r, int fd, unsigned entries) {
+    r->fd = fd;
+    r->entries = entries ? entries : 1;
+    r->pending = 0;
+    if (uring_setup(r) == 0) return 0;
+
+    r->done = (struct uring_completion*) malloc(r->entries * sizeof(*r->done));
+    if (!r->done) return -1;
+    r->done_count = 0;
+    return 0;
+}
+
+void uring_free(struct uring* r) {
+    struct uring_completion c[16];
+    if (!r) return;
+    if (r->ring_fd != -1) {
+        /* the kernel may still be using the buffers */
+        uring_submit(r);
+        while (r->pending && uring_reap(r, c, 16, 1) >= 0) {}
+    }
+    uring_unmap(r);
+    free(r->fixed);
+    free(r->done);
+    free(r);
+}
+
+int uring_is_async(const struct uring* r) {
+    return r->ring_fd != -1;
+}
+
+int uring_pending(const struct uring* r) {
+    return r->pending;
+}
+
+int uring_register_buffers(struct uring* r, const struct iovec* iov, int count) {
+    if (r->ring_fd == -1) return -1;
+    if (r->fixed) return -1;
+    if (sys_io_uring_register(r->ring_fd, IORING_REGISTER_BUFFERS, iov, count) < 0) return -1;
+    r->fixed = (struct iovec*) malloc(count * sizeof(*iov));
+    if (!r->fixed) {
+        sys_io_uring_register(r->ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        return -1;
+    }
+    memcpy(r->fixed, iov, count * sizeof(*iov));
+    r->fixed_count = count;
+    return 0;
+}
+
+/* Index of the registered buffer containing [buf, buf+len), -1 if none */
+static int uring_find_fixed(const struct uring* r, const void* buf, size_t len) {
+    int i;
+    for (i=0; i<r->fixed_count; ++i) {
+        const char* base = (const char*) r->fixed[i].iov_base;
+        if ((const char*)buf >= base && (const char*)buf + len <= base + r->fixed[i].iov_len) return i;
+    }
+    return -1;
+}
+
+static struct io_uring_sqe* uring_get_sqe(struct uring* r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_local_tail - head >= r->entries) return NULL;
+    struct io_uring_sqe* sqe = &r->sqes[r->sq_local_tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void uring_commit_sqe(struct uring* r, struct io_uring_sqe* sqe) {
+    unsigned index = sqe - r->sqes;
+    r->sq_array[r->sq_local_tail & *r->sq_mask] = index;
+    ++r->sq_local_tail;
+    ++r->to_submit;
+    ++r->pending;
+}
+
+/* Synchronous mode: does the request right away */
+static int uring_do_sync(struct uring* r, int opcode, void* buf, size_t len, off_t off, void* tag) {
+    ssize_t ret;
+    if (r->pending >= r->entries) return -1;
+    do {
+        switch (opcode) {
+        case IORING_OP_READ:   ret = pread(r->fd, buf, len, off); break;
+        case IORING_OP_WRITE:  ret = pwrite(r->fd, buf, len, off); break;
+        case IORING_OP_READV:  ret = preadv(r->fd, (const struct iovec*)buf, len, off); break;
+        default:               ret = pwritev(r->fd, (const struct iovec*)buf, len, off); break;
+        }
+    } while (ret < 0 && errno == EINTR);
+    r->done[r->done_count].tag = tag;
+    r->done[r->done_count].result = ret < 0 ? -errno : (int)ret;
+    ++r->done_count;
+    ++r->pending;
+    return 0;
+}
+
+static int uring_queue(struct uring* r, int opcode, void* buf, size_t len, off_t off, void* tag) {
+    if (r->ring_fd == -1) return uring_do_sync(r, opcode, buf, len, off, tag);
+    if (r->pending >= r->entries) return -1;
+
+    struct io_uring_sqe* sqe = uring_get_sqe(r);
+    if (!sqe) return -1;
+    sqe->fd = r->fd;
+    sqe->off = off;
+    sqe->addr = (unsigned long) buf;
+    sqe->len = len;
+    sqe->user_data = (unsigned long) tag;
+    if (opcode == IORING_OP_READ || opcode == IORING_OP_WRITE) {
+        int fixed = uring_find_fixed(r, buf, len);
+        if (fixed != -1) {
+            opcode = (opcode == IORING_OP_READ) ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+            sqe->buf_index = fixed;
+        }
+    }
+    sqe->opcode = opcode;
+    uring_commit_sqe(r, sqe);
+    return 0;
+}
+
+int uring_queue_read(struct uring* r, void* buf, size_t len, off_t off, void* tag) {
+    return uring_queue(r, IORING_OP_READ, buf, len, off, tag);
+}
+
+int uring_queue_write(struct uring* r, const void* buf, size_t len, off_t off, void* tag) {
+    return uring_queue(r, IORING_OP_WRITE, (void*)buf, len, off, tag);
+}
+
+/* iov must stay valid until the request is reaped */
+int uring_queue_readv(struct uring* r, const struct iovec* iov, int count, off_t off, void* tag) {
+    return uring_queue(r, IORING_OP_READV, (void*)iov, count, off, tag);
+}
+
+int uring_queue_writev(struct uring* r, const struct iovec* iov, int count, off_t off, void* tag) {
+    return uring_queue(r, IORING_OP_WRITEV, (void*)iov, count, off, tag);
+}
+
+int uring_submit(struct uring* r) {
+    if (r->ring_fd == -1) return 0;
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    while (r->to_submit) {
+        int ret = sys_io_uring_enter(r->ring_fd, r->to_submit, 0, 0);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            perror("io_uring_enter");
+            return -1;
+        }
+        r->to_submit -= ret;
+    }
+    return 0;
+}
+
+int uring_reap(struct uring* r, struct uring_completion* out, int max, int min_wait) {
+    int n = 0;
+    if (r->ring_fd == -1) {
+        n = r->done_count < max ? r->done_count : max;
+        memcpy(out, r->done, n * sizeof(*out));
+        memmove(r->done, r->done + n, (r->done_count - n) * sizeof(*out));
+        r->done_count -= n;
+        r->pending -= n;
+        return n;
+    }
+
+    if ((unsigned) min_wait > r->pending) min_wait = r->pending;
+    if (min_wait > max) min_wait = max;
+    for (;;) {
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail && n < max) {
+            struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+            out[n].tag = (void*)(unsigned long) cqe->user_data;
+            out[n].result = cqe->res;
+            ++n;
+            ++head;
+            --r->pending;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        if (n >= min_wait) return n;
+
+        /* also submits whatever is still queued */
+        __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+        int ret = sys_io_uring_enter(r->ring_fd, r->to_submit, min_wait - n, IORING_ENTER_GETEVENTS);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            perror("io_uring_enter");
+            return n ? n : -1;
+        }
+        r->to_submit -= ret;
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+/*
+    Batched asynchronous reads and writes of one file descriptor.
+
+    Requests are queued with uring_queue_*, handed to the kernel
+    with one uring_submit call and collected with uring_reap.
+    Each request carries a tag that comes back with its completion.
+
+    Uses io_uring directly through system calls. Buffers registered with
+    uring_register_buffers are used with the fixed-buffer operations,
+    which saves mapping the pages on every request (mostly matters for O_DIRECT).
+
+    If io_uring is not available, the requests are done synchronously
+    when queued and the same interface keeps working.
+
+    Not thread safe, use one ring per thread.
+*/
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct uring;
+
+struct uring_completion {
+    void* tag;
+    int result; /* bytes transferred or -errno */
+};
+
+/* Allocate new uring structure */
+struct uring* uring_alloc(void);
+
+/* Initialize for up to entries requests in flight. Returns -1 on failure */
+int uring_init(struct uring* r, int fd, unsigned entries);
+
+/* Free uring structure, waiting for the requests still in flight */
+void uring_free(struct uring* r);
+
+/* Whether requests really go asynchronously through io_uring */
+int uring_is_async(const struct uring* r);
+
+/* Register buffers for the fixed-buffer operations. Returns -1 on failure */
+int uring_register_buffers(struct uring* r, const struct iovec* iov, int count);
+
+/* Queue a request. Returns -1 if the queue is full: submit and reap some first */
+int uring_queue_read(struct uring* r, void* buf, size_t len, off_t off, void* tag);
+int uring_queue_write(struct uring* r, const void* buf, size_t len, off_t off, void* tag);
+int uring_queue_readv(struct uring* r, const struct iovec* iov, int count, off_t off, void* tag);
+int uring_queue_writev(struct uring* r, const struct iovec* iov, int count, off_t off, void* tag);
+
+/* Hand the queued requests to the kernel. Returns -1 on failure */
+int uring_submit(struct uring* r);
+
+/*
+    Collect up to max completions, waiting until there are at least min_wait
+    (or nothing is in flight anymore). Returns the number of completions, -1 on failure
+*/
+int uring_reap(struct uring* r, struct uring_completion* out, int max, int min_wait);
+
+/* Requests queued or submitted and not reaped yet */
+int uring_pending(const struct uring* r);
@@ -54,7 +54,7 @@ echo "BLOCK_SIZE=$BLOCK_SIZE"
 echo "Dummy test"
 setup
 diff -u - <(find m -printf '%y %M %n %s %P %Cs %As %Ts\n') <<\EOF
-d drwxr-x--- 0 0  0 0 0
+d drwxr-x--- 1 0  0 0 0
 EOF
 teardown
 
@@ -63,9 +63,9 @@ setup
 echo qqq > m/qqq
 mkdir m/ddd
 diff -u - <(find m -printf '%y %M %n %s %P %Cs %As %Ts\n') <<\EOF
-d drwxr-x--- 0 0  0 0 0
-f -rwxr-x--- 0 4 qqq 0 0 0
-d drwxr-x--- 0 0 ddd 0 0 0
+d drwxr-x--- 1 0  0 0 0
+f -rwxr-x--- 1 4 qqq 0 0 0
+d drwxr-x--- 1 0 ddd 0 0 0
 EOF
 teardown
 
@@ -76,9 +76,27 @@ mkdir m/ddd
 fusermount -u m
 echo "2test" | ./chaoticfs s m > /dev/null
 diff -u - <(find m -printf '%y %M %n %s %P %Cs %As %Ts\n') <<\EOF
-d drwxr-x--- 0 0  0 0 0
-f -rwxr-x--- 0 4 qqq 0 0 0
-d drwxr-x--- 0 0 ddd 0 0 0
+d drwxr-x--- 1 0  0 0 0
+f -rwxr-x--- 1 4 qqq 0 0 0
+d drwxr-x--- 1 0 ddd 0 0 0
+EOF
+teardown
+
+echo "Directory rename test"
+setup
+mkdir -p m/a/b
+echo qqq > m/a/b/qqq
+mkdir m/c
+mv m/a m/c/
+test ! -e m/a/b/qqq
+fusermount -u m
+echo "2test" | ./chaoticfs s m > /dev/null
+diff -u - <(find m -printf '%y %M %n %s %P %Cs %As %Ts\n') <<\EOF
+d drwxr-x--- 1 0  0 0 0
+d drwxr-x--- 1 0 c 0 0 0
+d drwxr-x--- 1 0 c/a 0 0 0
+d drwxr-x--- 1 0 c/a/b 0 0 0
+f -rwxr-x--- 1 4 c/a/b/qqq 0 0 0
 EOF
 teardown
 
@@ -206,10 +224,166 @@ setup
 echo qqq > m/qqq
 mkdir m/ddd
 diff -u - <(find m -printf '%y %M %n %s %P %F %Cs %As %Ts\n') <<\EOF
-d drwxr-x--- 0 0  fuse.chaoticfs 0 0 0
-f -rwxr-x--- 0 4 qqq fuse.chaoticfs 0 0 0
-d drwxr-x--- 0 0 ddd fuse.chaoticfs 0 0 0
+d drwxr-x--- 1 0  fuse.chaoticfs 0 0 0
+f -rwxr-x--- 1 4 qqq fuse.chaoticfs 0 0 0
+d drwxr-x--- 1 0 ddd fuse.chaoticfs 0 0 0
+EOF
+teardown
+
+echo "Sequential read test"
+dd if=/dev/zero of=s bs=1024 count=10240 2> /dev/null
+mkdir -p m
+echo "2test" | ./chaoticfs s m  > /dev/null 2> /dev/null
+dd if=/dev/urandom of=randomlet bs=1024 count=4000 2> /dev/null
+cp randomlet m/file
+um
+echo "2test" | READAHEAD_MAX_BYTES=262144 ./chaoticfs s m > /dev/null
+cmp randomlet m/file
+dd if=m/file bs=65536 skip=10 2> /dev/null | cmp - <(dd if=randomlet bs=65536 skip=10 2> /dev/null)
+rm randomlet
+teardown
+
+echo "Cache miss after remount test"
+dd if=/dev/zero of=s bs=1024 count=10240 2> /dev/null
+mkdir -p m
+echo "2test" | ./chaoticfs s m  > /dev/null 2> /dev/null
+dd if=/dev/urandom of=randomlet bs=1024 count=2000 2> /dev/null
+cp randomlet m/file
+um
+# the daemon reads single blocks into a small cache itself, after loading the directory before the fork
+echo "2test" | BLOCK_CACHE_SIZE=65536 READAHEAD_THREADS=0 ./chaoticfs s m > /dev/null 2> /dev/null
+for i in 3 77 150 41 249 8 200; do
+    dd if=m/file bs=8192 skip=$i count=1 2> /dev/null | cmp - <(dd if=randomlet bs=8192 skip=$i count=1 2> /dev/null)
+done
+cmp randomlet m/file
+rm randomlet
+teardown
+
+echo "Journal replay test"
+dd if=/dev/zero of=s bs=1024 count=10240 2> /dev/null
+mkdir -p m
+# every close waits for its commit
+echo "2test" | COMMIT_WINDOW_MS=0 ./chaoticfs s m  > /dev/null 2> /dev/null
+dd if=/dev/urandom of=randomlet bs=1024 count=300 2> /dev/null
+cp randomlet m/a
+cp randomlet m/b
+mkdir m/d
+mv m/a m/d/a
+rm m/b
+truncate -s 1000 m/d/a
+cp randomlet m/c # closing the file commits everything above to the journal
+pkill -9 -f 'chaoticfs s m'
+sleep 1
+um
+echo "2test" | ./chaoticfs s m > /dev/null
+diff -u - <(cd m && find . -printf '%y %s /%P\n' | sort) <<\EOF
+d 0 /
+d 0 /d
+f 1000 /d/a
+f 307200 /c
 EOF
+cmp randomlet m/c
+cmp -n 1000 randomlet m/d/a
+rm randomlet
+teardown
+
+echo "Grouped closes test"
+dd if=/dev/zero of=s bs=1024 count=10240 2> /dev/null
+mkdir -p m
+# the closes are committed only as a group of 50 (or by fsync)
+echo "2test" | DIRTY_ALARM=3600 COMMIT_WINDOW_MS=3600000 COMMIT_GROUP_CLOSES=50 ./chaoticfs s m  > /dev/null 2> /dev/null
+for i in {1..50}; do echo "small $i" > m/f$i; done
+sync -d m/f50 # waits for the group commit started by the last close
+pkill -9 -f 'chaoticfs s m'
+sleep 1
+um
+echo "2test" | ./chaoticfs s m > /dev/null
+for i in {1..50}; do test "`cat m/f$i`" == "small $i"; done
+teardown
+
+echo "Fsync test"
+dd if=/dev/zero of=s bs=1024 count=10240 2> /dev/null
+mkdir -p m
+# nothing is committed but by fsync
+echo "2test" | DIRTY_ALARM=3600 COMMIT_WINDOW_MS=3600000 ./chaoticfs s m  > /dev/null 2> /dev/null
+dd if=/dev/urandom of=randomlet bs=1024 count=300 2> /dev/null
+dd if=randomlet of=m/file bs=4096 conv=fsync 2> /dev/null
+pkill -9 -f 'chaoticfs s m'
+sleep 1
+um
+echo "2test" | ./chaoticfs s m > /dev/null
+cmp randomlet m/file
+rm randomlet
+teardown
+
+echo "Lazy block lists test"
+dd if=/dev/zero of=s bs=1024 count=10240 2> /dev/null
+mkdir -p m
+echo "2test" | ./chaoticfs s m  > /dev/null 2> /dev/null
+dd if=/dev/urandom of=randomlet bs=1024 count=300 2> /dev/null
+for i in 1 2 3; do cp randomlet m/file$i; done
+um
+echo "2test" | LAZY_BLOCK_LISTS=y BLOCK_LISTS_MAX_BYTES=0 ./chaoticfs s m > /dev/null
+cmp randomlet m/file1
+mv m/file2 m/file4
+truncate -s 1000 m/file3
+um
+echo "2test" | LAZY_BLOCK_LISTS=y BLOCK_LISTS_MAX_BYTES=0 ./chaoticfs s m > /dev/null
+cmp randomlet m/file1
+cmp randomlet m/file4
+cmp -n 1000 randomlet m/file3
+test `find m/file3 -printf '%s'` == 1000
+rm randomlet
+teardown
+
+echo "Old formats test"
+# made by older versions without encryption: branch 2 is "RndAllV0", branch 7 is "RndAllV1"
+gunzip -c test_old_formats.img.gz > s
+mkdir -p m
+function old_formats_mount() {
+    echo "$1" | BLOCK_SIZE=512 NO_O_DIRECT=y MCRYPT_ALGO=none ./chaoticfs s m > /dev/null 2> /dev/null
+}
+function old_formats_signature() {
+    dd if=s bs=512 skip=$1 count=1 2> /dev/null | head -c 16 | tail -c 8
+}
+# the other branch is listed too, so that its blocks stay untouched
+while read PASSWORDS ROOT V LINES; do
+    old_formats_mount $PASSWORDS
+    seq $LINES | cmp - m/$V/seq
+    test "`cat m/$V/dir/small`" == "small $V"
+    echo new > m/$V/new # the next save converts the directory
+    um
+    test "`old_formats_signature $ROOT`" == "RndAllV2"
+    old_formats_mount $PASSWORDS
+    seq $LINES | cmp - m/$V/seq
+    test "`cat m/$V/dir/small`" == "small $V"
+    test "`cat m/$V/new`" == "new"
+    um
+done <<\EOF
+7,2 2 v0 1000
+2,7 7 v1 2000
+EOF
+rm s
+rmdir m
+
+echo "Multithreaded test"
+export MULTITHREADED=y
+dd if=/dev/zero of=s bs=1024 count=10240 2> /dev/null
+mkdir -p m
+echo "2test" | ./chaoticfs s m  > /dev/null 2> /dev/null
+for i in 1 2 3 4; do
+    dd if=/dev/urandom of=randomlet$i bs=1024 count=300 2> /dev/null
+    cp randomlet$i m/file$i &
+done
+for i in {1..50}; do find m > /dev/null; done
+wait
+um
+echo "2test" | ./chaoticfs s m > /dev/null
+for i in 1 2 3 4; do
+    cmp randomlet$i m/file$i
+    rm randomlet$i
+done
 teardown
+unset MULTITHREADED
 
 echo "All tests finished."